@@ -0,0 +1,40 @@
+--
+-- Benchmark cases run in a single session; see tools/bench.sh. The
+-- repetition count comes from the "reps" psql variable.
+
+\set ON_ERROR_STOP 1
+set client_min_messages = warning;
+
+-- warm up the interpreter and compile everything once
+select pllua_bench.add1(1), pllua_bench.noop(), pllua_bench.spi_rows(1),
+       pllua_bench.numeric_sum(1), pllua_bench.jsonb_rt('{}');
+select count(*) from pllua_bench.srf(1);
+
+select pllua_bench.run('scalar_call',
+  $q$ select sum(pllua_bench.add1(i)) from generate_series(1,100000) i $q$,
+  :reps);
+
+select pllua_bench.run('srf',
+  $q$ select count(*) from pllua_bench.srf(100000) $q$,
+  :reps);
+
+select pllua_bench.run('spi_rows',
+  $q$ select pllua_bench.spi_rows(100000) $q$,
+  :reps);
+
+select pllua_bench.run('array_map',
+  $q$ select array_length(pllua_bench.array_map(a), 1) from pllua_bench.arrays $q$,
+  :reps);
+
+select pllua_bench.run('jsonb_round_trip',
+  $q$ select count(pllua_bench.jsonb_rt(j)) from pllua_bench.docs $q$,
+  :reps);
+
+select pllua_bench.run('trigger_per_row',
+  $q$ insert into pllua_bench.trig_t select i, 'x' from generate_series(1,50000) i $q$,
+  :reps,
+  $q$ truncate pllua_bench.trig_t $q$);
+
+select pllua_bench.run('numeric_arith',
+  $q$ select pllua_bench.numeric_sum(20000) $q$,
+  :reps);
@@ -0,0 +1,13 @@
+--
+-- Interpreter cold start: the time of the first pllua call in a new
+-- session, which includes creating the interpreter unless a prebuilt one
+-- is available (see pllua.prebuilt_interpreters). Run once per session by
+-- tools/bench.sh.
+
+\set ON_ERROR_STOP 1
+
+select clock_timestamp() as t0 \gset
+select pllua_bench.noop();
+insert into pllua_bench.samples
+  values ('cold_start',
+          extract(epoch from clock_timestamp() - :'t0'::timestamptz) * 1000);
@@ -0,0 +1,130 @@
+--
+-- Setup for the benchmark suite; see tools/bench.sh.
+--
+-- run(name, query, reps, reset) executes the query reps times, recording
+-- the elapsed time of each execution in samples. The reset query, if
+-- given, is run untimed before each execution.
+
+\set ON_ERROR_STOP 1
+set client_min_messages = warning;
+
+create extension if not exists pllua;
+
+drop schema if exists pllua_bench cascade;
+create schema pllua_bench;
+
+create table pllua_bench.samples (
+  name text not null,
+  ms float8 not null
+);
+
+create table pllua_bench.baseline (
+  name text primary key,
+  samples integer,
+  min_ms float8,
+  median_ms float8,
+  max_ms float8
+);
+
+create function pllua_bench.run(name text, query text, reps integer,
+                                reset text default null)
+  returns void language plpgsql
+  as $f$
+    declare
+      t0 timestamptz;
+    begin
+      for i in 1..reps loop
+        if reset is not null then
+          execute reset;
+        end if;
+        t0 := clock_timestamp();
+        execute query;
+        insert into pllua_bench.samples
+          values (name, extract(epoch from clock_timestamp() - t0) * 1000);
+      end loop;
+    end;
+  $f$;
+
+create function pllua_bench.report(out name text, out samples integer,
+                                   out min_ms float8, out median_ms float8,
+                                   out max_ms float8)
+  returns setof record language sql
+  as $f$
+    select name, count(*)::integer, min(ms),
+           percentile_cont(0.5) within group (order by ms), max(ms)
+      from pllua_bench.samples
+     group by name
+     order by name;
+  $f$;
+
+create function pllua_bench.compare(out name text, out median_ms float8,
+                                    out baseline_ms float8, out ratio float8)
+  returns setof record language sql
+  as $f$
+    select r.name, r.median_ms, b.median_ms,
+           round((r.median_ms / nullif(b.median_ms, 0))::numeric, 3)::float8
+      from pllua_bench.report() r
+           left join pllua_bench.baseline b on (b.name = r.name)
+     order by r.name;
+  $f$;
+
+-- functions under test
+
+create function pllua_bench.add1(a integer) returns integer
+  language pllua immutable
+  as $$ return a + 1 $$;
+
+create function pllua_bench.srf(n integer) returns setof integer
+  language pllua
+  as $$ for i = 1,n do coroutine.yield(i) end $$;
+
+create function pllua_bench.spi_rows(n integer) returns bigint
+  language pllua
+  as $$
+    local s = 0
+    for r in spi.rows([[select i from generate_series(1,$1::integer) i]], n) do
+      s = s + r.i
+    end
+    return s
+  $$;
+
+create function pllua_bench.array_map(a integer[]) returns integer[]
+  language pllua
+  as $$ return a{ map = function(e) return e * 2 end } $$;
+
+create function pllua_bench.jsonb_rt(j jsonb) returns jsonb
+  language pllua
+  as $$ return pgtype.jsonb(j{}) $$;
+
+create function pllua_bench.numeric_sum(n integer) returns numeric
+  language pllua
+  as $$
+    local s = pgtype.numeric(0)
+    for i = 1,n do s = s + pgtype.numeric(i) / 7 end
+    return s
+  $$;
+
+create function pllua_bench.noop() returns integer
+  language pllua
+  as $$ return 1 $$;
+
+create function pllua_bench.trig() returns trigger
+  language pllua
+  as $$ new.n = new.id * 2 $$;
+
+create table pllua_bench.trig_t (id integer, v text, n integer);
+create trigger trig_t_before before insert on pllua_bench.trig_t
+  for each row execute procedure pllua_bench.trig();
+
+create table pllua_bench.arrays as
+  select array(select generate_series(1,100000)) as a;
+
+create table pllua_bench.docs as
+  select jsonb_build_object('id', i, 'name', 'item ' || i,
+                            'tags', jsonb_build_array('a', 'b', i),
+                            'attrs', jsonb_build_object('x', i * 1.5, 'y', true))
+         as j
+    from generate_series(1,10000) i;
+
+analyze pllua_bench.arrays;
+analyze pllua_bench.docs;
@@ -105,6 +105,88 @@ hstore_to_pllua_real(lua_State *L)
 	return 1;
 }
 
+/*
+ * Fast path of pllua_to_hstore_real for a plain table: fill the Pairs array
+ * directly from the table. Keys and values that are already strings are
+ * kept alive by the source table, which is therefore referenced from the
+ * Pairs userdata; strings made by converting other values are stored in the
+ * table at index 2, which is also referenced, to keep them from being GC'd.
+ *
+ * Stack on entry: 1 = table, 2 = empty table, 3 = unused
+ */
+static int
+pllua_to_hstore_table(lua_State *L)
+{
+	Pairs	   *pairs;
+	int			pcount = 0;
+	int			idx = 0;
+	int			nstrings = 0;
+
+	lua_settop(L, 3);
+
+	lua_pushnil(L);
+	while (lua_next(L, 1))
+	{
+		++pcount;
+		lua_pop(L, 1);
+	}
+
+	lua_pushinteger(L, pcount);  /* first result, fixed up below */
+	pairs = lua_newuserdata(L, (pcount ? pcount : 1) * sizeof(Pairs));
+	lua_newtable(L);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "table");
+	lua_pushvalue(L, 2);
+	lua_setfield(L, -2, "strings");
+	lua_setuservalue(L, -2);
+
+	lua_pushnil(L);
+	while (lua_next(L, 1))
+	{
+		if (idx >= pcount)
+			luaL_error(L, "table modified during conversion to hstore");
+
+		pairs[idx].needfree = false;
+
+		if (lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+		{
+			pairs[idx].val = NULL;
+			pairs[idx].vallen = 0;
+			pairs[idx].isnull = true;
+		}
+		else
+		{
+			if (lua_type(L, -1) == LUA_TSTRING)
+				pairs[idx].val = (char *) lua_tolstring(L, -1, &(pairs[idx].vallen));
+			else
+			{
+				pairs[idx].val = (char *) luaL_tolstring(L, -1, &(pairs[idx].vallen));
+				lua_rawseti(L, 2, ++nstrings);
+			}
+			pairs[idx].isnull = false;
+		}
+
+		/*
+		 * must not use lua_tolstring on a non-string key, it would confuse
+		 * lua_next
+		 */
+		if (lua_type(L, -2) == LUA_TSTRING)
+			pairs[idx].key = (char *) lua_tolstring(L, -2, &(pairs[idx].keylen));
+		else
+		{
+			pairs[idx].key = (char *) luaL_tolstring(L, -2, &(pairs[idx].keylen));
+			lua_rawseti(L, 2, ++nstrings);
+		}
+
+		lua_pop(L, 1);
+		++idx;
+	}
+
+	lua_pushinteger(L, idx);
+	lua_replace(L, 4);
+	return 2;
+}
+
 /*
  * equivalent to:
  *
@@ -112,6 +194,7 @@ hstore_to_pllua_real(lua_State *L)
  *  for k,v in pairs(hs) do keys[#keys+1] = k vals[#vals+1] = v end
  *  then makes a full userdata with a Pairs array and refs to keys,vals
  *
+ * (but see pllua_to_hstore_table for the usual case of a plain table)
  */
 static int
 pllua_to_hstore_real(lua_State *L)
@@ -147,6 +230,9 @@ pllua_to_hstore_real(lua_State *L)
 		return 2;
 	}
 
+	if (!metaloop)
+		return pllua_to_hstore_table(L);
+
 	while (metaloop ? pllua_pairs_next(L) : lua_next(L, 1))
 	{
 		++idx;
@@ -243,9 +329,11 @@ pllua_to_hstore(PG_FUNCTION_ARGS)
 
 	/*
 	 * this ptr is the Pairs struct as a Lua full userdata, which carries
-	 * refs to the tables holding the keys and values strings to prevent
-	 * them being GC'd. hstorePairs will copy everything into a new palloc'd
-	 * value, and the storage will be GC'd sometime later after we pop it.
+	 * refs to whatever holds the key and value strings (the keys and vals
+	 * tables, or for a plain table the source table and a table of
+	 * converted strings) to prevent them being GC'd. hstorePairs will copy
+	 * everything into a new palloc'd value, and the storage will be GC'd
+	 * sometime later after we pop it.
 	 */
 	pcount = lua_tointeger(L, -2);
 	pairs = lua_touserdata(L, -1);
@@ -257,7 +345,7 @@ pllua_to_hstore(PG_FUNCTION_ARGS)
 		for (i = 0; i < pcount; ++i)
 		{
 			pairs[i].keylen = hstoreCheckKeyLen(pairs[i].keylen);
-			pairs[i].vallen = hstoreCheckKeyLen(pairs[i].vallen);
+			pairs[i].vallen = hstoreCheckValLen(pairs[i].vallen);
 			pg_verifymbstr(pairs[i].key, pairs[i].keylen, false);
 			pg_verifymbstr(pairs[i].val, pairs[i].vallen, false);
 		}
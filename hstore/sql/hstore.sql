@@ -36,4 +36,13 @@ do language pllua $$
   print(pgtype.hstore(function() end))
 $$;
 
+do language pllua $$
+  -- non-string keys and values, and false for null
+  local hs = pgtype.hstore({ [1] = 2, a = true, b = false, c = 1.5 })
+  print(hs)
+  local res = (spi.execute([[select $1 as hs]], hs))[1]
+  print(res.hs["1"], res.hs.a, res.hs.b, res.hs.c)
+  print(pgtype.hstore({}))
+$$;
+
 --end
@@ -215,4 +215,34 @@ create function pg_temp.af10() returns acomp1[] language pllua
 $$;
 select pg_temp.af10();
 
+-- array kernels
+do language pllua $$
+  local a = pgtype.array.float8({1.5, 2.25, nil, -4.5, 0.5}, 5)
+  local b = pgtype.array.integer(3, 1, 2, nil, 7)
+  local m = pgtype.array.float8({{1.5,2.5},{3.5,4.75}}, 2, 2)
+  print(a:sum(), a:min(), a:max(), b:sum(), b:min(), b:max())
+  print(a:dot(b), pgtype.array.integer():sum())
+  print(a:add(1), a:mul(2), b:mul(-2))
+  print(m:mul(0.5), m:sum())
+  print(b:filter{true,false,true,true},
+        b:filter(pgtype.array.boolean(false,true,nil,false,true)))
+  local p = b:filter{true,true,true,false,true}:pack()
+  print(#p, pgtype.array.integer:frompacked(p))
+  print(pcall(b.pack, b))
+  local s = pgtype.array.smallint(30000, 1)
+  print(pcall(s.add, s, 10000))
+$$;
+
+-- array views
+do language pllua $$
+  local a = pgtype.array.float8({1.5, nil, 3.25}, 3)
+  local v = a:view()
+  print(#v, v[1], v[2], v[3], v[4], v:ptr())
+  for i,x in pairs(v) do print(i,x) end
+  a[2] = 2.5
+  print(v[2], a[2])
+  local b = pgtype.array.bigint({{1,2},{3,4}}, 2, 2):view()
+  print(#b, b[4], b:ptr() ~= nil)
+$$;
+
 --
@@ -314,6 +314,18 @@ do language pllua $$
   end
 $$;
 
+do language pllua $$
+  local t = pgtype.timestamptz('2019-06-30 23:30:00.5+00')
+  print(t.year, t.month, t.day, t.hour, t.minute, t.second, t.isodow)
+  spi.execute("set timezone = 'Asia/Tokyo'")
+  print(t.year, t.month, t.day, t.hour, t.minute, t.second, t.isodow)
+  spi.execute("set timezone = 'UTC'")
+  local d = pgtype.date('0044-03-15 BC')
+  print(d.year, d.month, d.day, d.dow, d.isodow, d.doy)
+  print(pgtype.timestamp{ year=2019, month=4, day=22, hour=12, min=23, sec=34.25 })
+  print(pgtype.timestamp{ year=2019, month=4, day=22, hour=12, min=23, sec=34, msec=1.5 })
+$$;
+
 -- errors (not worth testing many combinations, they all share a code path)
 do language pllua $$ print(pgtype.time('03:45:01.234567').dow) $$;
 
@@ -118,4 +118,38 @@ do language pllua $$
   print(j_out)
 $$;
 
+-- incremental builder
+
+do language pllua $$
+  local jsonb = require 'pllua.jsonb'
+  local b = jsonb.builder()
+  b:begin_object()
+  b:key("a"):value(1)
+  b:key("b"):begin_array()
+  for i = 1,3 do b:value(i) end
+  b:value(1.5):value(nil):value(true):value("x")
+  b:end_array()
+  b:key("c"):value({ d = "e" })
+  b:key("f"):begin_object():end_object()
+  b:end_object()
+  print(b:result())
+  local s = jsonb.builder():value("scalar"):result()
+  print(s, jsonb.type(s))
+  print(pcall(function() jsonb.builder():begin_object():value(1) end))
+  print(pcall(function() jsonb.builder():begin_array():end_object() end))
+$$;
+
+-- lazy views
+
+do language pllua $$
+  local jsonb = require 'pllua.jsonb'
+  local v = jsonb.view(pgtype.jsonb('{"a":1,"b":[10,"x",{"c":true}],"d":null,"e":"str"}'))
+  print(v.a, v.e, v.d, v.missing, #v)
+  local b = v.b
+  print(#b, b[0], b[1], b[2].c, b[3], b[-1])
+  print(b[2], v)
+  for k,val in pairs(b) do print(k, val) end
+  print(jsonb.view(pgtype.jsonb('"scalar"')))
+$$;
+
 --end
@@ -90,6 +90,25 @@ do language pllua $$
   print(pi())
 $$;
 
+-- accumulators
+
+do language pllua $$
+  local num = require 'pllua.numeric'
+  local acc = num.accum()
+  for i = 1,1000 do acc:add(i) end
+  print(acc:value(), acc)
+  acc:add(num.maxinteger, num.maxinteger):sub(num.maxinteger * 2)
+  print(acc:value())
+  acc:reset('1.5'):mul(2, '0.25'):add(0.125)
+  print(acc:value())
+  local a2 = pgtype.numeric('10.01'):accum()
+  local big = num.maxinteger:tointeger()
+  a2:add(big):add(1):sub(big)
+  print(a2)
+  print(pcall(function() return acc:div(0) end))
+  print(acc)
+$$;
+
 -- check sanity of maxinteger/mininteger
 
 do language pllua $$
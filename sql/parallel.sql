@@ -0,0 +1,56 @@
+--
+
+\set VERBOSITY terse
+
+--
+
+-- Test of functions running in parallel workers (pg10+).
+
+create table ptest as select i from generate_series(1,10000) i;
+analyze ptest;
+
+create function pl_pred(i integer) returns boolean
+  language pllua immutable parallel safe
+  as $$ return i % 7 = 0 $$;
+
+create function pl_pcall(i integer) returns boolean
+  language pllua immutable parallel safe
+  as $$
+    local ok, err = pcall(error, "caught")
+    return not ok and err == "caught" and i % 7 = 0
+  $$;
+
+create function pl_spi(i integer) returns integer
+  language pllua stable parallel safe
+  as $$ return spi.execute([[select $1::integer + 1 as n]], i)[1].n $$;
+
+create function pl_worker() returns boolean
+  language pllua stable parallel safe
+  as $$ return _PL_PARALLEL_WORKER $$;
+
+set parallel_setup_cost = 0;
+set parallel_tuple_cost = 0;
+set min_parallel_table_scan_size = 0;
+set max_parallel_workers_per_gather = 2;
+
+select count(*) from ptest where pl_pred(i);
+select count(*) from ptest where pl_pcall(i);
+select sum(pl_spi(i)) from ptest;
+
+-- force_parallel_mode was renamed in pg16
+select case when current_setting('server_version_num')::integer >= 160000
+            then 'debug_parallel_query' else 'force_parallel_mode' end
+       as force_parallel \gset
+
+select pl_worker();
+set :force_parallel = on;
+select pl_worker();
+select pl_spi(41);
+
+reset :force_parallel;
+reset max_parallel_workers_per_gather;
+reset min_parallel_table_scan_size;
+reset parallel_tuple_cost;
+reset parallel_setup_cost;
+
+--end
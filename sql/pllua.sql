@@ -181,4 +181,179 @@ do language pllua $$
   print((lpcall(require,"io")))
 $$;
 
+-- interpreter memory stats
+do language pllua $$
+  local stats = require 'pllua.stats'
+  local m = stats.memory()
+  print(type(m.in_use), m.peak >= m.in_use, type(m.slab))
+$$;
+do language pllua $$
+  local stats = require 'pllua.stats'
+  local function cur()
+    for _,s in ipairs(stats.interpreters()) do
+      if s.current then return s end
+    end
+  end
+  local s = cur()
+  print(s.trusted, s.heap > 0, s.typeinfos > 0, type(s.functions), type(s.statements))
+  print(s.context_bytes == nil or s.context_bytes > s.error_context_bytes)
+  local t = {}
+  for i = 1,10 do t[i] = pgtype.numeric(i) end
+  print(cur().datums - s.datums >= 10)
+  local p = stats.pool()
+  print(p.hits > 0, p.held_used + p.created > 0, type(p.held))
+$$;
+
+-- adaptive gc
+set pllua.adaptive_gc = on;
+do language pllua $$
+  local r = spi.execute([[select repeat('x',100000) as t from generate_series(1,10)]])
+$$;
+do language pllua $$
+  local g = require('pllua.stats').gc()
+  print(g.runs > 0, type(g.time), g.ratio >= 0)
+$$;
+reset pllua.adaptive_gc;
+
+-- function profiler
+set pllua.profile = on;
+set pllua.profile_lines = on;
+create function pg_temp.prof1(n integer) returns integer language pllua as $$
+  local s = 0
+  for i = 1,n do s = s + i end
+  return s
+$$;
+select sum(pg_temp.prof1(i)) from generate_series(1,10) i;
+do language pllua $$
+  local stats = require 'pllua.stats'
+  local oid = spi.execute([[select 'pg_temp.prof1(integer)'::regprocedure::oid as o]])[1].o
+  local f = stats.functions()[oid]
+  print(f.calls, f.total_time >= f.self_time, type(f.spi_time), f.datums >= 0)
+  local hits = 0
+  for _,l in ipairs(stats.lines()) do
+    if l.source:match("prof1") then hits = hits + l.hits end
+  end
+  print(hits > 10)
+  stats.reset_profile()
+  print(stats.functions()[oid], #stats.lines())
+$$;
+reset pllua.profile_lines;
+reset pllua.profile;
+
+-- memory limit
+set pllua.max_memory = '16MB';
+do language pllua $$
+  local ok = pcall(function() local t = {} for i = 1,1e7 do t[i] = i end end)
+  print(ok)
+$$;
+reset pllua.max_memory;
+
+-- direct scalar path for simple-typed functions
+create function pg_temp.fs1(a integer, b text, c float8, d boolean)
+  returns text language pllua
+  as $$ return string.format("%s:%s:%s:%s", a, b, c, d) $$;
+select pg_temp.fs1(i, 'x'||i, i + 0.5::float8, i%2 = 0) from generate_series(1,3) i;
+select pg_temp.fs1(null, null, null, null);
+create function pg_temp.fs2(a integer) returns integer language pllua
+  as $$ if a > 1 then return tostring(a * 10) end return a $$;
+select pg_temp.fs2(i) from generate_series(0,3) i;
+create function pg_temp.fs3(a bigint, b boolean) returns float8 language pllua
+  as $$ if b then return a end return nil $$;
+select pg_temp.fs3(i, i <> 2) from generate_series(1,3) i;
+
+
+-- materialize-mode SRFs
+set pllua.materialize_srf = on;
+select * from pg_temp.f11(1);
+select * from pg_temp.f11b(1);
+select * from pg_temp.f12(1);
+select * from pg_temp.f13(4);
+select * from pg_temp.f14(4);
+select * from pg_temp.f16c(3);
+select count(*), sum(y) from pg_temp.f15(10000);
+select pg_temp.f13(2);
+-- a final return after yields ends the set without adding a row
+create function pg_temp.f17(a integer) returns setof integer language pllua
+  as $$ for i = 1,a do coroutine.yield(i) end return -1 $$;
+select * from pg_temp.f17(2);
+reset pllua.materialize_srf;
+select * from pg_temp.f17(2);
+
+
+-- pllua.prewarm_functions applies to interpreters set up later, so use a
+-- new role to get a new trusted interpreter. pw1 prints when compiled, so
+-- the call after prewarming must not print again; pg_temp.f2 is plluau and
+-- is skipped.
+create role regress_pllua_prewarm;
+set check_function_bodies = off;
+create function pg_temp.pw1() returns text language pllua
+  as $$ return "pw1" end do print("compiling pw1") $$;
+create function pg_temp.pw2() returns text language pllua
+  as $$ return "pw2" end do spi.error("pw2 does not compile") $$;
+reset check_function_bodies;
+set pllua.prewarm_functions = 'pg_temp.pw1, pllua_no_such_function, pg_temp.pw2(), pg_temp.f2';
+set role regress_pllua_prewarm;
+select pg_temp.pw1();
+reset role;
+reset pllua.prewarm_functions;
+drop role regress_pllua_prewarm;
+
+-- pllua.bytecode_cache_dir, using a new temp directory. Replacing the
+-- function must give a new cache entry rather than the old bytecode.
+-- cachefiles itself is compiled with the cache enabled, so it has an
+-- entry too.
+do language plluau $$
+  local d = os.tmpname()
+  os.remove(d)
+  os.execute("mkdir -m 700 " .. d)
+  _G.cachedir = d
+  spi.execute("select set_config('pllua.bytecode_cache_dir', $1, false)", d)
+$$;
+create function pg_temp.cachefiles(pat text) returns text language plluau as $$
+  local n, priv = 0, 0
+  local p = io.popen("ls -l " .. _G.cachedir)
+  for line in p:lines() do
+    if line:match(pat) then
+      n = n + 1
+      if line:match("^%-rw%-%-%-%-%-%-%-") then priv = priv + 1 end
+    end
+  end
+  p:close()
+  return n .. " files, " .. priv .. " private"
+$$;
+create function pg_temp.bc1() returns text language pllua as $$ return "bc1 v1" $$;
+select pg_temp.bc1();
+select pg_temp.cachefiles('pllua_%d.*%.luac$');
+create or replace function pg_temp.bc1() returns text language pllua as $$ return "bc1 v2" $$;
+select pg_temp.bc1();
+select pg_temp.cachefiles('pllua_%d.*%.luac$');
+
+-- modules found by require() on package.path are cached too; requiring
+-- the module again goes through the searcher and finds the same entry,
+-- while a changed source gets a new one.
+do language plluau $$
+  local d = _G.cachedir .. "/mods"
+  local function put(src)
+    local f = assert(io.open(d .. "/pllua_cachemod.lua", "w"))
+    f:write(src)
+    f:close()
+    package.loaded.pllua_cachemod = nil
+  end
+  os.execute("mkdir " .. d)
+  local oldpath = package.path
+  package.path = d .. "/?.lua;" .. oldpath
+  put("return { v = 1 }")
+  print(require("pllua_cachemod").v)
+  package.loaded.pllua_cachemod = nil
+  print(require("pllua_cachemod").v)
+  print(spi.execute("select pg_temp.cachefiles('pllua_mod_.*%.luac$') as f")[1].f)
+  put("return { v = 2 }")
+  print(require("pllua_cachemod").v)
+  print(spi.execute("select pg_temp.cachefiles('pllua_mod_.*%.luac$') as f")[1].f)
+  package.path = oldpath
+  package.loaded.pllua_cachemod = nil
+$$;
+reset pllua.bytecode_cache_dir;
+do language plluau $$ os.execute("rm -r " .. _G.cachedir) $$;
+
 --end
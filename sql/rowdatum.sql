@@ -181,4 +181,14 @@ do language pllua $$
   print(r) print(pgtype.ntab4(r))
 $$;
 
+-- lazy column access followed by full deform
+do language pllua $$
+  local r = spi.execute([[ select 1 as a, null::text as b, 'foo'::text as c,
+                                  2.5::float8 as d, row(1,'x') as e ]])[1]
+  print(r.d, r.b, r.c)
+  local e = r.e
+  print(e.f2, r.e == e)
+  print(r)
+$$;
+
 --end
@@ -179,6 +179,71 @@ do language pllua $$
   print(#r1)
 $$;
 
+-- check execute_columnar
+do language pllua $$
+  local cols, n = spi.execute_columnar([[
+    select i, 'r'||i as t, i*1.5::float8 as f,
+           case when i%2=0 then null else i end as h, array[i] as a
+      from generate_series(1,3) i ]])
+  print(n, cols.i[3], cols.t[2], cols.f[1], cols.h[2], cols.a[3], cols[1] == cols.i)
+  local s = spi.prepare([[ select * from generate_series($1::integer,$2) i ]], {"integer","integer"})
+  cols, n = s:execute_columnar(1,5)
+  print(n, #cols.i, cols.i[5])
+$$;
+
+-- plan cache for query strings
+create temp table pc_tab(a integer);
+insert into pc_tab values (1);
+create function pc_get() returns text language pllua as $$
+  local r
+  for i = 1,3 do r = spi.execute("select * from pc_tab") end
+  return tostring(r[1])
+$$;
+select pc_get();
+alter table pc_tab add column b text default 'x';
+select pc_get();
+
+-- execute_many
+create temp table em_tab(a integer, b text);
+do language pllua $$
+  local s = spi.prepare([[ insert into em_tab values ($1,$2) ]], {"integer","text"})
+  print(s:execute_many({ {1,'a'}, {2,'b'}, {3, nil, n = 2} }))
+  print(spi.execute_many([[ update em_tab set b = $2 where a = $1 ]], { {1,'x'}, {3,'z'} }))
+  print(s:execute_many({}))
+  print(pcall(function() return s:execute_many({ {4,'d'}, {5} }) end))
+  print(pcall(spi.execute_many, [[ select $1::integer ]], { {4}, {5,'e'} }))
+$$;
+select * from em_tab order by a;
+
+-- rows() iterator with adaptive fetch size
+do language pllua $$
+  local sum, n = 0, 0
+  for r in spi.rows([[ select i from generate_series(1,20000) i ]]) do
+    sum = sum + r.i
+    n = n + 1
+  end
+  print(n, sum)
+$$;
+
+-- copy_in / copy_out
+create temp table ci_tab(a integer, b text, c numeric);
+do language pllua $$
+  print(spi.copy_in("ci_tab", {"a","b"}, { {1,'x'}, {2,'y'}, {3} }))
+  print(spi.copy_in("ci_tab", nil, spi.rows([[ select i as a, 'r'||i as b, i*1.5 as c
+                                                   from generate_series(4,2503) i ]])))
+  print(spi.copy_in("ci_tab", {"a"}, {}))
+$$;
+select count(*), sum(a), count(b), sum(c) from ci_tab;
+create temp table ci_arr(a integer, d integer[]);
+do language pllua $$
+  print(pcall(spi.copy_in, "ci_arr", nil, { {1, {1,2}} }))
+$$;
+do language pllua $$
+  local sum = 0
+  print(spi.copy_out([[ select a from ci_tab where a <= $1 ]], function(r) sum = sum + r.a end, 10), sum)
+  print(spi.copy_out([[ select a from ci_tab order by a ]], function(r) return r.a < 5 end))
+$$;
+
 -- cursors as parameters and return values
 
 create function do_fetch(c refcursor) returns void language pllua as $$
@@ -206,4 +271,34 @@ do language pllua $$ collectgarbage() $$;  -- check cursor stays open
 fetch all from mycur2;
 commit;
 
+-- function handles
+
+do language pllua $$
+  local lower = spi.func("lower(text)")
+  print(lower("FooBar"), lower(nil))
+  local add = spi.func("int4pl(integer,integer)")
+  local s = 0
+  for i = 1,1000 do s = add(s, i) end
+  print(s)
+  local nadd = spi.func("numeric_add(numeric,numeric)")
+  print(nadd(1.5, 2), nadd("1.25", nadd(0.25, 1)))
+  local tl = spi.func("text_larger(text,text)")
+  print(tl("abc", "abd"), tl("zz", "a"))
+  local oid = spi.execute([[ select 'upper(text)'::regprocedure::oid as o ]])[1].o
+  print(spi.func(oid)("abc"), tostring(spi.func(oid)))
+  print(pcall(spi.func, "generate_series(integer,integer)"))
+  print(pcall(lower, "a", "b"))
+$$;
+
+-- recursion through the handle the function was called from
+create function func_rec(n integer, s text) returns text language pllua as $$
+  if n <= 1 then return s end
+  return _G.rec_handle(n - 1, s .. n) .. ":" .. s
+$$;
+do language pllua $$
+  _G.rec_handle = spi.func("func_rec(integer,text)")
+  print(_G.rec_handle(4, "x"), _G.rec_handle(2, "y"))
+  _G.rec_handle = nil
+$$;
+
 --end
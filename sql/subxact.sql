@@ -145,4 +145,39 @@ do language pllua $$
   print(err.type(e), err.category(e), err.errcode(e), e)
 $$;
 
+-- subxacts are only started when the protected code touches the db
+
+truncate table xatst;
+
+do language pllua $$
+  local stmt = spi.prepare([[ insert into xatst values ($1) ]]);
+  stmt:execute(1);
+  local n = 0
+  for i = 1,1000 do
+    if not pcall(error, "x") then n = n + 1 end
+  end
+  print(n)
+  print(pcall(function()
+                local ok = pcall(function() stmt:execute(2) end)
+                stmt:execute(3)
+                return ok
+              end))
+  stmt:execute(4);
+$$;
+
+-- should now be three different xids in xatst, and 4 rows
+select count(*), count(distinct age(xmin)) from xatst;
+
+-- PG errors thrown directly inside a pcall must still roll back properly
+
+truncate table xatst;
+
+do language pllua $$
+  print(pcall(spi.error, "boom"))
+  print(pcall(function() error("lua") end))
+  spi.execute([[ insert into xatst values (1) ]])
+  print(pcall(function() spi.execute([[ insert into xatst values (2) ]]) spi.error("again") end))
+  print(spi.execute([[ select count(*) as n from xatst ]])[1].n)
+$$;
+
 --end
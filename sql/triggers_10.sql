@@ -66,4 +66,40 @@ insert into trigtst2
 update trigtst2 set qty = qty + 1;
 delete from trigtst2 where name = 'sheila';
 
+
+create function ttrig4() returns trigger language pllua
+as $$
+  local n = 0
+  for r in trigger.new_table:rows() do
+    n = n + r.qty
+  end
+  print(trigger.name, #trigger.new_table, #trigger.old_table, n)
+  for b in trigger.old_table:batches(4) do
+    local ids = {}
+    for i,r in ipairs(b) do ids[i] = r.id end
+    print(#b, table.concat(ids,","))
+  end
+  print(trigger.new)
+$$;
+
+create trigger t4
+  after update on trigtst2
+  referencing old table as oldtab
+              new table as newtab
+  for each statement
+  execute procedure ttrig4();
+
+update trigtst2 set qty = qty + 1;
+
+--
+
+-- spi.copy_in skips identity "always" columns when no column list is given
+
+create temp table ci_ident (id integer generated always as identity,
+                            a integer, b text);
+do language pllua $$
+  print(spi.copy_in("ci_ident", nil, { {1,'x'}, {2,'y'} }))
+$$;
+select * from ci_ident order by id;
+
 --
@@ -202,4 +202,12 @@ do language pllua $$
   print(pgtype.ctype3(1,2))
 $$;
 
+-- cached result/argument typeinfos must see type changes
+create type ctype4 as (a integer, b text);
+create function pg_temp.tc4(x ctype4) returns ctype4 language pllua
+  as $$ return { a = x.a + 1, b = x.b, c = 'zot' } $$;
+select pg_temp.tc4(row(i,'foo')) from generate_series(1,3) i;
+alter type ctype4 add attribute c text;
+select pg_temp.tc4(row(1,'foo','bar'));
+
 --end
@@ -2,6 +2,7 @@
 #include "pllua.h"
 
 #include "access/htup_details.h"
+#include "access/xlog.h"
 #include "catalog/pg_proc.h"
 #include "catalog/pg_language.h"
 #include "catalog/pg_type.h"
@@ -10,6 +11,9 @@
 #include "utils/syscache.h"
 #include "utils/lsyscache.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
 
 /*
  * Do fairly minimalist validation on the procTup to ensure that we're not
@@ -76,31 +80,17 @@ pllua_compile_inline(lua_State *L, const char *str, bool trusted)
 }
 
 /*
- * Given a comp_info containing the info we need, compile a function and make
- * an object for it. However, we don't actually store the func_info into the
- * object; caller does that, after reparenting the memory context.
- *
- * Note that "compiling" a function in the current setup may execute some user
- * code (except in validate_only mode).
- *
- * Returns the object on the stack (except in validate_only mode, which returns
- * nothing)
+ * Given a comp_info, construct the source text of the function's chunk and
+ * load it (without running anything). The chunk is left on the stack.
  */
-int
-pllua_compile(lua_State *L)
+static void
+pllua_load_function_source(lua_State *L, pllua_function_compile_info *comp_info)
 {
-	pllua_function_compile_info *comp_info = lua_touserdata(L, 1);
 	pllua_function_info *func_info = comp_info->func_info;
 	const char	   *fname = func_info->name;
 	const char	   *src;
 	luaL_Buffer b;
 
-	if (!comp_info->validate_only)
-	{
-		/* caller fills in pointer */
-		pllua_newrefobject(L, PLLUA_FUNCTION_OBJECT, NULL, true);
-	}
-
 	luaL_buffinit(L, &b);
 
 	/*
@@ -188,6 +178,338 @@ pllua_compile(lua_State *L)
 	if (luaL_loadbufferx(L, src, strlen(src), fname, "t"))
 		pllua_rethrow_from_lua(L, LUA_ERRRUN);
 	lua_remove(L, -2); /* drop source */
+}
+
+/*
+ * Optional on-disk cache of compiled function chunks (lua_dump output).
+ *
+ * The key is everything that determines the generated source: the function
+ * oid and pg_proc row version (the same things pllua_function_valid checks),
+ * qualified by cluster and database, plus the Lua version and our own format
+ * version below. Any change to the function changes the key, so stale entries
+ * are never read, merely left for the administrator to clean out.
+ *
+ * This all runs in Lua context, so we stick to plain stdio, which doesn't
+ * throw; any failure just means a cache miss.
+ */
+
+/*
+ * Bump this whenever the wrapper generated by pllua_load_function_source
+ * changes, or anything else that would make an existing entry wrong.
+ */
+#define PLLUA_BYTECODE_FORMAT 1
+
+typedef struct pllua_bytecode_reader
+{
+	FILE	   *file;
+	char		buf[8192];
+} pllua_bytecode_reader;
+
+static const char *
+pllua_bytecode_read(lua_State *L, void *ud, size_t *sz)
+{
+	pllua_bytecode_reader *r = ud;
+
+	*sz = fread(r->buf, 1, sizeof(r->buf), r->file);
+	return (*sz > 0) ? r->buf : NULL;
+}
+
+static int
+pllua_bytecode_write(lua_State *L, const void *p, size_t sz, void *ud)
+{
+	return (fwrite(p, 1, sz, (FILE *) ud) == sz) ? 0 : 1;
+}
+
+static bool
+pllua_bytecode_cache_path(pllua_function_info *func_info, char *path, size_t len)
+{
+	int			rc;
+
+	if (!pllua_bytecode_cache_dir || !*pllua_bytecode_cache_dir)
+		return false;
+
+	rc = snprintf(path, len,
+				  "%s/pllua_" UINT64_FORMAT "_%u_%u_%u_%u_%u_%d_%d_%d.luac",
+				  pllua_bytecode_cache_dir,
+				  GetSystemIdentifier(),
+				  (unsigned) MyDatabaseId,
+				  (unsigned) func_info->fn_oid,
+				  (unsigned) func_info->fn_xmin,
+				  (unsigned) ItemPointerGetBlockNumber(&func_info->fn_tid),
+				  (unsigned) ItemPointerGetOffsetNumber(&func_info->fn_tid),
+				  (int) LUA_VERSION_NUM,
+				  (int) LUAJIT_VERSION_NUM,
+				  PLLUA_BYTECODE_FORMAT);
+
+	return (rc > 0 && rc < len);
+}
+
+/*
+ * On a hit, leaves the loaded chunk on the stack and returns true. On a miss,
+ * the stack is unchanged.
+ */
+static bool
+pllua_bytecode_cache_load(lua_State *L, const char *path, const char *fname)
+{
+	pllua_bytecode_reader r;
+	int			rc;
+
+	r.file = fopen(path, PG_BINARY_R);
+	if (!r.file)
+		return false;
+	rc = pllua_load(L, pllua_bytecode_read, &r, fname, "b");
+	fclose(r.file);
+	if (rc == LUA_OK)
+		return true;
+	if (rc == LUA_ERRMEM)
+		lua_error(L);
+	/* unreadable or from an incompatible Lua build; just recompile */
+	lua_pop(L, 1);
+	return false;
+}
+
+/*
+ * Dump the chunk on top of the stack into the cache. We write to a temp file
+ * and rename it into place, so that concurrent backends never see a partial
+ * file. The file is readable only by the server's user, as for the files in
+ * the data directory.
+ */
+static void
+pllua_bytecode_cache_store(lua_State *L, const char *path)
+{
+	char		tmppath[MAXPGPATH];
+	FILE	   *f;
+	int			fd;
+	int			rc;
+
+	rc = snprintf(tmppath, sizeof(tmppath), "%s.%d.tmp", path, MyProcPid);
+	if (rc <= 0 || rc >= sizeof(tmppath))
+		return;
+
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return;
+	f = fdopen(fd, PG_BINARY_W);
+	if (!f)
+	{
+		close(fd);
+		unlink(tmppath);
+		return;
+	}
+	rc = pllua_dump(L, pllua_bytecode_write, f);
+	if (fclose(f) != 0)
+		rc = 1;
+	if (rc != 0 || rename(tmppath, path) != 0)
+		unlink(tmppath);
+}
+
+/*
+ * The same directory also caches modules that require() finds on
+ * package.path. The searcher below is placed just ahead of the standard Lua
+ * file searcher in package.searchers, outside any sandbox, so it serves
+ * trusted.allow/trusted.require and the on_*init strings as well as plain
+ * require(). It still reads the source file, which is cheap, but loads the
+ * dumped bytecode in place of compiling the source whenever an entry for the
+ * same module name and source checksum exists; one backend or interpreter
+ * compiling a module is thus enough for all of them in the cluster.
+ *
+ * Nothing here touches the database, so this is postmaster-safe (modules
+ * loaded from on_init in a preloaded interpreter use the cache too).
+ */
+static uint64
+pllua_bytecode_checksum(const char *p, size_t len)
+{
+	/* FNV-1a */
+	uint64		h = UINT64CONST(0xcbf29ce484222325);
+
+	while (len-- > 0)
+	{
+		h ^= (unsigned char) *p++;
+		h *= UINT64CONST(0x100000001b3);
+	}
+	return h;
+}
+
+/*
+ * Push the contents of the named file as a string, or push nothing and
+ * return false if it can't be read.
+ */
+static bool
+pllua_module_read_source(lua_State *L, const char *filename)
+{
+	FILE	   *f = fopen(filename, PG_BINARY_R);
+	luaL_Buffer b;
+	size_t		n;
+
+	if (!f)
+		return false;
+
+	luaL_buffinit(L, &b);
+	do
+	{
+		char	   *p = luaL_prepbuffer(&b);
+
+		n = fread(p, 1, LUAL_BUFFERSIZE, f);
+		luaL_addsize(&b, n);
+	} while (n == LUAL_BUFFERSIZE);
+	luaL_pushresult(&b);
+
+	if (ferror(f))
+	{
+		fclose(f);
+		lua_pop(L, 1);
+		return false;
+	}
+	fclose(f);
+	return true;
+}
+
+/*
+ * searcher(name)  returns chunk,filename
+ *
+ * upvalue 1 is the (real) package table. Returns nothing, so that the
+ * standard searchers carry on, if there's no cache directory or the module
+ * isn't a source file on package.path.
+ */
+static int
+pllua_module_cache_search(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	const char *filename;
+	const char *chunkname;
+	const char *src;
+	size_t		srclen;
+	char		path[MAXPGPATH];
+	int			rc;
+
+	if (!pllua_bytecode_cache_dir || !*pllua_bytecode_cache_dir)
+		return 0;
+
+	lua_settop(L, 1);
+	lua_getfield(L, lua_upvalueindex(1), "searchpath");
+	if (!lua_isfunction(L, -1))
+		return 0;
+	lua_pushvalue(L, 1);
+	lua_getfield(L, lua_upvalueindex(1), "path");
+	if (!lua_isstring(L, -1))
+		return 0;
+	lua_call(L, 2, 1);
+	if (!lua_isstring(L, -1))
+		return 0;
+	filename = lua_tostring(L, 2);
+
+	chunkname = lua_pushfstring(L, "@%s", filename);
+
+	if (!pllua_module_read_source(L, filename))
+		return 0;
+	src = lua_tolstring(L, 4, &srclen);
+
+	/* precompiled files are left to the standard searcher */
+	if (srclen > 0 && src[0] == LUA_SIGNATURE[0])
+		return 0;
+
+	rc = snprintf(path, sizeof(path),
+				  "%s/pllua_mod_" UINT64_FORMAT "_" UINT64_FORMAT "_%lu_%d_%d_%d.luac",
+				  pllua_bytecode_cache_dir,
+				  pllua_bytecode_checksum(name, strlen(name)),
+				  pllua_bytecode_checksum(src, srclen),
+				  (unsigned long) srclen,
+				  (int) LUA_VERSION_NUM,
+				  (int) LUAJIT_VERSION_NUM,
+				  PLLUA_BYTECODE_FORMAT);
+	if (rc <= 0 || rc >= sizeof(path))
+		return 0;
+
+	if (!pllua_bytecode_cache_load(L, path, chunkname))
+	{
+		/* skip a leading "#" line as luaL_loadfile does, but keep its newline */
+		if (srclen > 0 && src[0] == '#')
+		{
+			const char *nl = memchr(src, '\n', srclen);
+
+			srclen = nl ? srclen - (nl - src) : 0;
+			src = nl ? nl : src;
+		}
+		if (luaL_loadbufferx(L, src, srclen, chunkname, "t") != LUA_OK)
+			luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+					   name, filename, lua_tostring(L, -1));
+		pllua_bytecode_cache_store(L, path);
+	}
+
+	lua_pushvalue(L, 2);
+	return 2;
+}
+
+/*
+ * Put the caching searcher in the real package.searchers (package.loaders in
+ * 5.1), just after the preload searcher.
+ */
+void
+pllua_install_module_searcher(lua_State *L)
+{
+	int			i;
+
+	lua_getglobal(L, "package");
+#if LUA_VERSION_NUM == 501
+	lua_getfield(L, -1, "loaders");
+#else
+	lua_getfield(L, -1, "searchers");
+#endif
+	if (!lua_istable(L, -1))
+	{
+		lua_pop(L, 2);
+		return;
+	}
+	for (i = 1; lua_rawgeti(L, -1, i) != LUA_TNIL; ++i)
+		lua_pop(L, 1);
+	lua_pop(L, 1);
+	for (--i; i >= 2; --i)
+	{
+		lua_rawgeti(L, -1, i);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, pllua_module_cache_search, 1);
+	lua_rawseti(L, -2, 2);
+	lua_pop(L, 2);
+}
+
+/*
+ * Given a comp_info containing the info we need, compile a function and make
+ * an object for it. However, we don't actually store the func_info into the
+ * object; caller does that, after reparenting the memory context.
+ *
+ * Note that "compiling" a function in the current setup may execute some user
+ * code (except in validate_only mode).
+ *
+ * Returns the object on the stack (except in validate_only mode, which returns
+ * nothing)
+ */
+int
+pllua_compile(lua_State *L)
+{
+	pllua_function_compile_info *comp_info = lua_touserdata(L, 1);
+	pllua_function_info *func_info = comp_info->func_info;
+	char		cache_path[MAXPGPATH];
+	bool		use_cache = false;
+
+	if (!comp_info->validate_only)
+	{
+		/* caller fills in pointer */
+		pllua_newrefobject(L, PLLUA_FUNCTION_OBJECT, NULL, true);
+
+		use_cache = pllua_bytecode_cache_path(func_info,
+											  cache_path,
+											  sizeof(cache_path));
+	}
+
+	if (!use_cache
+		|| !pllua_bytecode_cache_load(L, cache_path, func_info->name))
+	{
+		pllua_load_function_source(L, comp_info);
+		if (use_cache)
+			pllua_bytecode_cache_store(L, cache_path);
+	}
 
 	/*
 	 * Bail out here if validating.
@@ -247,6 +569,65 @@ pllua_intern_function(lua_State *L)
 	return 1;
 }
 
+/*
+ * Types for which a Datum converts to and from a plain Lua value without any
+ * need for a typeinfo.
+ */
+static bool
+pllua_simple_scalar_type(Oid typeoid)
+{
+	switch (typeoid)
+	{
+		case BOOLOID:
+		case INT4OID:
+#ifdef PLLUA_INT8_OK
+		case INT8OID:
+#endif
+		case FLOAT8OID:
+		case TEXTOID:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Decide whether calls to this activation can take the direct scalar path in
+ * exec.c, which converts args and result without looking up typeinfos. This
+ * requires a non-SRF with no polymorphism or VARIADIC "any", whose result and
+ * args are all simple scalar types, and no tosql transform on the result type
+ * (arg transforms don't matter since simple values are preferred for args
+ * anyway).
+ */
+static bool
+pllua_activation_is_simple(pllua_func_activation *act,
+						   pllua_function_info *func_info)
+{
+	int			i;
+
+	if (act->retset
+		|| act->polymorphic
+		|| act->retdomain
+		|| act->typefuncclass != TYPEFUNC_SCALAR
+		|| func_info->variadic_any
+		|| !pllua_simple_scalar_type(act->rettype))
+		return false;
+
+	for (i = 0; i < act->nargs; ++i)
+	{
+		if (!pllua_simple_scalar_type(act->argtypes[i]))
+			return false;
+	}
+
+	if (OidIsValid(func_info->language_oid)
+		&& OidIsValid(get_transform_tosql(act->rettype,
+										  func_info->language_oid,
+										  list_make1_oid(act->rettype))))
+		return false;
+
+	return true;
+}
+
 /*
  * Call this to resolve an activation before use
  *
@@ -326,6 +707,8 @@ pllua_resolve_activation(lua_State *L,
 	else
 		act->argtypes = func_info->argtypes;
 
+	act->simple_scalar = pllua_activation_is_simple(act, func_info);
+
 	MemoryContextSwitchTo(oldcontext);
 	act->resolved = true;
 }
@@ -430,6 +813,91 @@ pllua_function_valid(pllua_function_info *func_info,
 			ItemPointerEquals(&func_info->fn_tid, &procTup->t_self));
 }
 
+/*
+ * Compile the function in procTup from scratch and intern the result in
+ * PLLUA_FUNCS. If act is not NULL, it's resolved against the new func_info
+ * (using the call's fcinfo) before compiling, and left unresolved on error.
+ *
+ * Create the func_info, compile_info and contexts here. Note that the compile
+ * context is always transient, but the function context is reparented to the
+ * long-lived lua context on success. (CurrentMemoryContext on entry is the
+ * original caller's context, assumed transient.)
+ *
+ * Called in PG context; errors are thrown as pg errors. The lua stack is left
+ * unchanged.
+ */
+static void
+pllua_compile_and_intern(lua_State *L,
+						 Oid fn_oid,
+						 HeapTuple procTup,
+						 bool trusted,
+						 pllua_func_activation *act,
+						 FunctionCallInfo fcinfo)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	pllua_function_info *func_info;
+	pllua_function_compile_info *comp_info;
+	MemoryContext fcxt;
+	MemoryContext ccxt;
+	int			rc;
+
+	fcxt = AllocSetContextCreate(CurrentMemoryContext,
+								 "pllua function object",
+								 ALLOCSET_SMALL_SIZES);
+	ccxt = AllocSetContextCreate(CurrentMemoryContext,
+								 "pllua compile context",
+								 ALLOCSET_SMALL_SIZES);
+
+	func_info = MemoryContextAlloc(fcxt, sizeof(pllua_function_info));
+	func_info->mcxt = fcxt;
+
+	comp_info = MemoryContextAlloc(ccxt, sizeof(pllua_function_compile_info));
+	comp_info->mcxt = ccxt;
+	comp_info->func_info = func_info;
+
+	pllua_load_from_proctup(L, fn_oid,
+							func_info, comp_info,
+							procTup, trusted);
+
+	if (act)
+		pllua_resolve_activation(L, act, func_info, fcinfo);
+
+	pllua_pushcfunction(L, pllua_compile);
+	lua_pushlightuserdata(L, comp_info);
+	rc = pllua_pcall_nothrow(L, 1, 1, 0);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(ccxt);
+
+	if (rc)
+	{
+		/* error. bail out */
+		if (act)
+			act->resolved = false;
+		MemoryContextDelete(fcxt);
+		pllua_rethrow_from_lua(L, rc);
+	}
+	else
+	{
+		void **p = lua_touserdata(L, -1);
+		MemoryContextSetParent(fcxt, pllua_get_memory_cxt(L));
+		*p = func_info;
+		++(pllua_getinterpreter(L)->n_functions);
+	}
+
+	/*
+	 * Try and intern the function. When called from pllua_validate_and_push
+	 * we uninterned any old version earlier, but a recursive call could have
+	 * interned a new version already (which will be at least as new as ours),
+	 * in which case ours is discarded.
+	 */
+	/* stack: funcinfo */
+	pllua_pushcfunction(L, pllua_intern_function);
+	lua_insert(L, -2);
+	lua_pushinteger(L, (lua_Integer) fn_oid);
+	pllua_pcall(L, 2, 0, 0);
+}
+
 /*
  * Returns with a function activation object on top of the lua stack.
  *
@@ -457,7 +925,6 @@ pllua_validate_and_push(lua_State *L,
 	{
 		pllua_func_activation *act = flinfo->fn_extra;
 		Oid		fn_oid = flinfo->fn_oid;
-		int		rc;
 
 		/*
 		 * If we don't have an activation yet, make one (it'll initially be
@@ -485,9 +952,6 @@ pllua_validate_and_push(lua_State *L,
 		for (;;)
 		{
 			pllua_function_info *func_info;
-			pllua_function_compile_info *comp_info;
-			MemoryContext fcxt;
-			MemoryContext ccxt;
 			HeapTuple	procTup;
 
 			/* Get the pg_proc tuple. */
@@ -547,76 +1011,16 @@ pllua_validate_and_push(lua_State *L,
 
 			/*
 			 * If we get this far, we need to compile up the function from
-			 * scratch. Create the func_info, compile_info and contexts. Note
-			 * that the compile context is always transient, but the function
-			 * context is reparented to the long-lived lua context on success.
+			 * scratch. The activation is resolved before compiling in case the
+			 * user code tries to do something that needs access to it.
 			 *
-			 * (CurrentMemoryContext at this point is still the original
-			 * caller's context, assumed transient)
-			 */
-			fcxt = AllocSetContextCreate(CurrentMemoryContext,
-										 "pllua function object",
-										 ALLOCSET_SMALL_SIZES);
-			ccxt = AllocSetContextCreate(CurrentMemoryContext,
-										 "pllua compile context",
-										 ALLOCSET_SMALL_SIZES);
-
-			func_info = MemoryContextAlloc(fcxt, sizeof(pllua_function_info));
-			func_info->mcxt = fcxt;
-
-			comp_info = MemoryContextAlloc(ccxt, sizeof(pllua_function_compile_info));
-			comp_info->mcxt = ccxt;
-			comp_info->func_info = func_info;
-
-			pllua_load_from_proctup(L, fn_oid,
-									func_info, comp_info,
-									procTup, trusted);
-
-			/*
-			 * Resolve the activation before compiling in case the user code
-			 * tries to do something that needs access to it.
-			 */
-			pllua_resolve_activation(L, act, func_info, fcinfo);
-
-			/*
-			 * Beware, compiling can invoke user-supplied code, which might
-			 * in turn recurse here. We trust that stack depth checks will
-			 * break any such loop if need be.
-			 */
-			pllua_pushcfunction(L, pllua_compile);
-			lua_pushlightuserdata(L, comp_info);
-			rc = pllua_pcall_nothrow(L, 1, 1, 0);
-
-			MemoryContextSwitchTo(oldcontext);
-			MemoryContextDelete(ccxt);
-
-			if (rc)
-			{
-				/* error. bail out */
-				act->resolved = false;
-				MemoryContextDelete(fcxt);
-				pllua_rethrow_from_lua(L, rc);
-			}
-			else
-			{
-				void **p = lua_touserdata(L, -1);
-				MemoryContextSetParent(fcxt, pllua_get_memory_cxt(L));
-				*p = func_info;
-			}
-
-			/*
-			 * Try and intern the function. Since we uninterned it earlier, we
-			 * expect this to succeed, but a recursive call could have interned
-			 * a new version already (which will be at least as new as ours).
-			 * Worse, if so, that new version could already be out of date,
-			 * meaning that we have to loop back to check the pg_proc row
-			 * again.
+			 * Beware, compiling can invoke user-supplied code, which might in
+			 * turn recurse here. We trust that stack depth checks will break
+			 * any such loop if need be. A recursive call could also have
+			 * interned a newer version already, which could itself be out of
+			 * date by now; so loop back to check the pg_proc row again.
 			 */
-			/* stack: activation funcinfo */
-			pllua_pushcfunction(L, pllua_intern_function);
-			lua_insert(L, -2);
-			lua_pushinteger(L, (lua_Integer) fn_oid);
-			pllua_pcall(L, 2, 0, 0);
+			pllua_compile_and_intern(L, fn_oid, procTup, trusted, act, fcinfo);
 			func_info = NULL;
 			ReleaseSysCache(procTup);
 		}
@@ -648,6 +1052,52 @@ pllua_validate_and_push(lua_State *L,
 }
 
 
+/*
+ * Compile and intern a function without reference to any call site, so that a
+ * later call will find it already present in PLLUA_FUNCS. Used for pre-warming
+ * new interpreters. Returns false if the function is not in our language (in
+ * which case nothing is done).
+ *
+ * Called in PG context; errors are thrown as pg errors.
+ */
+bool
+pllua_prewarm_function(lua_State *L,
+					   Oid fn_oid,
+					   Oid lang_oid,
+					   bool trusted)
+{
+	HeapTuple	procTup;
+
+	ASSERT_PG_CONTEXT;
+
+	procTup = SearchSysCache1(PROCOID, ObjectIdGetDatum(fn_oid));
+	if (!HeapTupleIsValid(procTup))
+		elog(ERROR, "cache lookup failed for function %u", fn_oid);
+
+	if (((Form_pg_proc) GETSTRUCT(procTup))->prolang != lang_oid)
+	{
+		ReleaseSysCache(procTup);
+		return false;
+	}
+
+	/* nothing to do if some earlier call got here first */
+	lua_rawgetp(L, LUA_REGISTRYINDEX, PLLUA_FUNCS);
+	if (lua_rawgeti(L, -1, (lua_Integer) fn_oid) != LUA_TNIL)
+	{
+		lua_pop(L, 2);
+		ReleaseSysCache(procTup);
+		return true;
+	}
+	lua_pop(L, 2);
+
+	pllua_compile_and_intern(L, fn_oid, procTup, trusted, NULL, NULL);
+
+	ReleaseSysCache(procTup);
+
+	return true;
+}
+
+
 /*
  * Returns true if typeid (a pseudotype) is acceptable for either a result type
  * (if is_result) or a param of mode "argmode".
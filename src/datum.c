@@ -659,7 +659,12 @@ static int pllua_datum_gc(lua_State *L)
 {
 	pllua_datum *p = lua_touserdata(L, 1);
 
-	if (!p || !p->need_gc || !DatumGetPointer(p->value))
+	if (!p)
+		return 0;
+
+	--(pllua_getinterpreter(L)->n_datums);
+
+	if (!p->need_gc || !DatumGetPointer(p->value))
 		return 0;
 
 	ASSERT_LUA_CONTEXT;
@@ -825,6 +830,9 @@ pllua_datum *pllua_newdatum(lua_State *L, int nt, Datum value)
 	d->need_gc = false;
 	d->modified = false;
 
+	++pllua_profile_datums;
+	++(pllua_getinterpreter(L)->n_datums);
+
 	/*
 	 * If this is a record type of unknown structure but known value, see about
 	 * replacing the caller-supplied typeinfo with one that reflects the actual
@@ -1039,9 +1047,11 @@ static void pllua_datum_deform_tuple(lua_State *L, int nd, pllua_datum *d, pllua
 	bool needsave[MaxTupleAttributeNumber + 1];
 	pllua_datum *savedatum[MaxTupleAttributeNumber + 1];
 	pllua_typeinfo *saveti[MaxTupleAttributeNumber + 1];
+	bool		present[MaxTupleAttributeNumber + 1];
 	TupleDesc tupdesc = t->tupdesc;
 	MemoryContext mcxt = pllua_get_memory_cxt(L);
 	bool anysave = false;
+	bool have_partial = false;
 	int i;
 
 	nd = lua_absindex(L, nd);
@@ -1052,7 +1062,26 @@ static void pllua_datum_deform_tuple(lua_State *L, int nd, pllua_datum *d, pllua
 	if (luaL_getmetafield(L, nd, "attrtypes") != LUA_TTABLE)
 		luaL_error(L, "mising attrtypes table");
 
-	lua_createtable(L, t->natts, 8);
+	/*
+	 * If some columns were already fetched by pllua_datum_lazy_column, keep
+	 * those child datums and fill in the rest around them.
+	 */
+	if (pllua_get_user_field(L, nd, ".partial") == LUA_TTABLE)
+	{
+		have_partial = true;
+		for (i = 0; i < t->natts; ++i)
+		{
+			present[i] = (lua_rawgeti(L, -1, i+1) != LUA_TNIL);
+			lua_pop(L, 1);
+		}
+	}
+	else
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, t->natts, 8);
+		for (i = 0; i < t->natts; ++i)
+			present[i] = false;
+	}
 
 	/* stack: attrtypes,table */
 
@@ -1096,6 +1125,7 @@ static void pllua_datum_deform_tuple(lua_State *L, int nd, pllua_datum *d, pllua
 							? get_typtype(getBaseType(att->atttypid))
 							: '\0');
 			if (!nulls[i]
+				&& !present[i]
 				&& att->attlen == -1
 				&& (att->atttypid == RECORDOID ||
 					typtype == TYPTYPE_RANGE ||
@@ -1117,6 +1147,9 @@ static void pllua_datum_deform_tuple(lua_State *L, int nd, pllua_datum *d, pllua
 	{
 		Form_pg_attribute att = TupleDescAttr(tupdesc, i);
 
+		if (present[i])
+			continue;
+
 		lua_rawgeti(L, -2, i+1);
 		/* stack: attrtypes,table,typeinfo */
 
@@ -1195,6 +1228,12 @@ static void pllua_datum_deform_tuple(lua_State *L, int nd, pllua_datum *d, pllua
 	lua_pushvalue(L, -1);
 	pllua_set_user_field(L, nd, ".deformed");
 	lua_remove(L, -2);
+
+	if (have_partial)
+	{
+		lua_pushnil(L);
+		pllua_set_user_field(L, nd, ".partial");
+	}
 }
 
 /*
@@ -1442,6 +1481,132 @@ static bool pllua_datum_column(lua_State *L, int attno, bool skip_dropped)
 	return true;
 }
 
+/*
+ * Fetch a single column of a row datum without deforming the whole tuple.
+ * heap_getattr only walks the tuple as far as the requested column (using
+ * the cached attribute offsets where they are valid), so reading a few
+ * columns of a wide row is much cheaper than deforming all of it.
+ *
+ * Child datums made this way are kept in a ".partial" table, which
+ * pllua_datum_deform_tuple completes if a full deform is needed later; so
+ * every reference to a given column is to the same child datum either way.
+ *
+ * Returns false, with nothing pushed, if the caller should just do the full
+ * deform; otherwise pushes the column's value as pllua_datum_column does.
+ */
+static bool pllua_datum_lazy_column(lua_State *L, int nd, pllua_datum *d, pllua_typeinfo *t, int attno)
+{
+	Form_pg_attribute att = TupleDescAttr(t->tupdesc, attno - 1);
+	volatile Datum value = (Datum)0;
+	volatile bool isnull = true;
+	volatile bool needsave = false;
+
+	nd = lua_absindex(L, nd);
+
+	if (d->value == (Datum)0 || d->modified)
+		return false;
+
+	if (pllua_get_user_field(L, nd, ".deformed") == LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		return false;
+	}
+	lua_pop(L, 1);
+
+	if (pllua_get_user_field(L, nd, ".partial") != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, t->natts, 0);
+		lua_pushvalue(L, -1);
+		pllua_set_user_field(L, nd, ".partial");
+	}
+
+	/* stack: partial */
+
+	if (lua_rawgeti(L, -1, attno) != LUA_TNIL)
+	{
+		lua_pop(L, 1);
+		pllua_datum_column(L, attno, false);
+		return true;
+	}
+	lua_pop(L, 1);
+
+	PLLUA_TRY();
+	{
+		HeapTupleHeader htup = (HeapTupleHeader) DatumGetPointer(d->value);
+		HeapTupleData tuple;
+		bool		isnull_l;
+		Datum		value_l;
+
+		tuple.t_len = HeapTupleHeaderGetDatumLength(htup);
+		ItemPointerSetInvalid(&(tuple.t_self));
+		tuple.t_tableOid = InvalidOid;
+		tuple.t_data = htup;
+
+		value_l = heap_getattr(&tuple, attno, t->tupdesc, &isnull_l);
+
+		/* see pllua_datum_deform_tuple */
+		if (!isnull_l
+			&& att->attlen == -1
+			&& VARATT_IS_EXTENDED(DatumGetPointer(value_l)))
+		{
+			char typtype = get_typtype(getBaseType(att->atttypid));
+			if (att->atttypid == RECORDOID ||
+				typtype == TYPTYPE_RANGE ||
+				typtype == TYPTYPE_COMPOSITE)
+			{
+				value_l = PointerGetDatum(PG_DETOAST_DATUM(value_l));
+				needsave = true;
+			}
+		}
+		value = value_l;
+		isnull = isnull_l;
+	}
+	PLLUA_CATCH_RETHROW();
+
+	if (isnull)
+		lua_pushboolean(L, 1);		/* as in the deformed table */
+	else
+	{
+		pllua_typeinfo *newt;
+		pllua_datum *newd;
+
+		if (luaL_getmetafield(L, nd, "attrtypes") != LUA_TTABLE)
+			luaL_error(L, "mising attrtypes table");
+		lua_rawgeti(L, -1, attno);
+		lua_remove(L, -2);
+
+		newt = pllua_checktypeinfo(L, -1, false);
+		newd = pllua_newdatum(L, -1, value);
+		if (newt->typeoid != RECORDOID)
+			newd->typmod = att->atttypmod;
+		newd->need_gc = false;
+
+		lua_pushvalue(L, nd);
+		pllua_datum_reference(L, -2);
+
+		if (needsave)
+		{
+			PLLUA_TRY();
+			{
+				MemoryContext oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+				void *oldp = DatumGetPointer(newd->value);
+				pllua_savedatum(L, newd, newt);
+				pfree(oldp);
+				MemoryContextSwitchTo(oldcontext);
+			}
+			PLLUA_CATCH_RETHROW();
+		}
+
+		lua_remove(L, -2);  /* typeinfo */
+	}
+
+	/* stack: partial value */
+	lua_rawseti(L, -2, attno);
+	pllua_datum_column(L, attno, false);
+	return true;
+}
+
 
 /*
  * __tostring(d)  returns the string representation of an unregistered row.
@@ -1584,6 +1749,9 @@ static int pllua_datum_row_index(lua_State *L)
 			else if ((attno < 1 || attno > t->natts)
 					 || TupleDescAttr(t->tupdesc, attno-1)->attisdropped)
 				luaL_error(L, "datum has no column number %d", attno);
+			if (!IsObjectIdAttributeNumber(attno) &&
+				pllua_datum_lazy_column(L, 1, d, t, attno))
+				return 1;
 			pllua_datum_deform_tuple(L, 1, d, t);
 			if (IsObjectIdAttributeNumber(attno))
 				lua_getfield(L, -1, "oid");
@@ -2342,6 +2510,809 @@ pllua_datum_array_map(lua_State *L)
 	return noresult ? 0 : 1;
 }
 
+/*
+ * Array kernels.
+ *
+ * sum, min, max, dot, add, mul, filter and pack work directly on the
+ * deconstructed element values of an int2, int4, int8, float4 or float8
+ * array, rather than going through a Lua value (and possibly a Lua function
+ * call) per element as map does. Results are built in plain native buffers,
+ * which are also the format used by :pack() and typeinfo:frompacked(); the
+ * loops are kept per-type and free of calls so that the compiler has a
+ * chance of vectorizing them.
+ */
+
+#define PLLUA_ARRAY_KERNEL_LOOP(...)						\
+	do {													\
+		if (!nulls)											\
+			for (i = 0; i < nelems; ++i) { __VA_ARGS__; }	\
+		else												\
+			for (i = 0; i < nelems; ++i)					\
+				if (!nulls[i]) { __VA_ARGS__; }				\
+	} while (0)
+
+static bool
+pllua_datum_array_kernel_type(Oid elemtype)
+{
+	switch (elemtype)
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static ExpandedArrayHeader *
+pllua_datum_array_deconstruct(lua_State *L, pllua_datum *d, pllua_typeinfo *t)
+{
+	ExpandedArrayHeader *arr = pllua_datum_array_value(L, d, t);
+
+	if (!arr->dvalues)
+	{
+		PLLUA_TRY();
+		{
+			deconstruct_expanded_array(arr);
+		}
+		PLLUA_CATCH_RETHROW();
+	}
+
+	return arr;
+}
+
+static ExpandedArrayHeader *
+pllua_datum_array_elements(lua_State *L, pllua_datum *d, pllua_typeinfo *t)
+{
+	if (!t->is_array)
+		luaL_error(L, "datum is not an array type");
+	if (!pllua_datum_array_kernel_type(t->elemtype))
+		luaL_error(L, "array element type must be int2, int4, int8, float4 or float8");
+
+	return pllua_datum_array_deconstruct(L, d, t);
+}
+
+static inline float8
+pllua_datum_array_elem_float8(Datum val, Oid elemtype)
+{
+	switch (elemtype)
+	{
+		case INT2OID:	return (float8) DatumGetInt16(val);
+		case INT4OID:	return (float8) DatumGetInt32(val);
+		case INT8OID:	return (float8) DatumGetInt64(val);
+		case FLOAT4OID:	return (float8) DatumGetFloat4(val);
+		default:		return DatumGetFloat8(val);
+	}
+}
+
+static inline void
+pllua_datum_array_store_native(char *buf, int i, Datum val, Oid elemtype)
+{
+	switch (elemtype)
+	{
+		case INT2OID:	((int16 *) buf)[i] = DatumGetInt16(val); break;
+		case INT4OID:	((int32 *) buf)[i] = DatumGetInt32(val); break;
+		case INT8OID:	((int64 *) buf)[i] = DatumGetInt64(val); break;
+		case FLOAT4OID:	((float4 *) buf)[i] = DatumGetFloat4(val); break;
+		default:		((float8 *) buf)[i] = DatumGetFloat8(val); break;
+	}
+}
+
+static inline Datum
+pllua_datum_array_fetch_native(const char *buf, int i, Oid elemtype)
+{
+	switch (elemtype)
+	{
+		case INT2OID:	return Int16GetDatum(((const int16 *) buf)[i]);
+		case INT4OID:	return Int32GetDatum(((const int32 *) buf)[i]);
+		case INT8OID:	return Int64GetDatum(((const int64 *) buf)[i]);
+		case FLOAT4OID:	return Float4GetDatum(((const float4 *) buf)[i]);
+		default:		return Float8GetDatum(((const float8 *) buf)[i]);
+	}
+}
+
+/*
+ * Construct and push a new array datum of type t (at stack index nt) from a
+ * buffer of native element values. nulls may be NULL if there are none, in
+ * which case the buffer is simply copied into place as the array data (the
+ * supported element types have no alignment padding).
+ */
+static void
+pllua_datum_array_push_native(lua_State *L, int nt, pllua_typeinfo *t,
+							  const char *buf, int nelems, bool *nulls,
+							  int ndims, int *dims, int *lbs)
+{
+	pllua_datum *newd = pllua_newdatum(L, nt, (Datum)0);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext;
+		ArrayType  *res;
+		int			i;
+
+		if (nelems == 0)
+			res = construct_empty_array(t->elemtype);
+		else if (!nulls)
+		{
+			Size		nbytes = ARR_OVERHEAD_NONULLS(ndims) + (Size) nelems * t->elemtyplen;
+
+			res = (ArrayType *) palloc0(nbytes);
+			SET_VARSIZE(res, nbytes);
+			res->ndim = ndims;
+			res->dataoffset = 0;
+			res->elemtype = t->elemtype;
+			memcpy(ARR_DIMS(res), dims, ndims * sizeof(int));
+			memcpy(ARR_LBOUND(res), lbs, ndims * sizeof(int));
+			memcpy(ARR_DATA_PTR(res), buf, (Size) nelems * t->elemtyplen);
+		}
+		else
+		{
+			Datum	   *values = palloc(nelems * sizeof(Datum));
+
+			for (i = 0; i < nelems; ++i)
+				values[i] = nulls[i] ? (Datum)0 : pllua_datum_array_fetch_native(buf, i, t->elemtype);
+			res = construct_md_array(values, nulls, ndims, dims, lbs,
+									 t->elemtype,
+									 t->elemtyplen,
+									 t->elemtypbyval,
+									 t->elemtypalign);
+			pfree(values);
+		}
+
+		newd->value = PointerGetDatum(res);
+		oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+		pllua_savedatum(L, newd, t);
+		MemoryContextSwitchTo(oldcontext);
+		pfree(res);
+	}
+	PLLUA_CATCH_RETHROW();
+}
+
+/*
+ * sum(array)
+ *
+ * Sum of the non-null elements, or nil if there are none. Integer arrays
+ * sum to an integer (an error is raised on overflow), float arrays to a
+ * float.
+ */
+static int
+pllua_datum_array_sum(lua_State *L)
+{
+	pllua_datum *d = pllua_checkdatum(L, 1, lua_upvalueindex(1));
+	pllua_typeinfo *t = pllua_totypeinfo(L, lua_upvalueindex(1));
+	ExpandedArrayHeader *arr = pllua_datum_array_elements(L, d, t);
+	Datum	   *values = arr->dvalues;
+	bool	   *nulls = arr->dnulls;
+	int			nelems = arr->nelems;
+	int			nvals = 0;
+	int64		isum = 0;
+	float8		fsum = 0.0;
+	bool		overflow = false;
+	int			i;
+
+	switch (t->elemtype)
+	{
+		case INT2OID:
+			PLLUA_ARRAY_KERNEL_LOOP(isum += DatumGetInt16(values[i]); ++nvals);
+			break;
+		case INT4OID:
+			PLLUA_ARRAY_KERNEL_LOOP(isum += DatumGetInt32(values[i]); ++nvals);
+			break;
+		case INT8OID:
+			PLLUA_ARRAY_KERNEL_LOOP(int64 v = DatumGetInt64(values[i]);
+									overflow |= (v > 0) ? (isum > PG_INT64_MAX - v) : (isum < PG_INT64_MIN - v);
+									isum += v;
+									++nvals);
+			break;
+		case FLOAT4OID:
+			PLLUA_ARRAY_KERNEL_LOOP(fsum += DatumGetFloat4(values[i]); ++nvals);
+			break;
+		case FLOAT8OID:
+			PLLUA_ARRAY_KERNEL_LOOP(fsum += DatumGetFloat8(values[i]); ++nvals);
+			break;
+	}
+
+	if (overflow)
+		luaL_error(L, "bigint out of range");
+
+	if (nvals == 0)
+		lua_pushnil(L);
+	else if (t->elemtype == FLOAT4OID || t->elemtype == FLOAT8OID)
+		lua_pushnumber(L, fsum);
+	else
+		lua_pushinteger(L, isum);
+	return 1;
+}
+
+#define PLLUA_ARRAY_MINMAX_INT(get_)											\
+	do {																		\
+		ibest = get_(values[first]);											\
+		if (ismax)																\
+			PLLUA_ARRAY_KERNEL_LOOP(int64 v = get_(values[i]); ibest = Max(ibest, v)); \
+		else																	\
+			PLLUA_ARRAY_KERNEL_LOOP(int64 v = get_(values[i]); ibest = Min(ibest, v)); \
+	} while (0)
+
+/* NaN sorts above everything else, as in SQL */
+#define PLLUA_ARRAY_MINMAX_FLOAT(get_)											\
+	do {																		\
+		fbest = get_(values[first]);											\
+		if (ismax)																\
+			PLLUA_ARRAY_KERNEL_LOOP(float8 v = get_(values[i]);					\
+									if (isnan(v) || (!isnan(fbest) && v > fbest)) fbest = v); \
+		else																	\
+			PLLUA_ARRAY_KERNEL_LOOP(float8 v = get_(values[i]);					\
+									if (!isnan(v) && (isnan(fbest) || v < fbest)) fbest = v); \
+	} while (0)
+
+static int
+pllua_datum_array_minmax(lua_State *L, bool ismax)
+{
+	pllua_datum *d = pllua_checkdatum(L, 1, lua_upvalueindex(1));
+	pllua_typeinfo *t = pllua_totypeinfo(L, lua_upvalueindex(1));
+	ExpandedArrayHeader *arr = pllua_datum_array_elements(L, d, t);
+	Datum	   *values = arr->dvalues;
+	bool	   *nulls = arr->dnulls;
+	int			nelems = arr->nelems;
+	int64		ibest = 0;
+	float8		fbest = 0.0;
+	int			first;
+	int			i;
+
+	for (first = 0; first < nelems; ++first)
+		if (!nulls || !nulls[first])
+			break;
+
+	if (first >= nelems)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+
+	switch (t->elemtype)
+	{
+		case INT2OID:
+			PLLUA_ARRAY_MINMAX_INT(DatumGetInt16);
+			lua_pushinteger(L, ibest);
+			break;
+		case INT4OID:
+			PLLUA_ARRAY_MINMAX_INT(DatumGetInt32);
+			lua_pushinteger(L, ibest);
+			break;
+		case INT8OID:
+			PLLUA_ARRAY_MINMAX_INT(DatumGetInt64);
+			lua_pushinteger(L, ibest);
+			break;
+		case FLOAT4OID:
+			PLLUA_ARRAY_MINMAX_FLOAT(DatumGetFloat4);
+			lua_pushnumber(L, fbest);
+			break;
+		case FLOAT8OID:
+			PLLUA_ARRAY_MINMAX_FLOAT(DatumGetFloat8);
+			lua_pushnumber(L, fbest);
+			break;
+	}
+	return 1;
+}
+
+/*
+ * min(array)
+ * max(array)
+ *
+ * Smallest or largest non-null element, or nil if there are none.
+ */
+static int
+pllua_datum_array_min(lua_State *L)
+{
+	return pllua_datum_array_minmax(L, false);
+}
+
+static int
+pllua_datum_array_max(lua_State *L)
+{
+	return pllua_datum_array_minmax(L, true);
+}
+
+/*
+ * dot(array,array2)
+ *
+ * Sum of the products of corresponding elements (in storage order), as a
+ * float. The arrays need not have the same element type, but must have the
+ * same number of elements; pairs where either element is null are skipped.
+ */
+static int
+pllua_datum_array_dot(lua_State *L)
+{
+	pllua_datum *d = pllua_checkdatum(L, 1, lua_upvalueindex(1));
+	pllua_typeinfo *t = pllua_totypeinfo(L, lua_upvalueindex(1));
+	pllua_typeinfo *t2;
+	pllua_datum *d2 = pllua_checkanydatum(L, 2, &t2);
+	ExpandedArrayHeader *arr = pllua_datum_array_elements(L, d, t);
+	ExpandedArrayHeader *arr2 = pllua_datum_array_elements(L, d2, t2);
+	Datum	   *values = arr->dvalues;
+	Datum	   *values2 = arr2->dvalues;
+	bool	   *nulls = arr->dnulls;
+	bool	   *nulls2 = arr2->dnulls;
+	int			nelems = arr->nelems;
+	float8		res = 0.0;
+	int			i;
+
+	if (arr2->nelems != nelems)
+		luaL_error(L, "arrays must have the same number of elements");
+
+	if (t->elemtype == FLOAT8OID && t2->elemtype == FLOAT8OID
+		&& !nulls && !nulls2)
+	{
+		for (i = 0; i < nelems; ++i)
+			res += DatumGetFloat8(values[i]) * DatumGetFloat8(values2[i]);
+	}
+	else
+	{
+		for (i = 0; i < nelems; ++i)
+		{
+			if ((nulls && nulls[i]) || (nulls2 && nulls2[i]))
+				continue;
+			res += (pllua_datum_array_elem_float8(values[i], t->elemtype)
+					* pllua_datum_array_elem_float8(values2[i], t2->elemtype));
+		}
+	}
+
+	lua_pushnumber(L, res);
+	return 1;
+}
+
+/*
+ * The int2/int4 scalar is clamped before use, so that the int64 arithmetic
+ * can never overflow. Clamping can't change whether a result is in range:
+ * for a multiply, any nonzero value times a scalar of magnitude 2^31+1 or more
+ * is out of range, and the largest possible product is 2^31 * (2^31+1); for an
+ * add, any value plus a scalar of magnitude 2^32 or more is out of range.
+ */
+#define PLLUA_ARRAY_ARITH_INT(ctype_, get_, min_, max_)							\
+	do {																		\
+		ctype_	   *out = (ctype_ *) buf;										\
+		int64		s;															\
+		if (is_mul)																\
+		{																		\
+			s = Max(Min(iscalar, INT64CONST(0x80000001)), -INT64CONST(0x80000001)); \
+			PLLUA_ARRAY_KERNEL_LOOP(int64 r = (int64) get_(values[i]) * s;		\
+									overflow |= (r < (min_) || r > (max_));		\
+									out[i] = (ctype_) r);						\
+		}																		\
+		else																	\
+		{																		\
+			s = Max(Min(iscalar, INT64CONST(0x100000000)), -INT64CONST(0x100000000)); \
+			PLLUA_ARRAY_KERNEL_LOOP(int64 r = (int64) get_(values[i]) + s;		\
+									overflow |= (r < (min_) || r > (max_));		\
+									out[i] = (ctype_) r);						\
+		}																		\
+	} while (0)
+
+#define PLLUA_ARRAY_ARITH_FLOAT(ctype_, get_)									\
+	do {																		\
+		ctype_	   *out = (ctype_ *) buf;										\
+		if (is_mul)																\
+			PLLUA_ARRAY_KERNEL_LOOP(float8 v = get_(values[i]);					\
+									ctype_ r = (ctype_) (v * fscalar);			\
+									overflow |= (isinf(r) && !isinf(v) && !isinf(fscalar)); \
+									underflow |= (r == 0.0 && v != 0.0 && fscalar != 0.0); \
+									out[i] = r);								\
+		else																	\
+			PLLUA_ARRAY_KERNEL_LOOP(float8 v = get_(values[i]);					\
+									ctype_ r = (ctype_) (v + fscalar);			\
+									overflow |= (isinf(r) && !isinf(v) && !isinf(fscalar)); \
+									out[i] = r);								\
+	} while (0)
+
+static int
+pllua_datum_array_arith(lua_State *L, bool is_mul)
+{
+	pllua_datum *d = pllua_checkdatum(L, 1, lua_upvalueindex(1));
+	pllua_typeinfo *t = pllua_totypeinfo(L, lua_upvalueindex(1));
+	ExpandedArrayHeader *arr = pllua_datum_array_elements(L, d, t);
+	Datum	   *values = arr->dvalues;
+	bool	   *nulls = arr->dnulls;
+	int			nelems = arr->nelems;
+	bool		overflow = false;
+	bool		underflow = false;
+	lua_Integer	iscalar = 0;
+	float8		fscalar = 0.0;
+	char	   *buf;
+	int			i;
+
+	if (t->elemtype == FLOAT4OID || t->elemtype == FLOAT8OID)
+		fscalar = luaL_checknumber(L, 2);
+	else
+		iscalar = luaL_checkinteger(L, 2);
+
+	buf = lua_newuserdata(L, Max(nelems, 1) * t->elemtyplen);
+
+	switch (t->elemtype)
+	{
+		case INT2OID:
+			PLLUA_ARRAY_ARITH_INT(int16, DatumGetInt16, PG_INT16_MIN, PG_INT16_MAX);
+			if (overflow)
+				luaL_error(L, "smallint out of range");
+			break;
+		case INT4OID:
+			PLLUA_ARRAY_ARITH_INT(int32, DatumGetInt32, PG_INT32_MIN, PG_INT32_MAX);
+			if (overflow)
+				luaL_error(L, "integer out of range");
+			break;
+		case INT8OID:
+			{
+				int64	   *out = (int64 *) buf;
+				int64		s = iscalar;
+
+				/* overflow tests as for int8pl and int8mul */
+				if (is_mul)
+					PLLUA_ARRAY_KERNEL_LOOP(int64 v = DatumGetInt64(values[i]);
+											int64 r = v * s;
+											overflow |= ((v != (int64) ((int32) v) || s != (int64) ((int32) s))
+														 && s != 0
+														 && ((s == -1 && v < 0 && r < 0) || r / s != v));
+											out[i] = r);
+				else
+					PLLUA_ARRAY_KERNEL_LOOP(int64 v = DatumGetInt64(values[i]);
+											overflow |= (s > 0) ? (v > PG_INT64_MAX - s) : (v < PG_INT64_MIN - s);
+											out[i] = v + s);
+				if (overflow)
+					luaL_error(L, "bigint out of range");
+			}
+			break;
+		case FLOAT4OID:
+			PLLUA_ARRAY_ARITH_FLOAT(float4, DatumGetFloat4);
+			break;
+		case FLOAT8OID:
+			PLLUA_ARRAY_ARITH_FLOAT(float8, DatumGetFloat8);
+			break;
+	}
+
+	if (overflow)
+		luaL_error(L, "value out of range: overflow");
+	if (underflow)
+		luaL_error(L, "value out of range: underflow");
+
+	pllua_datum_array_push_native(L, lua_upvalueindex(1), t,
+								  buf, nelems, nulls,
+								  arr->ndims, arr->dims, arr->lbound);
+	return 1;
+}
+
+/*
+ * add(array,scalar)
+ * mul(array,scalar)
+ *
+ * Return a new array of the same type and shape with scalar added to, or
+ * multiplied into, every non-null element.
+ */
+static int
+pllua_datum_array_add(lua_State *L)
+{
+	return pllua_datum_array_arith(L, false);
+}
+
+static int
+pllua_datum_array_mul(lua_State *L)
+{
+	return pllua_datum_array_arith(L, true);
+}
+
+/*
+ * filter(array,mask)
+ *
+ * mask is either a boolean[] datum or a Lua table of booleans, either way
+ * indexed in storage order; returns a new one-dimensional array of the
+ * elements for which the mask is true (null mask entries count as false).
+ */
+static int
+pllua_datum_array_filter(lua_State *L)
+{
+	pllua_datum *d = pllua_checkdatum(L, 1, lua_upvalueindex(1));
+	pllua_typeinfo *t = pllua_totypeinfo(L, lua_upvalueindex(1));
+	ExpandedArrayHeader *arr = pllua_datum_array_elements(L, d, t);
+	Datum	   *values = arr->dvalues;
+	bool	   *nulls = arr->dnulls;
+	int			nelems = arr->nelems;
+	bool	   *sel;
+	bool	   *outnulls;
+	char	   *buf;
+	bool		anynull = false;
+	int			nout = 0;
+	int			lbound = 1;
+	int			i;
+
+	sel = lua_newuserdata(L, Max(nelems, 1) * sizeof(bool));
+
+	if (lua_type(L, 2) == LUA_TTABLE)
+	{
+		for (i = 0; i < nelems; ++i)
+		{
+			lua_rawgeti(L, 2, i+1);
+			sel[i] = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+		}
+	}
+	else
+	{
+		pllua_typeinfo *mt;
+		pllua_datum *md = pllua_toanydatum(L, 2, &mt);
+		ExpandedArrayHeader *marr;
+
+		if (!md || !mt->is_array || mt->elemtype != BOOLOID)
+			luaL_argerror(L, 2, "boolean array or table expected");
+		marr = pllua_datum_array_deconstruct(L, md, mt);
+		if (marr->nelems != nelems)
+			luaL_error(L, "mask must have the same number of elements as the array");
+		for (i = 0; i < nelems; ++i)
+			sel[i] = (!(marr->dnulls && marr->dnulls[i])
+					  && DatumGetBool(marr->dvalues[i]));
+	}
+
+	buf = lua_newuserdata(L, Max(nelems, 1) * t->elemtyplen);
+	outnulls = lua_newuserdata(L, Max(nelems, 1) * sizeof(bool));
+
+	for (i = 0; i < nelems; ++i)
+	{
+		if (!sel[i])
+			continue;
+		if (nulls && nulls[i])
+		{
+			anynull = true;
+			outnulls[nout++] = true;
+			continue;
+		}
+		outnulls[nout] = false;
+		pllua_datum_array_store_native(buf, nout++, values[i], t->elemtype);
+	}
+
+	pllua_datum_array_push_native(L, lua_upvalueindex(1), t,
+								  buf, nout, anynull ? outnulls : NULL,
+								  1, &nout, &lbound);
+	return 1;
+}
+
+#define PLLUA_ARRAY_PACK(ctype_, get_)				\
+	do {											\
+		ctype_	   *out = (ctype_ *) buf;			\
+		for (i = 0; i < nelems; ++i)				\
+			out[i] = get_(values[i]);				\
+	} while (0)
+
+/*
+ * pack(array)
+ *
+ * Return the elements (in storage order) as a string of packed native
+ * values, e.g. for handing to a C library via LuaJIT's FFI. The inverse is
+ * typeinfo:frompacked(str). Nulls are not allowed.
+ */
+static int
+pllua_datum_array_pack(lua_State *L)
+{
+	pllua_datum *d = pllua_checkdatum(L, 1, lua_upvalueindex(1));
+	pllua_typeinfo *t = pllua_totypeinfo(L, lua_upvalueindex(1));
+	ExpandedArrayHeader *arr = pllua_datum_array_elements(L, d, t);
+	Datum	   *values = arr->dvalues;
+	bool	   *nulls = arr->dnulls;
+	int			nelems = arr->nelems;
+	char	   *buf;
+	int			i;
+
+	if (nulls)
+	{
+		for (i = 0; i < nelems; ++i)
+			if (nulls[i])
+				luaL_error(L, "cannot pack an array containing nulls");
+	}
+
+	buf = lua_newuserdata(L, Max(nelems, 1) * t->elemtyplen);
+
+	switch (t->elemtype)
+	{
+		case INT2OID:	PLLUA_ARRAY_PACK(int16, DatumGetInt16); break;
+		case INT4OID:	PLLUA_ARRAY_PACK(int32, DatumGetInt32); break;
+		case INT8OID:	PLLUA_ARRAY_PACK(int64, DatumGetInt64); break;
+		case FLOAT4OID:	PLLUA_ARRAY_PACK(float4, DatumGetFloat4); break;
+		case FLOAT8OID:	PLLUA_ARRAY_PACK(float8, DatumGetFloat8); break;
+	}
+
+	lua_pushlstring(L, buf, (size_t) nelems * t->elemtyplen);
+	return 1;
+}
+
+/*
+ * view(array)
+ *
+ * Returns a read-only view object indexed by flat element position 1..n,
+ * which converts elements to Lua values only as they are read, rather than
+ * building a whole table as :table() does. The view refers to the array
+ * datum (not its storage), so it stays valid, and sees any changes, if the
+ * array is modified.
+ *
+ * Elements are read in place from the flat data area when the array has no
+ * nulls and its flat form is current, otherwise from the deconstructed
+ * dvalues.
+ */
+struct arrayview
+{
+	pllua_datum *d;
+	pllua_typeinfo *t;
+};
+
+static int
+pllua_datum_array_view(lua_State *L)
+{
+	pllua_datum *d = pllua_checkdatum(L, 1, lua_upvalueindex(1));
+	pllua_typeinfo *t = pllua_totypeinfo(L, lua_upvalueindex(1));
+	struct arrayview *v;
+
+	pllua_datum_array_elements(L, d, t);
+
+	v = pllua_newobject(L, PLLUA_ARRAYVIEW_OBJECT, sizeof(struct arrayview), true);
+	v->d = d;
+	v->t = t;
+	lua_pushvalue(L, 1);
+	pllua_set_user_field(L, -2, "datum");
+	return 1;
+}
+
+static ExpandedArrayHeader *
+pllua_arrayview_array(lua_State *L, struct arrayview *v, int *nelems)
+{
+	ExpandedArrayHeader *arr = pllua_datum_array_value(L, v->d, v->t);
+	int			n = 0;
+	int			i;
+
+	if (arr->dvalues)
+		n = arr->nelems;
+	else if (arr->ndims > 0)
+	{
+		for (n = 1, i = 0; i < arr->ndims; ++i)
+			n *= arr->dims[i];
+	}
+
+	*nelems = n;
+	return arr;
+}
+
+/* push element i (1-based) */
+static void
+pllua_arrayview_push(lua_State *L, struct arrayview *v, lua_Integer i)
+{
+	int			nelems;
+	ExpandedArrayHeader *arr = pllua_arrayview_array(L, v, &nelems);
+
+	if (i < 1 || i > nelems)
+	{
+		lua_pushnil(L);
+		return;
+	}
+	--i;
+
+	if (arr->fvalue && !ARR_HASNULL(arr->fvalue))
+	{
+		const char *p = ARR_DATA_PTR(arr->fvalue);
+
+		switch (v->t->elemtype)
+		{
+			case INT2OID:	lua_pushinteger(L, ((const int16 *) p)[i]); break;
+			case INT4OID:	lua_pushinteger(L, ((const int32 *) p)[i]); break;
+			case INT8OID:	lua_pushinteger(L, ((const int64 *) p)[i]); break;
+			case FLOAT4OID:	lua_pushnumber(L, ((const float4 *) p)[i]); break;
+			case FLOAT8OID:	lua_pushnumber(L, ((const float8 *) p)[i]); break;
+		}
+		return;
+	}
+
+	if (!arr->dvalues)
+		arr = pllua_datum_array_deconstruct(L, v->d, v->t);
+
+	if (arr->dnulls && arr->dnulls[i])
+		lua_pushnil(L);
+	else
+	{
+		Datum		val = arr->dvalues[i];
+
+		switch (v->t->elemtype)
+		{
+			case INT2OID:	lua_pushinteger(L, DatumGetInt16(val)); break;
+			case INT4OID:	lua_pushinteger(L, DatumGetInt32(val)); break;
+			case INT8OID:	lua_pushinteger(L, DatumGetInt64(val)); break;
+			case FLOAT4OID:	lua_pushnumber(L, DatumGetFloat4(val)); break;
+			case FLOAT8OID:	lua_pushnumber(L, DatumGetFloat8(val)); break;
+		}
+	}
+}
+
+static int
+pllua_arrayview_index(lua_State *L)
+{
+	struct arrayview *v = pllua_checkobject(L, 1, PLLUA_ARRAYVIEW_OBJECT);
+
+	if (lua_isinteger(L, 2))
+		pllua_arrayview_push(L, v, lua_tointeger(L, 2));
+	else if (lua_type(L, 2) == LUA_TSTRING &&
+			 luaL_getmetafield(L, 1, "__methods") != LUA_TNIL)
+		lua_getfield(L, -1, lua_tostring(L, 2));
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+static int
+pllua_arrayview_len(lua_State *L)
+{
+	struct arrayview *v = pllua_checkobject(L, 1, PLLUA_ARRAYVIEW_OBJECT);
+	int			nelems;
+
+	pllua_arrayview_array(L, v, &nelems);
+	lua_pushinteger(L, nelems);
+	return 1;
+}
+
+static int
+pllua_arrayview_next(lua_State *L)
+{
+	struct arrayview *v = pllua_checkobject(L, 1, PLLUA_ARRAYVIEW_OBJECT);
+	lua_Integer i = luaL_checkinteger(L, 2) + 1;
+	int			nelems;
+
+	pllua_arrayview_array(L, v, &nelems);
+	if (i > nelems)
+		return 0;
+	lua_pushinteger(L, i);
+	pllua_arrayview_push(L, v, i);
+	return 2;
+}
+
+static int
+pllua_arrayview_pairs(lua_State *L)
+{
+	pllua_checkobject(L, 1, PLLUA_ARRAYVIEW_OBJECT);
+	lua_pushcfunction(L, pllua_arrayview_next);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+	return 3;
+}
+
+/*
+ * view:ptr()
+ *
+ * Address of the packed element data as a light userdata (e.g. for
+ * ffi.cast on LuaJIT), or nil if the array has nulls or no current flat
+ * form. The pointer is only valid while the array is neither modified nor
+ * garbage-collected.
+ */
+static int
+pllua_arrayview_ptr(lua_State *L)
+{
+	struct arrayview *v = pllua_checkobject(L, 1, PLLUA_ARRAYVIEW_OBJECT);
+	int			nelems;
+	ExpandedArrayHeader *arr = pllua_arrayview_array(L, v, &nelems);
+
+	if (nelems > 0 && arr->fvalue && !ARR_HASNULL(arr->fvalue))
+		lua_pushlightuserdata(L, ARR_DATA_PTR(arr->fvalue));
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+static struct luaL_Reg arrayview_mt[] = {
+	{ "__index", pllua_arrayview_index },
+	{ "__len", pllua_arrayview_len },
+	{ "__pairs", pllua_arrayview_pairs },
+	{ "__ipairs", pllua_arrayview_pairs },
+	{ NULL, NULL }
+};
+
+static struct luaL_Reg arrayview_methods[] = {
+	{ "ptr", pllua_arrayview_ptr },
+	{ NULL, NULL }
+};
+
 /*
  * deform a range value and cache the details
  */
@@ -2498,6 +3469,15 @@ static struct luaL_Reg datumobj_array_methods[] = {
 	{ "table", pllua_datum_array_map },
 	{ "map", pllua_datum_array_map },
 	{ "mapnull", pllua_datum_array_map },
+	{ "sum", pllua_datum_array_sum },
+	{ "min", pllua_datum_array_min },
+	{ "max", pllua_datum_array_max },
+	{ "dot", pllua_datum_array_dot },
+	{ "add", pllua_datum_array_add },
+	{ "mul", pllua_datum_array_mul },
+	{ "filter", pllua_datum_array_filter },
+	{ "pack", pllua_datum_array_pack },
+	{ "view", pllua_datum_array_view },
 	{ NULL, NULL }
 };
 
@@ -2732,6 +3712,8 @@ pllua_typeinfo *pllua_newtypeinfo_raw(lua_State *L, Oid oid, int32 typmod, Tuple
 	if (!t)
 		return t;
 
+	++(pllua_getinterpreter(L)->n_typeinfos);
+
 	pllua_record_gc_debt(L, 4096);  /* somewhat arbitrary */
 
 	/*
@@ -3086,6 +4068,9 @@ int pllua_typeinfo_invalidate(lua_State *L)
 	Oid typoid = inval->inval_typeoid;
 	Oid relid = inval->inval_reloid;
 
+	/* anything caching typeinfos outside the registry must look again */
+	++(pllua_getinterpreter(L)->typeinfo_gen);
+
 	lua_rawgetp(L, LUA_REGISTRYINDEX, PLLUA_TYPES);
 
 	if (inval->inval_type)
@@ -3140,6 +4125,8 @@ static int pllua_typeinfo_gc(lua_State *L)
 	if (!obj)
 		return 0;
 
+	--(pllua_getinterpreter(L)->n_typeinfos);
+
 	PLLUA_TRY();
 	{
 		/*
@@ -3948,6 +4935,36 @@ static int pllua_typeinfo_frombinary(lua_State *L)
 	return 1;
 }
 
+/*
+ * frompacked(str)
+ *
+ * Construct a one-dimensional array from a string of packed native element
+ * values, as returned by the :pack() method of an array datum.
+ */
+static int pllua_typeinfo_frompacked(lua_State *L)
+{
+	pllua_typeinfo *t = pllua_checktypeinfo(L, 1, true);
+	size_t len = 0;
+	const char *str = luaL_checklstring(L, 2, &len);
+	int nelems;
+	int lbound = 1;
+
+	if (t->modified || t->obsolete)
+		luaL_error(L, "cannot create values for a dropped or modified type");
+
+	if (!t->is_array || !pllua_datum_array_kernel_type(t->elemtype))
+		luaL_error(L, "frompacked requires an array of int2, int4, int8, float4 or float8");
+
+	if (len % t->elemtyplen != 0)
+		luaL_error(L, "packed string length is not a multiple of the element size");
+	if (len / t->elemtyplen > MaxArraySize)
+		luaL_error(L, "number of elements in array exceeds limit");
+	nelems = (int) (len / t->elemtyplen);
+
+	pllua_datum_array_push_native(L, 1, t, str, nelems, NULL, 1, &nelems, &lbound);
+	return 1;
+}
+
 /*
  * "nd" indexes a table (or table-like object)
  * t = target typeinfo
@@ -5375,6 +6392,7 @@ static struct luaL_Reg typeinfo_mt[] = {
 static struct luaL_Reg typeinfo_methods[] = {
 	{ "fromstring", pllua_typeinfo_fromstring },
 	{ "frombinary", pllua_typeinfo_frombinary },
+	{ "frompacked", pllua_typeinfo_frompacked },
 	{ "element", pllua_typeinfo_element },
 	{ "dump", pllua_dump_typeinfo },
 	{ "name", pllua_typeinfo_name },
@@ -5428,6 +6446,12 @@ int pllua_open_pgtype(lua_State *L)
 	pllua_newmetatable(L, PLLUA_IDXLIST_OBJECT, idxlist_mt);
 	lua_pop(L, 1);
 
+	pllua_newmetatable(L, PLLUA_ARRAYVIEW_OBJECT, arrayview_mt);
+	lua_newtable(L);
+	luaL_setfuncs(L, arrayview_methods, 0);
+	lua_setfield(L, -2, "__methods");
+	lua_pop(L, 1);
+
 	pllua_newmetatable(L, PLLUA_TYPEINFO_OBJECT, typeinfo_mt);
 	lua_newtable(L);
 	luaL_setfuncs(L, typeinfo_methods, 0);
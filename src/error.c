@@ -291,7 +291,17 @@ pllua_rethrow_from_lua(lua_State *L, int rc)
 	 */
 	if (rc == LUA_ERRMEM)
 	{
+		pllua_interpreter *interp = pllua_getinterpreter(L);
+
 		lua_pop(L, 1);
+		if (interp && interp->mem_limit_hit)
+		{
+			interp->mem_limit_hit = false;
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("pllua: out of memory"),
+					 errdetail("Memory limit set by pllua.max_memory was exceeded.")));
+		}
 		elog(ERROR, "pllua: out of memory");
 	}
 
@@ -572,7 +582,9 @@ pllua_initial_protected_call(pllua_interpreter *interp,
 
 	interp->cur_activation = *arg;  /* copies content not pointer */
 
+	++interp->call_depth;
 	rc = pllua_cpcall(interp->L, func, &interp->cur_activation);
+	--interp->call_depth;
 
 	/*
 	 * We better not have longjmp'd past any pg catch blocks.
@@ -787,12 +799,23 @@ int pllua_t_lxpcall (lua_State *L) {
  *
  * This is all aimed at preserving the following invariant: we can only run the
  * user's Lua code inside an error-free subtransaction.
+ *
+ * The subtransaction is not actually started until the protected code first
+ * enters PG via PLLUA_TRY (see pllua_subxact_start below); code that never
+ * touches the database, such as pcall used for pure Lua error handling, never
+ * pays for it. Since the protected code can't have done anything to the
+ * database before that point, there is nothing that an earlier start could
+ * have rolled back, so the invariant still holds. Unstarted entries are
+ * always the topmost ones on the stack, and are started in stack order.
  */
 
 typedef struct pllua_subxact
 {
 	volatile struct pllua_subxact *prev;
-	bool				onstack;
+	bool				onstack;	/* subxact started and not yet ended */
+	bool				pending;	/* on stack, subxact not started */
+	bool				failed;		/* starting the subxact threw an error */
+	bool				saved_pending_error;	/* pllua_pending_error at push */
     ResourceOwner		resowner;
     MemoryContext		mcontext;
 	ResourceOwner		own_resowner;
@@ -800,12 +823,80 @@ typedef struct pllua_subxact
 
 static volatile pllua_subxact *subxact_stack_top = NULL;
 
+/* number of pending, not failed, entries at the top of the stack */
+int pllua_subxact_pending = 0;
+
+static void
+pllua_subxact_start_one(volatile pllua_subxact *xa, int n)
+{
+	MemoryContext oldcontext;
+
+	if (n > 1)
+		pllua_subxact_start_one(xa->prev, n - 1);
+
+	Assert(xa->pending);
+	oldcontext = CurrentMemoryContext;
+	xa->resowner = CurrentResourceOwner;
+
+	BeginInternalSubTransaction(NULL);
+
+	MemoryContextSwitchTo(oldcontext);
+	xa->own_resowner = CurrentResourceOwner;
+	xa->pending = false;
+	xa->failed = false;
+	xa->onstack = true;
+}
+
+/*
+ * Start all pending subtransactions, outermost first. Called in PG context
+ * from within PLLUA_TRY. If this throws, the entries not yet started are left
+ * marked as failed, and their pcalls rethrow the error to the enclosing
+ * context rather than catching it, just as if the subtransaction had been
+ * started eagerly in the caller.
+ */
+void
+pllua_subxact_start(void)
+{
+	int			n = pllua_subxact_pending;
+	volatile pllua_subxact *xa = subxact_stack_top;
+	int			i;
+
+	for (i = 0; i < n; ++i, xa = xa->prev)
+		xa->failed = true;
+	pllua_subxact_pending = 0;
+
+	pllua_subxact_start_one(subxact_stack_top, n);
+}
+
+/*
+ * Remove the top stack entry, aborting its subxact if one was started.
+ */
 static void
 pllua_subxact_abort(lua_State *L)
 {
+	volatile pllua_subxact *xa = subxact_stack_top;
+
+	if (xa->pending)
+	{
+		/*
+		 * Nothing to roll back, since any PG error thrown inside the pcall
+		 * would have started the subxact first; but don't leave behind a
+		 * pending error that the pcall has now caught. (A failed entry's
+		 * error belongs to the enclosing context, so that stays pending.)
+		 */
+		Assert(!xa->onstack);
+		xa->pending = false;
+		subxact_stack_top = xa->prev;
+		if (!xa->failed)
+		{
+			--pllua_subxact_pending;
+			pllua_pending_error = xa->saved_pending_error;
+		}
+		return;
+	}
+
 	PLLUA_TRY();
 	{
-		volatile pllua_subxact *xa = subxact_stack_top;
 		Assert(xa->onstack);
 		xa->onstack = false;
 		subxact_stack_top = xa->prev;
@@ -836,6 +927,17 @@ pllua_intercept_error(lua_State *L)
 		lua_pushboolean(L, 1);
 		lua_replace(L, lua_upvalueindex(2));
 
+		/*
+		 * If the error is from a failure to start our subxact, it belongs to
+		 * the enclosing context; don't let the handler see it.
+		 */
+		if (subxact_stack_top->failed)
+		{
+			pllua_subxact_abort(L);
+			lua_settop(L, 1);
+			return 1;
+		}
+
 		/*
 		 * It's possible to get here with a non-pg error as the current error
 		 * value while there's a pg error in the registry. But if we're
@@ -944,6 +1046,7 @@ pllua_t_pcall_guts(lua_State *L, bool is_xpcall)
 	MemoryContext oldcontext = CurrentMemoryContext;
 	volatile int rc;
 	volatile bool rethrow = false;
+	volatile bool failed = false;
 
 	PLLUA_CHECK_PG_STACK_DEPTH();
 
@@ -975,27 +1078,40 @@ pllua_t_pcall_guts(lua_State *L, bool is_xpcall)
 
 	ASSERT_LUA_CONTEXT;
 
+	/* push a pending entry; the subxact itself is started on demand */
+	xa.resowner = CurrentResourceOwner;
+	xa.mcontext = oldcontext;
+	xa.onstack = false;
+	xa.pending = true;
+	xa.failed = false;
+	xa.saved_pending_error = pllua_pending_error;
+	xa.prev = subxact_stack_top;
+	xa.own_resowner = NULL;
+	subxact_stack_top = &xa;
+	++pllua_subxact_pending;
+
 	pllua_setcontext(L, PLLUA_CONTEXT_PG);
 	PG_TRY();
 	{
-		xa.resowner = CurrentResourceOwner;
-		xa.mcontext = oldcontext;
-		xa.onstack = false;
-		xa.prev = subxact_stack_top;
-		xa.own_resowner = NULL;
-
-		BeginInternalSubTransaction(NULL);
-
-		xa.onstack = true;
-		xa.own_resowner = CurrentResourceOwner;
-		subxact_stack_top = &xa;
-
 		rc = pllua_pcall_nothrow(L,
 								 lua_gettop(L) - (is_xpcall ? 4 : 2),
 								 LUA_MULTRET,
 								 (is_xpcall ? 2 : 0));
 
-		if (rc == LUA_OK)
+		if (xa.failed)
+		{
+			/* see pllua_subxact_start */
+			Assert(rc != LUA_OK);
+			if (xa.pending)
+				pllua_subxact_abort(L);
+			failed = true;
+		}
+		else if (rc == LUA_OK && xa.pending)
+		{
+			/* nothing touched the database, so there is nothing to commit */
+			pllua_subxact_abort(L);
+		}
+		else if (rc == LUA_OK)
 		{
 			/* Commit the inner transaction, return to outer xact context */
 			ReleaseCurrentSubTransaction();
@@ -1003,9 +1119,10 @@ pllua_t_pcall_guts(lua_State *L, bool is_xpcall)
 			CurrentResourceOwner = xa.resowner;
 
 			Assert(subxact_stack_top == &xa);
+			xa.onstack = false;
 			subxact_stack_top = xa.prev;
 		}
-		else if (xa.onstack)
+		else if (xa.onstack || xa.pending)
 			pllua_subxact_abort(L);
 		else
 		{
@@ -1022,10 +1139,10 @@ pllua_t_pcall_guts(lua_State *L, bool is_xpcall)
 		pllua_setcontext(NULL, PLLUA_CONTEXT_LUA);
 		/* absorb the error and get out of pg's error handling */
 		pllua_absorb_pg_error(L);
-		if (xa.onstack)
+		if (xa.onstack || xa.pending)
 			pllua_subxact_abort(L);
 		/*
-		 * Can only get here if begin or release of the subxact threw an error.
+		 * Can only get here if release of the subxact threw an error.
 		 * (We assume that release of a subxact can only result in aborting it
 		 * instead.) Treat this as an error within the parent context.
 		 */
@@ -1035,6 +1152,9 @@ pllua_t_pcall_guts(lua_State *L, bool is_xpcall)
 	PG_END_TRY();
 	pllua_setcontext(NULL, PLLUA_CONTEXT_LUA);
 
+	if (failed)
+		lua_error(L);
+
 	if (rc == LUA_OK)
 	{
 		/*
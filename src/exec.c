@@ -7,12 +7,15 @@
 #include "commands/trigger.h"
 #include "commands/event_trigger.h"
 #include "utils/datum.h"
+#include "utils/resowner.h"
+#include "utils/tuplestore.h"
 
 static void
 pllua_common_lua_init(lua_State *L, FunctionCallInfo fcinfo)
 {
 	Assert(pllua_context == PLLUA_CONTEXT_LUA);
 	luaL_checkstack(L, 40, NULL);
+	pllua_update_hook(L);
 }
 
 static void
@@ -23,12 +26,63 @@ pllua_common_lua_exit(lua_State *L)
 	if (pllua_track_gc_debt)
 	{
 		pllua_interpreter *interp = pllua_getinterpreter(L);
-		unsigned long gc_debt = interp->gc_debt;
-		interp->gc_debt = 0;
-		pllua_run_extra_gc(L, gc_debt);
+		interp->gc_debt = pllua_run_extra_gc(L, interp->gc_debt, false);
 	}
 }
 
+/*
+ * Push the typeinfo for slot idx (0 for the result, 1..n for args) of the
+ * activation. The lookup is only done if the cached entry is missing, is for a
+ * different type, or older than the last typeinfo invalidation; this saves a
+ * registry lookup and a lua_call per value on the common path.
+ */
+static pllua_typeinfo *
+pllua_activation_typeinfo(lua_State *L, pllua_func_activation *act,
+						  int idx, Oid typeoid, int32 typmod)
+{
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+	pllua_typeinfo *t;
+
+	if (act->typeinfo_ref == LUA_NOREF)
+	{
+		lua_newtable(L);
+		act->typeinfo_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		act->typeinfo_gen = interp->typeinfo_gen;
+	}
+	else if (act->typeinfo_gen != interp->typeinfo_gen)
+	{
+		lua_newtable(L);
+		lua_rawseti(L, LUA_REGISTRYINDEX, act->typeinfo_ref);
+		act->typeinfo_gen = interp->typeinfo_gen;
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, act->typeinfo_ref);
+	if (lua_rawgeti(L, -1, idx) == LUA_TUSERDATA)
+	{
+		t = pllua_totypeinfo(L, -1);
+		if (t && t->typeoid == typeoid
+			&& (typeoid != RECORDOID || t->typmod == typmod))
+		{
+			lua_remove(L, -2);
+			return t;
+		}
+	}
+	lua_pop(L, 1);
+
+	lua_pushcfunction(L, pllua_typeinfo_lookup);
+	lua_pushinteger(L, (lua_Integer) typeoid);
+	lua_pushinteger(L, (lua_Integer) typmod);
+	lua_call(L, 2, 1);
+	if (lua_isnil(L, -1))
+		luaL_error(L, "failed to find typeinfo");
+	t = pllua_checktypeinfo(L, -1, false);
+
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -3, idx);
+	lua_remove(L, -2);
+	return t;
+}
+
 /*
  * Given that the top "nret" items on the stack are the return value, convert
  * to Datum/isnull.
@@ -46,15 +100,16 @@ pllua_common_lua_exit(lua_State *L)
  * that.
  *
  * Otherwise we simply pass the whole list of values to the type constructor
- * for the return type, which does all the work. We then copy the result to the
- * current memory context (presumed to be the caller's), in order to avoid any
+ * for the return type, which does all the work. We then copy the result to
+ * mcxt (normally the caller's current memory context), in order to avoid any
  * uncertainty regarding garbage collection.
  */
 static Datum
-pllua_return_result(lua_State *L,
-					int nret,
-					pllua_func_activation *act,
-					bool *isnull)
+pllua_return_result_in(lua_State *L,
+					   int nret,
+					   pllua_func_activation *act,
+					   bool *isnull,
+					   MemoryContext mcxt)
 {
 	pllua_typeinfo *ti;
 	pllua_datum *d;
@@ -97,18 +152,12 @@ pllua_return_result(lua_State *L,
 		}
 	}
 
-	lua_pushcfunction(L, pllua_typeinfo_lookup);
 	if (!act->tupdesc)
-	{
-		lua_pushinteger(L, (lua_Integer)(act->rettype));
-		lua_call(L, 1, 1);
-	}
+		ti = pllua_activation_typeinfo(L, act, 0, act->rettype, -1);
 	else
-	{
-		lua_pushinteger(L, (lua_Integer)(act->tupdesc->tdtypeid));
-		lua_pushinteger(L, (lua_Integer)(act->tupdesc->tdtypmod));
-		lua_call(L, 2, 1);
-	}
+		ti = pllua_activation_typeinfo(L, act, 0,
+									   act->tupdesc->tdtypeid,
+									   act->tupdesc->tdtypmod);
 
 	/* stick two copies of the typeinfo below the args */
 	lua_pushvalue(L, -1);
@@ -116,7 +165,6 @@ pllua_return_result(lua_State *L,
 	lua_insert(L, -(nret+2));
 	nt = lua_absindex(L, -(nret+2));
 
-	ti = pllua_checktypeinfo(L, nt, true);
 	if (ti->obsolete || ti->modified)
 		luaL_error(L, "cannot create values for a dropped or modified type");
 
@@ -149,7 +197,10 @@ pllua_return_result(lua_State *L,
 
 		PLLUA_TRY();
 		{
+			MemoryContext oldcontext = MemoryContextSwitchTo(mcxt);
+
 			d_value = datumCopy(d->value, ti->typbyval, ti->typlen);
+			MemoryContextSwitchTo(oldcontext);
 		}
 		PLLUA_CATCH_RETHROW();
 
@@ -157,6 +208,15 @@ pllua_return_result(lua_State *L,
 	}
 }
 
+static Datum
+pllua_return_result(lua_State *L,
+					int nret,
+					pllua_func_activation *act,
+					bool *isnull)
+{
+	return pllua_return_result_in(L, nret, act, isnull, CurrentMemoryContext);
+}
+
 /*
  * If an argument is a record type with a non-NULL value, get the actual
  * typeid/typmod from the record header.
@@ -279,16 +339,8 @@ pllua_push_args(lua_State *L,
 		}
 		else if (pllua_value_from_datum(L, value, argtype) == LUA_TNONE)
 		{
-			pllua_typeinfo *t;
-
-			lua_pushcfunction(L, pllua_typeinfo_lookup);
-			lua_pushinteger(L, (lua_Integer) argtype);
-			lua_pushinteger(L, (lua_Integer) argtypmod);
-			lua_call(L, 2, 1);
-
-			if (lua_isnil(L, -1))
-				luaL_error(L, "failed to find typeinfo");
-			t = *pllua_checkrefobject(L, -1, PLLUA_TYPEINFO_OBJECT);
+			pllua_typeinfo *t = pllua_activation_typeinfo(L, act, i+1,
+														  argtype, argtypmod);
 
 			/*
 			 * arg might be a domain, in which case give pllua_value_from_datum
@@ -320,6 +372,68 @@ pllua_push_args(lua_State *L,
 	return nargs;
 }
 
+/*
+ * Direct path for activations flagged as simple_scalar: every arg is of a
+ * type that pllua_value_from_datum always handles, so no typeinfos, record
+ * checks or savedatum are needed.
+ */
+static int
+pllua_push_scalar_args(lua_State *L,
+					   FunctionCallInfo fcinfo,
+					   pllua_func_activation *act)
+{
+	int			i;
+	int			nargs = PG_NARGS();
+
+	if (nargs != act->nargs)
+		luaL_error(L, "wrong number of args: expected %d got %d", act->nargs, nargs);
+
+	luaL_checkstack(L, 40 + nargs, NULL);
+
+	for (i = 0; i < nargs; ++i)
+	{
+		if (PG_ARGISNULL(i))
+			lua_pushnil(L);
+		else if (pllua_value_from_datum(L, PG_GETARG_DATUM(i),
+										act->argtypes[i]) == LUA_TNONE)
+			luaL_error(L, "unexpected type for argument %d", i);
+	}
+
+	return nargs;
+}
+
+/*
+ * Result counterpart of pllua_push_scalar_args. A single plain Lua value that
+ * pllua_datum_from_value accepts is converted directly into the current
+ * memory context; anything else (including values needing the input function,
+ * and anything that would raise a conversion error) goes through the general
+ * path so that behavior and error messages are unchanged.
+ */
+static Datum
+pllua_return_scalar_result(lua_State *L,
+						   int nret,
+						   pllua_func_activation *act,
+						   bool *isnull)
+{
+	if (nret == 1)
+	{
+		Datum		value;
+		bool		value_isnull;
+		const char *errstr = NULL;
+
+		if (pllua_datum_from_value(L, -1, act->rettype,
+								   &value, &value_isnull, &errstr)
+			&& errstr == NULL)
+		{
+			lua_pop(L, 1);
+			*isnull = value_isnull;
+			return value;
+		}
+	}
+
+	return pllua_return_result(L, nret, act, isnull);
+}
+
 /*
  * Resume an SRF in value-per-call mode (second and subsequent calls come here)
  */
@@ -376,6 +490,158 @@ pllua_resume_function(lua_State *L)
 	return 0;
 }
 
+/*
+ * Store one SRF result row into the tuplestore. Called inside a catch block
+ * with the current memory context being the per-row context.
+ */
+static void
+pllua_materialize_putrow(Tuplestorestate *tupstore,
+						 TupleDesc tupdesc,
+						 pllua_func_activation *act,
+						 Datum value,
+						 bool isnull)
+{
+	if (!act->tupdesc)
+		tuplestore_putvalues(tupstore, tupdesc, &value, &isnull);
+	else if (isnull)
+	{
+		/* a null composite result is a row of nulls, as in value-per-call */
+		Datum	   *values = palloc0(tupdesc->natts * sizeof(Datum));
+		bool	   *nulls = palloc(tupdesc->natts * sizeof(bool));
+
+		memset(nulls, true, tupdesc->natts * sizeof(bool));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	else
+	{
+		HeapTupleHeader td = DatumGetHeapTupleHeader(value);
+		HeapTupleData tuple;
+
+		tuple.t_len = HeapTupleHeaderGetDatumLength(td);
+		ItemPointerSetInvalid(&tuple.t_self);
+		tuple.t_tableOid = InvalidOid;
+		tuple.t_data = td;
+		tuplestore_puttuple(tupstore, &tuple);
+	}
+}
+
+/*
+ * Initial call of an SRF in materialize mode (only if pllua.materialize_srf
+ * is on and the caller allows it). The function and its args are on top of
+ * the stack and nstack is the activation. Rather than returning to the
+ * executor for each row, we resume the coroutine in a loop here, converting
+ * each result with the (cached) return typeinfo and writing it straight into
+ * a tuplestore which is handed back as the whole result set.
+ *
+ * The thread is still registered on the activation while running, so that
+ * error context reporting and cleanup work just as for value-per-call.
+ */
+static void
+pllua_materialize_function(lua_State *L,
+						   int nstack,
+						   int nargs,
+						   ReturnSetInfo *rsi,
+						   pllua_func_activation *fact)
+{
+	lua_State  *thr = pllua_activate_thread(L, nstack, rsi->econtext);
+	Tuplestorestate *volatile tupstore = NULL;
+	volatile TupleDesc tupdesc = NULL;
+	volatile MemoryContext rowcxt = NULL;
+	ResourceOwner owner = CurrentResourceOwner;
+	int			base;
+	int			rc;
+	int			nret;
+	bool		yielded = false;
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(rsi->econtext->ecxt_per_query_memory);
+		tupstore = tuplestore_begin_heap((rsi->allowedModes & SFRM_Materialize_Random) != 0,
+										 false, work_mem);
+		tupdesc = CreateTupleDescCopy(rsi->expectedDesc);
+		MemoryContextSwitchTo(oldcontext);
+
+		rowcxt = AllocSetContextCreate(CurrentMemoryContext,
+									   "pllua SRF row context",
+									   ALLOCSET_SMALL_SIZES);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_xmove(L, thr, nargs + 1);  /* args plus function */
+	base = lua_gettop(L);
+
+	for (;;)
+	{
+		Datum		value;
+		bool		isnull;
+
+		fact->onstack = true;
+		rc = lua_resume(thr, L, nargs, &nret);
+		fact->onstack = false;
+		nargs = 0;
+
+		if (rc != LUA_OK && rc != LUA_YIELD)
+		{
+			lua_xmove(thr, L, 1);
+			pllua_deactivate_thread(L, fact, rsi->econtext);
+			pllua_rethrow_from_lua(L, rc);
+		}
+
+		/*
+		 * As for value-per-call, a final return ends the set and its values
+		 * are ignored, unless nothing was yielded before it, in which case a
+		 * return with values is one row.
+		 */
+		if (rc == LUA_OK && (yielded || nret == 0))
+		{
+			lua_pop(thr, nret);
+			break;
+		}
+
+		luaL_checkstack(L, 10 + nret, NULL);
+		lua_xmove(thr, L, nret);
+
+		/* rowcxt is only made current inside the catch block of the copy */
+		value = pllua_return_result_in(L, nret, fact, &isnull, rowcxt);
+
+		PLLUA_TRY();
+		{
+			ResourceOwner save_owner = CurrentResourceOwner;
+			MemoryContext save_context;
+
+			/* tuplestore temp files must belong to the caller's owner */
+			CurrentResourceOwner = owner;
+			save_context = MemoryContextSwitchTo(rowcxt);
+			pllua_materialize_putrow(tupstore, tupdesc, fact, value, isnull);
+			MemoryContextSwitchTo(save_context);
+			CurrentResourceOwner = save_owner;
+
+			MemoryContextReset(rowcxt);
+		}
+		PLLUA_CATCH_RETHROW();
+
+		lua_settop(L, base);
+
+		if (rc == LUA_OK)
+			break;
+		yielded = true;
+	}
+
+	pllua_deactivate_thread(L, fact, rsi->econtext);
+
+	PLLUA_TRY();
+	{
+		MemoryContextDelete(rowcxt);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	rsi->returnMode = SFRM_Materialize;
+	rsi->setResult = tupstore;
+	rsi->setDesc = tupdesc;
+}
+
 /*
  * Main entry point for function calls
  */
@@ -406,9 +672,24 @@ pllua_call_function(lua_State *L)
 	/* func should be the only thing on the stack after the act */
 	Assert(lua_gettop(L) == nstack + 1);
 
-	nargs = pllua_push_args(L, fcinfo, fact);
+	if (fact->simple_scalar)
+		nargs = pllua_push_scalar_args(L, fcinfo, fact);
+	else
+		nargs = pllua_push_args(L, fcinfo, fact);
 
-	if (fact->retset)
+	if (fact->retset
+		&& pllua_materialize_srf
+		&& (rsi->allowedModes & SFRM_Materialize)
+		&& rsi->expectedDesc
+		&& (fact->tupdesc || rsi->expectedDesc->natts == 1))
+	{
+		pllua_materialize_function(L, nstack, nargs, rsi, fact);
+		act->retval = (Datum)0;
+		fcinfo->isnull = true;
+		pllua_common_lua_exit(L);
+		return 0;
+	}
+	else if (fact->retset)
 	{
 		/*
 		 * This is the initial call into a SRF. Activate a new thread (which
@@ -478,9 +759,14 @@ pllua_call_function(lua_State *L)
 	 * result. the func_info is not on the stack any more, but we know it must
 	 * be referenced from the activation
 	 */
-	act->retval = pllua_return_result(L, lua_gettop(L) - nstack,
-									  fact,
-									  &fcinfo->isnull);
+	if (fact->simple_scalar)
+		act->retval = pllua_return_scalar_result(L, lua_gettop(L) - nstack,
+												 fact,
+												 &fcinfo->isnull);
+	else
+		act->retval = pllua_return_result(L, lua_gettop(L) - nstack,
+										  fact,
+										  &fcinfo->isnull);
 
 	pllua_common_lua_exit(L);
 
@@ -18,12 +18,18 @@ char PLLUA_ACTIVATIONS[] = "activations";
 char PLLUA_TYPES[] = "types";
 char PLLUA_RECORDS[] = "records";
 char PLLUA_PORTALS[] = "cursors";
+char PLLUA_SPI_PLANCACHE[] = "spi plan cache";
+char PLLUA_SPI_PLANCACHE_LRU[] = "spi plan cache lru";
 char PLLUA_TRUSTED[] = "trusted";
 char PLLUA_USERID[] = "userid";
 char PLLUA_LANG_OID[] = "language oid";
 char PLLUA_FUNCTION_OBJECT[] = "function object";
 char PLLUA_ERROR_OBJECT[] = "error object";
 char PLLUA_IDXLIST_OBJECT[] = "idxlist object";
+char PLLUA_ARRAYVIEW_OBJECT[] = "array view object";
+char PLLUA_JSONB_BUILDER_OBJECT[] = "jsonb builder object";
+char PLLUA_JSONB_VIEW_OBJECT[] = "jsonb view object";
+char PLLUA_NUMERIC_ACCUM_OBJECT[] = "numeric accumulator object";
 char PLLUA_ACTIVATION_OBJECT[] = "activation object";
 char PLLUA_MCONTEXT_OBJECT[] = "memory context object";
 char PLLUA_TYPEINFO_OBJECT[] = "typeinfo object";
@@ -32,8 +38,10 @@ char PLLUA_TYPEINFO_PACKAGE_ARRAY_OBJECT[] = "typeinfo package array object";
 char PLLUA_TUPCONV_OBJECT[] = "tupconv object";
 char PLLUA_TRIGGER_OBJECT[] = "trigger object";
 char PLLUA_EVENT_TRIGGER_OBJECT[] = "event trigger object";
+char PLLUA_TRIGGER_TABLE_OBJECT[] = "trigger transition table object";
 char PLLUA_SPI_STMT_OBJECT[] = "SPI statement object";
 char PLLUA_SPI_CURSOR_OBJECT[] = "SPI cursor object";
+char PLLUA_SPI_FUNC_OBJECT[] = "SPI function handle object";
 char PLLUA_LAST_ERROR[] = "last error";
 char PLLUA_RECURSIVE_ERROR[] = "recursive error";
 char PLLUA_FUNCTION_MEMBER[] = "function element";
@@ -8,12 +8,21 @@
 #include "pllua.h"
 
 #include "access/htup_details.h"
+#if PG_VERSION_NUM >= 90600
+#include "access/parallel.h"
+#endif
+#include "access/xact.h"
 #include "catalog/pg_proc.h"
 #include "nodes/pg_list.h"
+#include "portability/instr_time.h"
 #include "storage/ipc.h"
+#include "utils/builtins.h"
 #include "utils/inval.h"
+#include "utils/resowner.h"
 #include "utils/syscache.h"
 
+#include <ctype.h>
+
 #include <time.h>
 
 PGDLLEXPORT void _PG_init(void);
@@ -22,7 +31,11 @@ PGDLLEXPORT void _PG_init(void);
 
 static bool simulate_memory_failure = false;
 
-static HTAB *pllua_interp_hash = NULL;
+/* stats.c also needs these */
+HTAB *pllua_interp_hash = NULL;
+unsigned long pllua_interp_hits = 0;
+unsigned long pllua_interp_held_used = 0;
+unsigned long pllua_interp_created = 0;
 
 static List *held_states = NIL;
 
@@ -30,13 +43,29 @@ static char *pllua_on_init = NULL;
 static char *pllua_on_trusted_init = NULL;
 static char *pllua_on_untrusted_init = NULL;
 static char *pllua_on_common_init = NULL;
+static char *pllua_prewarm_list = NULL;
 static bool pllua_do_check_for_interrupts = true;
+static bool pllua_interrupt_check_on_return = true;
+static int pllua_interrupt_check_interval = 100000;
+static bool pllua_use_slab_allocator = false;
+static int pllua_max_memory = 0;
 /* trusted.c also needs this */
 bool pllua_do_install_globals = true;
+/* compile.c also needs this */
+char *pllua_bytecode_cache_dir = NULL;
+/* spi.c also needs this */
+int pllua_spi_plan_cache_size = 32;
+/* exec.c also needs this */
+bool pllua_materialize_srf = false;
+/* stats.c and pllua.c also need these */
+bool pllua_profile_enabled = false;
+bool pllua_profile_lines = false;
 static int pllua_num_held_interpreters = 1;
 static char *pllua_reload_ident = NULL;
 static double pllua_gc_threshold = 0;
 static double pllua_gc_multiplier = 0;
+static bool pllua_gc_adaptive = false;
+static bool pllua_gc_at_xact_end = false;
 
 static const char *pllua_pg_version_str = NULL;
 static const char *pllua_pg_version_num = NULL;
@@ -86,6 +115,7 @@ pllua_getstate(bool trusted, pllua_activation_record *act)
 				pllua_rethrow_from_lua(interp->L, rc);  /* unlikely, but be safe */
 		}
 
+		++pllua_interp_hits;
 		return interp;
 	}
 
@@ -104,6 +134,7 @@ pllua_getstate(bool trusted, pllua_activation_record *act)
 	{
 		pllua_interpreter *interp = linitial(held_states);
 		held_states = list_delete_first(held_states);
+		++pllua_interp_held_used;
 		pllua_newstate_phase2(interp_desc, interp, trusted, user_id, act);
 		return interp;
 	}
@@ -112,6 +143,7 @@ pllua_getstate(bool trusted, pllua_activation_record *act)
 		pllua_interpreter *interp = pllua_newstate_phase1(pllua_reload_ident);
 		if (!interp)
 			elog(ERROR, "PL/Lua: interpreter creation failed");
+		++pllua_interp_created;
 		pllua_newstate_phase2(interp_desc, interp, trusted, user_id, act);
 		return interp;
 	}
@@ -136,6 +168,12 @@ pllua_create_held_states(const char *ident)
 	MemoryContextSwitchTo(oldcontext);
 }
 
+int
+pllua_num_held_states(void)
+{
+	return list_length(held_states);
+}
+
 static void
 pllua_destroy_held_states(void)
 {
@@ -152,6 +190,7 @@ pllua_destroy_held_states(void)
 		pllua_setcontext(NULL, PLLUA_CONTEXT_LUA);
 		lua_close(interp->L); /* can't throw, but has internal lua catch blocks */
 		pllua_setcontext(NULL, PLLUA_CONTEXT_PG);
+		pllua_slab_release(interp);
 		MemoryContextDelete(interp->mcxt);
 	}
 }
@@ -221,42 +260,208 @@ pllua_set_new_ident(lua_State *L)
 }
 
 
+/*
+ * Debt tracking is needed if any of the extra-GC mechanisms is in use. The
+ * assign hooks are called before the variable itself is updated, hence the
+ * parameters.
+ */
+static void
+pllua_set_track_gc_debt(double multiplier, bool adaptive, bool at_xact_end)
+{
+	pllua_track_gc_debt = (multiplier > 0.0 || adaptive || at_xact_end);
+}
+
 static void
 pllua_assign_gc_multiplier(double newval, void *extra)
 {
-	if (newval > 0.0)
-		pllua_track_gc_debt = true;
+	pllua_set_track_gc_debt(newval, pllua_gc_adaptive, pllua_gc_at_xact_end);
+}
+
+static void
+pllua_assign_gc_adaptive(bool newval, void *extra)
+{
+	pllua_set_track_gc_debt(pllua_gc_multiplier, newval, pllua_gc_at_xact_end);
+}
+
+static void
+pllua_assign_gc_at_xact_end(bool newval, void *extra)
+{
+	pllua_set_track_gc_debt(pllua_gc_multiplier, pllua_gc_adaptive, newval);
+}
+
+/*
+ * Run a GC call and account for the time it took.
+ */
+static void
+pllua_timed_gc(lua_State *L, pllua_interpreter *interp, int what, int data)
+{
+	instr_time	start_time;
+	instr_time	end_time;
+
+	INSTR_TIME_SET_CURRENT(start_time);
+	lua_gc(L, what, data);
+	INSTR_TIME_SET_CURRENT(end_time);
+	INSTR_TIME_SUBTRACT(end_time, start_time);
+
+	interp->gc_runs++;
+	interp->gc_time += INSTR_TIME_GET_DOUBLE(end_time);
+	pllua_profile_gc_time += INSTR_TIME_GET_DOUBLE(end_time);
+}
+
+/*
+ * Adaptive mode: rather than a fixed multiplier, scale the work done by how
+ * large the external debt is relative to the Lua heap itself. A Lua heap
+ * holding a few small datum references to large detoasted values looks
+ * small to the collector but isn't, and the ratio is what tells us that.
+ *
+ * A smoothed ratio is also used to lower the collector's pause, so that
+ * workloads that consistently generate lots of external memory start their
+ * normal cycles sooner instead of relying entirely on our extra steps.
+ */
+static void
+pllua_run_adaptive_gc(lua_State *L, pllua_interpreter *interp,
+					  unsigned long gc_debt)
+{
+	size_t		heap = interp->mem_used;
+	double		ratio;
+	double		val;
+	int			pause;
+
+	/* mem_used is only maintained if we're tracking the allocator */
+	if (heap == 0)
+		heap = (size_t) lua_gc(L, LUA_GCCOUNT, 0) * 1024;
+	ratio = (double) gc_debt / (double) Max(heap, 65536);
+
+	interp->gc_ratio = 0.75 * interp->gc_ratio + 0.25 * ratio;
+
+	pause = 200 - (int) (100.0 * interp->gc_ratio);
+	pause = Max(pause, 100);
+	if (pause != interp->gc_pause)
+	{
+		lua_gc(L, LUA_GCSETPAUSE, pause);
+		interp->gc_pause = pause;
+	}
+
+	if (ratio >= 1.0)
+	{
+		/*
+		 * More external memory arrived since the last check than the whole
+		 * Lua heap; stepping won't catch up, so just do it all now.
+		 */
+		pllua_debug(L, "pllua_run_extra_gc: adaptive full collect");
+		pllua_timed_gc(L, interp, LUA_GCCOLLECT, 0);
+	}
 	else
-		pllua_track_gc_debt = false;
+	{
+		int			ival;
+
+		val = (gc_debt / 1024) * (1.0 + interp->gc_ratio);
+		if (val >= (double) INT_MAX)
+			ival = INT_MAX;
+		else
+			ival = (int) val;
+		pllua_debug(L, "pllua_run_extra_gc: adaptive step %d", ival);
+		pllua_timed_gc(L, interp, LUA_GCSTEP, ival);
+	}
 }
 
-void
-pllua_run_extra_gc(lua_State *L, unsigned long gc_debt)
+/*
+ * Returns the debt that remains outstanding. In the fixed-multiplier mode
+ * debt below the threshold is simply forgotten (as it always was), but the
+ * adaptive and commit-time modes carry it forward so that many small calls
+ * eventually add up. If "force" is set the threshold is ignored.
+ */
+unsigned long
+pllua_run_extra_gc(lua_State *L, unsigned long gc_debt, bool force)
 {
+	pllua_interpreter *interp = pllua_getinterpreter(L);
 	double val;
 
-	if (pllua_gc_multiplier == 0.0)
-		return;
+	if (gc_debt == 0)
+		return 0;
 
 	val = gc_debt / 1024;
-	if (val < pllua_gc_threshold)
-		return;
-	if (pllua_gc_multiplier > 999999.0)
+	if (!force && val < pllua_gc_threshold)
+		return (pllua_gc_adaptive || pllua_gc_at_xact_end) ? gc_debt : 0;
+
+	if (pllua_gc_adaptive)
+		pllua_run_adaptive_gc(L, interp, gc_debt);
+	else if (pllua_gc_multiplier > 999999.0)
 	{
 		pllua_debug(L, "pllua_run_extra_gc: full collect");
-		lua_gc(L, LUA_GCCOLLECT, 0);
+		pllua_timed_gc(L, interp, LUA_GCCOLLECT, 0);
 	}
-	else
+	else if (pllua_gc_multiplier > 0.0 || force)
 	{
 		int ival;
 
-		val *= pllua_gc_multiplier;
+		val *= Max(pllua_gc_multiplier, 1.0);
 		if (val >= (double) INT_MAX)
 			ival = INT_MAX;
 		else
 			ival = (int) val;
 		pllua_debug(L, "pllua_run_extra_gc: step %d", ival);
-		lua_gc(L, LUA_GCSTEP, ival);
+		pllua_timed_gc(L, interp, LUA_GCSTEP, ival);
+	}
+	else
+		return gc_debt;
+
+	return 0;
+}
+
+/*
+ * cpcall'd from the transaction callback to pay off whatever debt has
+ * accumulated during the transaction.
+ */
+int
+pllua_xact_end_gc(lua_State *L)
+{
+	pllua_interpreter *interp = lua_touserdata(L, 1);
+
+	interp->gc_debt = pllua_run_extra_gc(L, interp->gc_debt, true);
+	interp->gc_xact_runs++;
+	return 0;
+}
+
+/*
+ * At commit, values fetched during the transaction are commonly garbage, and
+ * the session is likely about to go idle; that makes it a cheap time to
+ * collect. We don't bother on abort, since the abort path has enough to deal
+ * with already.
+ *
+ * This must be done at pre-commit, since finalizers can call into PG and so
+ * can throw, which is not allowed once the commit record is written; an error
+ * here just aborts the transaction. Interpreters with a call in progress (a
+ * procedure doing spi.commit(), say) are skipped, since collecting under
+ * running code is what we want to avoid; their debt carries over.
+ */
+static void
+pllua_xact_callback(XactEvent event, void *arg)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pllua_interpreter_hashent *interp_desc;
+
+	if (!pllua_gc_at_xact_end || !pllua_interp_hash || pllua_ending)
+		return;
+	if (event != XACT_EVENT_PRE_COMMIT && event != XACT_EVENT_PARALLEL_PRE_COMMIT)
+		return;
+
+	hash_seq_init(&hash_seq, pllua_interp_hash);
+	while ((interp_desc = hash_seq_search(&hash_seq)) != NULL)
+	{
+		pllua_interpreter *interp = interp_desc->interp;
+		int			rc;
+
+		if (!interp || !interp->L || !interp->db_ready
+			|| interp->gc_debt == 0 || interp->call_depth > 0)
+			continue;
+
+		rc = pllua_cpcall(interp->L, pllua_xact_end_gc, interp);
+		if (rc)
+		{
+			hash_seq_term(&hash_seq);
+			pllua_rethrow_from_lua(interp->L, rc);
+		}
 	}
 }
 
@@ -322,6 +527,13 @@ void _PG_init(void)
 							   NULL,
 							   PGC_SUSET, 0,
 							   NULL, NULL, NULL);
+	DefineCustomStringVariable("pllua.prewarm_functions",
+							   gettext_noop("Functions to compile when a Lua interpreter is initialized."),
+							   NULL,
+							   &pllua_prewarm_list,
+							   NULL,
+							   PGC_SUSET, 0,
+							   NULL, NULL, NULL);
 	DefineCustomBoolVariable("pllua.install_globals",
 							 gettext_noop("Install key modules as global tables."),
 							 NULL,
@@ -336,6 +548,38 @@ void _PG_init(void)
 							 true,
 							 PGC_SUSET, 0,
 							 NULL, NULL, NULL);
+	DefineCustomBoolVariable("pllua.interrupt_check_on_return",
+							 gettext_noop("Also check for query cancels on every Lua function return."),
+							 NULL,
+							 &pllua_interrupt_check_on_return,
+							 true,
+							 PGC_SUSET, 0,
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("pllua.interrupt_check_interval",
+							gettext_noop("Number of Lua VM instructions between checks for query cancels."),
+							NULL,
+							&pllua_interrupt_check_interval,
+							100000,
+							100,
+							INT_MAX,
+							PGC_SUSET, 0,
+							NULL, NULL, NULL);
+	DefineCustomBoolVariable("pllua.slab_allocator",
+							 gettext_noop("Use a slab allocator for small blocks in new Lua interpreters."),
+							 NULL,
+							 &pllua_use_slab_allocator,
+							 false,
+							 PGC_SUSET, 0,
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("pllua.max_memory",
+							gettext_noop("Maximum memory usable by each Lua interpreter, or 0 for no limit."),
+							NULL,
+							&pllua_max_memory,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET, GUC_UNIT_KB,
+							NULL, NULL, NULL);
 	DefineCustomIntVariable("pllua.prebuilt_interpreters",
 							gettext_noop("Number of interpreters to prebuild if preloaded"),
 							NULL,
@@ -352,6 +596,13 @@ void _PG_init(void)
 							   NULL,
 							   PGC_SIGHUP, 0,
 							   NULL, pllua_assign_reload_ident, NULL);
+	DefineCustomStringVariable("pllua.bytecode_cache_dir",
+							   gettext_noop("Directory in which to cache compiled function bytecode."),
+							   NULL,
+							   &pllua_bytecode_cache_dir,
+							   NULL,
+							   PGC_SUSET, 0,
+							   NULL, NULL, NULL);
 
 	/*
 	 * These don't need to be SUSET because we're not concerned about resource
@@ -376,6 +627,50 @@ void _PG_init(void)
 							 (double)(LONG_MAX / 1024),
 							 PGC_USERSET, 0,
 							 NULL, NULL, NULL);
+	DefineCustomIntVariable("pllua.plan_cache_size",
+							gettext_noop("Maximum number of cached plans for query strings passed to SPI functions."),
+							NULL,
+							&pllua_spi_plan_cache_size,
+							32,
+							0,
+							10000,
+							PGC_USERSET, 0,
+							NULL, NULL, NULL);
+	DefineCustomBoolVariable("pllua.materialize_srf",
+							 gettext_noop("Run set-returning functions to completion into a tuplestore where the caller allows it"),
+							 NULL,
+							 &pllua_materialize_srf,
+							 false,
+							 PGC_USERSET, 0,
+							 NULL, NULL, NULL);
+	DefineCustomBoolVariable("pllua.profile",
+							 gettext_noop("Collect per-function call counts and timings"),
+							 NULL,
+							 &pllua_profile_enabled,
+							 false,
+							 PGC_USERSET, 0,
+							 NULL, NULL, NULL);
+	DefineCustomBoolVariable("pllua.profile_lines",
+							 gettext_noop("Also collect per-line timings when pllua.profile is on"),
+							 NULL,
+							 &pllua_profile_lines,
+							 false,
+							 PGC_USERSET, 0,
+							 NULL, NULL, NULL);
+	DefineCustomBoolVariable("pllua.adaptive_gc",
+							 gettext_noop("Scale additional GC calls by the ratio of non-Lua memory to the Lua heap"),
+							 NULL,
+							 &pllua_gc_adaptive,
+							 false,
+							 PGC_USERSET, 0,
+							 NULL, pllua_assign_gc_adaptive, NULL);
+	DefineCustomBoolVariable("pllua.xact_end_gc",
+							 gettext_noop("Do additional GC calls at transaction commit"),
+							 NULL,
+							 &pllua_gc_at_xact_end,
+							 false,
+							 PGC_USERSET, 0,
+							 NULL, pllua_assign_gc_at_xact_end, NULL);
 
 	EmitWarningsOnPlaceholders("pllua");
 
@@ -500,6 +795,7 @@ pllua_syscache_typeoid_callback(Datum arg, int cacheid, uint32 hashvalue)
 	inval.inval_type = true;
 	inval.inval_typeoid = InvalidOid;
 	pllua_callback_broadcast(arg, pllua_register_cfunc(L, pllua_typeinfo_invalidate), &inval);
+	pllua_callback_broadcast(arg, pllua_register_cfunc(L, pllua_spi_plancache_invalidate), &inval);
 }
 
 static void
@@ -519,23 +815,292 @@ pllua_syscache_cast_callback(Datum arg, int cacheid, uint32 hashvalue)
  * associated objects (referenced by userdata values) go in the context
  * associated with the interpreter. Lua's memory usage can be queried within
  * lua if one needs to monitor usage.
+ *
+ * Optionally (pllua.slab_allocator), small blocks are instead carved out of
+ * larger malloc'd chunks and recycled through per-size-class free lists, since
+ * Lua makes enormous numbers of small short-lived allocations. Chunks are
+ * never returned to malloc until the interpreter is closed. The choice is made
+ * when the interpreter is created and can't change afterwards, since a block
+ * must be freed the same way it was allocated (we rely on Lua always telling
+ * us the true old size of a block to decide which way that was).
+ *
+ * That rule means that shrinking a malloc'd block to a small size must move
+ * it into the slab, yet Lua requires shrinks never to fail. So one spare chunk
+ * is kept in reserve for such shrinks when malloc fails, and replaced as soon
+ * as malloc succeeds again. If even that is gone, the old block is handed back
+ * unchanged and remembered as "foreign": a malloc'd block that Lua thinks is
+ * small. Those are checked for wherever a small block is freed or resized,
+ * and go back to malloc rather than onto a free list; since the real size is
+ * more than any small size, resizing one within the small sizes needs no work
+ * at all. Only if PLLUA_SLAB_MAX_FOREIGN of them are outstanding at once does
+ * the shrink fail, leaving pllua_alloc to hand back the block regardless (it is
+ * big enough for its free list, but is then never returned to malloc).
+ */
+#define PLLUA_SLAB_QUANTUM		16
+#define PLLUA_SLAB_MAX_BLOCK	256
+#define PLLUA_SLAB_NCLASSES		(PLLUA_SLAB_MAX_BLOCK / PLLUA_SLAB_QUANTUM)
+#define PLLUA_SLAB_CHUNK_SIZE	(64 * 1024)
+#define PLLUA_SLAB_MAX_FOREIGN	32
+
+#define PLLUA_SLAB_CLASS(sz_)		(((sz_) - 1) / PLLUA_SLAB_QUANTUM)
+#define PLLUA_SLAB_CLASS_SIZE(c_)	(((c_) + 1) * PLLUA_SLAB_QUANTUM)
+
+typedef union pllua_slab_chunk
+{
+	union pllua_slab_chunk *next;
+	char		pad_[PLLUA_SLAB_QUANTUM];	/* keep blocks aligned */
+} pllua_slab_chunk;
+
+typedef struct pllua_slab
+{
+	void	   *freelist[PLLUA_SLAB_NCLASSES];
+	char	   *curptr;			/* unused space in newest chunk */
+	char	   *curend;
+	pllua_slab_chunk *chunks;	/* all chunks, for release */
+	pllua_slab_chunk *spare;	/* reserve chunk for shrinks, if any */
+	size_t		reserved;		/* total size of chunks */
+	int			nforeign;		/* malloc'd blocks with small sizes */
+	void	   *foreign[PLLUA_SLAB_MAX_FOREIGN];
+} pllua_slab;
+
+/*
+ * Is ptr (of a small size) really a malloc'd block? If so and "forget" is
+ * set, it's removed from the list.
+ */
+static inline bool
+pllua_slab_is_foreign(pllua_slab *slab, void *ptr, bool forget)
+{
+	int			i;
+
+	for (i = 0; i < slab->nforeign; ++i)
+	{
+		if (slab->foreign[i] == ptr)
+		{
+			if (forget)
+				slab->foreign[i] = slab->foreign[--slab->nforeign];
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Allocate a block of class cls; "shrinking" allows use of the spare chunk.
+ */
+static void *
+pllua_slab_alloc(pllua_slab *slab, int cls, bool shrinking)
+{
+	size_t		sz = PLLUA_SLAB_CLASS_SIZE(cls);
+	void	   *p = slab->freelist[cls];
+
+	if (p)
+	{
+		slab->freelist[cls] = *(void **) p;
+		return p;
+	}
+
+	if ((size_t) (slab->curend - slab->curptr) < sz)
+	{
+		pllua_slab_chunk *chunk = malloc(PLLUA_SLAB_CHUNK_SIZE);
+
+		if (chunk)
+		{
+			slab->reserved += PLLUA_SLAB_CHUNK_SIZE;
+			if (!slab->spare && (slab->spare = malloc(PLLUA_SLAB_CHUNK_SIZE)))
+				slab->reserved += PLLUA_SLAB_CHUNK_SIZE;
+		}
+		else if (shrinking && slab->spare)
+		{
+			chunk = slab->spare;
+			slab->spare = NULL;
+		}
+		else
+			return NULL;
+		chunk->next = slab->chunks;
+		slab->chunks = chunk;
+		slab->curptr = (char *) (chunk + 1);
+		slab->curend = (char *) chunk + PLLUA_SLAB_CHUNK_SIZE;
+	}
+
+	p = slab->curptr;
+	slab->curptr += sz;
+	return p;
+}
+
+static inline void
+pllua_slab_free(pllua_slab *slab, void *ptr, size_t osize)
+{
+	int			cls = PLLUA_SLAB_CLASS(osize);
+
+	*(void **) ptr = slab->freelist[cls];
+	slab->freelist[cls] = ptr;
+}
+
+/*
+ * Called only when at least one of osize/nsize is a small block size; ptr may
+ * be null (in which case osize must be 0).
  */
+static void *
+pllua_slab_realloc(pllua_slab *slab, void *ptr, size_t osize, size_t nsize)
+{
+	bool		old_small = (ptr && osize <= PLLUA_SLAB_MAX_BLOCK);
+	void	   *nptr;
+
+	if (old_small && pllua_slab_is_foreign(slab, ptr, false))
+	{
+		/* its real size is more than any small size, so it can stay put */
+		if (nsize <= PLLUA_SLAB_MAX_BLOCK)
+			return ptr;
+		(void) pllua_slab_is_foreign(slab, ptr, true);
+		nptr = realloc(ptr, nsize);
+		/* on failure it's still foreign; there's room since we took it out */
+		if (!nptr)
+			slab->foreign[slab->nforeign++] = ptr;
+		return nptr;
+	}
+
+	if (nsize <= PLLUA_SLAB_MAX_BLOCK)
+	{
+		if (old_small && PLLUA_SLAB_CLASS(osize) == PLLUA_SLAB_CLASS(nsize))
+			return ptr;
+		nptr = pllua_slab_alloc(slab, PLLUA_SLAB_CLASS(nsize),
+								ptr && !old_small);
+		if (!nptr && ptr && nsize < osize)
+		{
+			/* a block that is already small can just stay where it is */
+			if (old_small)
+				return ptr;
+			/* a malloc'd one too, if we can remember it (see above) */
+			if (slab->nforeign < PLLUA_SLAB_MAX_FOREIGN)
+			{
+				slab->foreign[slab->nforeign++] = ptr;
+				return ptr;
+			}
+		}
+	}
+	else
+		nptr = malloc(nsize);
+
+	if (nptr && ptr)
+	{
+		memcpy(nptr, ptr, Min(osize, nsize));
+		if (old_small)
+			pllua_slab_free(slab, ptr, osize);
+		else
+			free(ptr);
+	}
+
+	return nptr;
+}
+
+static pllua_slab *
+pllua_slab_create(void)
+{
+	pllua_slab *slab = malloc(sizeof(pllua_slab));
+
+	if (slab)
+	{
+		memset(slab, 0, sizeof(pllua_slab));
+		if ((slab->spare = malloc(PLLUA_SLAB_CHUNK_SIZE)))
+			slab->reserved = PLLUA_SLAB_CHUNK_SIZE;
+	}
+	return slab;
+}
+
+/*
+ * Only call this after lua_close.
+ */
+static void
+pllua_slab_release(pllua_interpreter *interp)
+{
+	pllua_slab *slab = interp->slab;
+
+	if (!slab)
+		return;
+	while (slab->chunks)
+	{
+		pllua_slab_chunk *chunk = slab->chunks;
+
+		slab->chunks = chunk->next;
+		free(chunk);
+	}
+	while (slab->nforeign > 0)
+		free(slab->foreign[--slab->nforeign]);
+	free(slab->spare);
+	free(slab);
+	interp->slab = NULL;
+}
+
+size_t
+pllua_slab_reserved(pllua_interpreter *interp)
+{
+	return interp->slab ? interp->slab->reserved : 0;
+}
+
+static inline void
+pllua_account_alloc(pllua_interpreter *interp, size_t osize, size_t nsize)
+{
+	interp->mem_used += nsize;
+	interp->mem_used -= osize;
+	if (interp->mem_used > interp->mem_peak)
+		interp->mem_peak = interp->mem_used;
+}
+
+/*
+ * Enforce pllua.max_memory, but only once setup is done, so that a small limit
+ * can't prevent the interpreter from being created at all. Just failing the
+ * allocation is enough: Lua (5.3+) responds to that by doing an emergency full
+ * collection and retrying, and only if that fails too does it raise a memory
+ * error. (With 5.1/LuaJIT pllua_alloc isn't used at all, so there is no limit.)
+ */
+static inline bool
+pllua_over_memory_limit(pllua_interpreter *interp, size_t osize, size_t nsize)
+{
+	if (pllua_max_memory > 0
+		&& nsize > osize
+		&& interp->db_ready
+		&& interp->mem_used + (nsize - osize) > (size_t) pllua_max_memory * 1024)
+	{
+		interp->mem_limit_hit = true;
+		return true;
+	}
+	return false;
+}
+
 static void *
 pllua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
 {
+	pllua_interpreter *interp = ud;
+	pllua_slab *slab = interp->slab;
 	void	   *nptr;
 
-	(void)ud;  /* not used */
+	/* if ptr is null, osize is an object type code, not a size */
+	if (!ptr)
+		osize = 0;
 
 	if (nsize == 0)
 	{
-		free(ptr);							/* free(NULL) is explicitly safe */
+		if (ptr)
+		{
+			if (slab && osize <= PLLUA_SLAB_MAX_BLOCK
+				&& !pllua_slab_is_foreign(slab, ptr, true))
+				pllua_slab_free(slab, ptr, osize);
+			else
+				free(ptr);
+			pllua_account_alloc(interp, osize, 0);
+		}
 		simulate_memory_failure = false;
 		return NULL;
 	}
 
+	if (pllua_over_memory_limit(interp, osize, nsize))
+		return NULL;
+
 	if (simulate_memory_failure)
 		nptr = NULL;
+	else if (slab && (nsize <= PLLUA_SLAB_MAX_BLOCK
+					  || (ptr && osize <= PLLUA_SLAB_MAX_BLOCK)))
+		nptr = pllua_slab_realloc(slab, ptr, osize, nsize);
 	else
 		nptr = realloc(ptr, nsize);
 
@@ -545,22 +1110,37 @@ pllua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
 		{
 			elog(WARNING, "pllua: failed to shrink a block of size %lu to %lu",
 				 (unsigned long) osize, (unsigned long) nsize);
-			return ptr;
+			nptr = ptr;
 		}
 	}
 
+	if (nptr)
+	{
+		pllua_account_alloc(interp, osize, nsize);
+		interp->mem_limit_hit = false;
+	}
+
 	return nptr;
 }
 
 /*
  * Some luajit builds need their own allocator, but since we want to repurpose
- * the alloc "ud" value, we have to insert a shim.
+ * the alloc "ud" value, we have to insert a shim. We still keep count of the
+ * memory in use.
  */
 static void *
 pllua_alloc_shim(void *ud, void *ptr, size_t osize, size_t nsize)
 {
 	pllua_interpreter *interp = ud;
-	return interp->allocf(interp->alloc_ud, ptr, osize, nsize);
+	size_t		oldsize = ptr ? osize : 0;
+	void	   *nptr;
+
+	if (pllua_over_memory_limit(interp, oldsize, nsize))
+		return NULL;
+	nptr = interp->allocf(interp->alloc_ud, ptr, osize, nsize);
+	if (nptr || nsize == 0)
+		pllua_account_alloc(interp, oldsize, nsize);
+	return nptr;
 }
 
 static void
@@ -609,11 +1189,24 @@ pllua_warnfunction(void *p, const char *msg, int tocont)
 
 /*
  * Hook function to check for interrupts. We have lua call this for every
- * function return or set number of opcodes executed.
+ * set number of opcodes executed, and optionally every function return.
+ * When the line profiler is on, it also gets called for every new line.
+ *
+ * The hook can be called very often, so test for a pending interrupt before
+ * paying for the catch block.
  */
 static void
 pllua_hook(lua_State *L, lua_Debug *ar)
 {
+	if (ar->event == LUA_HOOKLINE)
+	{
+		pllua_profile_line(L, ar);
+		return;
+	}
+
+	if (!INTERRUPTS_PENDING_CONDITION())
+		return;
+
 	/*
 	 * Allow this even if an error is pending.
 	 */
@@ -624,6 +1217,25 @@ pllua_hook(lua_State *L, lua_Debug *ar)
 	PLLUA_CATCH_RETHROW();
 }
 
+/*
+ * Turn line events on or off in the hook to match pllua.profile_lines; called
+ * at each entry from PG, so that the setting takes effect on the next call.
+ * (Coroutines already in existence keep the hook they were created with.)
+ */
+void
+pllua_update_hook(lua_State *L)
+{
+	int			mask = lua_gethookmask(L);
+	bool		want_lines = pllua_profile_enabled && pllua_profile_lines;
+
+	if (want_lines != ((mask & LUA_MASKLINE) != 0))
+	{
+		mask ^= LUA_MASKLINE;
+		lua_sethook(L, mask ? pllua_hook : NULL, mask,
+					(mask & LUA_MASKCOUNT) ? lua_gethookcount(L) : 0);
+	}
+}
+
 /*
  * Simple bare-bones execution of a single string.
  */
@@ -750,6 +1362,12 @@ pllua_init_state_phase1(lua_State *L)
 	 */
 	pllua_wrap_stack_checks(L);
 
+	/*
+	 * Let require() use the bytecode cache, if configured, for modules found
+	 * on package.path.
+	 */
+	pllua_install_module_searcher(L);
+
 	/*
 	 * Initialize our error handling, which replaces many base functions
 	 * (pcall, xpcall, etc.). Must be done after openlibs but before anything
@@ -770,6 +1388,11 @@ pllua_init_state_phase1(lua_State *L)
 	 */
 	luaL_requiref(L, "pllua.paths", pllua_open_paths, 0);
 
+	/*
+	 * Likewise the stats module, which only looks at the interpreter.
+	 */
+	luaL_requiref(L, "pllua.stats", pllua_open_stats, 0);
+
 	/*
 	 * Early init of the trusted sandbox, so that on_init can do trusted setup
 	 * (even though we don't know in on_init whether we're trusted or not).
@@ -806,6 +1429,7 @@ pllua_init_state_phase2(lua_State *L)
 	bool		trusted = lua_toboolean(L, 1);
 	lua_Integer	user_id = lua_tointeger(L, 2);
 	lua_Integer	lang_oid = lua_tointeger(L, 3);
+	bool		parallel_worker = lua_toboolean(L, 4);
 
 	lua_pushinteger(L, user_id);
 	lua_rawsetp(L, LUA_REGISTRYINDEX, PLLUA_USERID);
@@ -846,6 +1470,17 @@ pllua_init_state_phase2(lua_State *L)
 	if (trusted && pllua_do_install_globals)
 		lua_setglobal(L, "trusted");
 
+	/*
+	 * Let init strings and function bodies tell whether they are running in
+	 * a parallel worker, e.g. to skip leader-only setup work.
+	 */
+	lua_pushboolean(L, parallel_worker);
+	lua_setglobal(L, "_PL_PARALLEL_WORKER");
+	lua_rawgetp(L, LUA_REGISTRYINDEX, PLLUA_TRUSTED_SANDBOX);
+	lua_pushliteral(L, "_PL_PARALLEL_WORKER");
+	lua_pushboolean(L, parallel_worker);
+	lua_rawset(L, -3);
+
 	lua_settop(L, 0);
 
 	/* set up the compat module for preload */
@@ -869,7 +1504,9 @@ pllua_init_state_phase2(lua_State *L)
 
 	/* enable interrupt checks */
 	if (pllua_do_check_for_interrupts)
-		lua_sethook(L, pllua_hook, LUA_MASKRET | LUA_MASKCOUNT, 100000);
+		lua_sethook(L, pllua_hook,
+					(pllua_interrupt_check_on_return ? LUA_MASKRET : 0) | LUA_MASKCOUNT,
+					pllua_interrupt_check_interval);
 
 	/* don't run user code yet */
 	return 0;
@@ -906,6 +1543,125 @@ pllua_run_init_strings(lua_State *L)
 	return 0;
 }
 
+/*
+ * Split the prewarm list on commas that are not inside parens or double
+ * quotes, since function signatures contain commas. Modifies rawstring.
+ */
+static List *
+pllua_split_function_list(char *rawstring)
+{
+	List	   *result = NIL;
+	char	   *start = rawstring;
+	char	   *p;
+	int			depth = 0;
+	bool		inquote = false;
+
+	for (p = rawstring; ; ++p)
+	{
+		if (*p == '"')
+			inquote = !inquote;
+		else if (*p == '\0' || (*p == ',' && depth == 0 && !inquote))
+		{
+			char		endc = *p;
+
+			*p = '\0';
+			while (isspace((unsigned char) *start))
+				++start;
+			if (*start)
+				result = lappend(result, start);
+			if (endc == '\0')
+				break;
+			start = p + 1;
+		}
+		else if (!inquote && *p == '(')
+			++depth;
+		else if (!inquote && *p == ')' && depth > 0)
+			--depth;
+	}
+
+	return result;
+}
+
+/*
+ * Compile the functions listed in pllua.prewarm_functions into a new
+ * interpreter. Each one is done in its own subtransaction, so that a bad
+ * entry (or a function that fails to compile) produces only a warning rather
+ * than causing interpreter creation to fail.
+ */
+static void
+pllua_prewarm_functions(pllua_interpreter *interp, bool trusted, Oid langoid)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	lua_State  *L = interp->L;
+	char	   *rawstring;
+	List	   *names;
+	ListCell   *lc;
+
+	if (!pllua_prewarm_list || !*pllua_prewarm_list)
+		return;
+
+	/* subtransactions aren't allowed in parallel mode */
+	if (IsInParallelMode())
+		return;
+
+	rawstring = pstrdup(pllua_prewarm_list);
+	names = pllua_split_function_list(rawstring);
+
+	foreach(lc, names)
+	{
+		const char *name = lfirst(lc);
+		int			top = lua_gettop(L);
+
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(oldcontext);
+
+		PG_TRY();
+		{
+			Oid			fn_oid;
+
+			if (strchr(name, '('))
+				fn_oid = DatumGetObjectId(DirectFunctionCall1(regprocedurein,
+															  CStringGetDatum(name)));
+			else
+				fn_oid = DatumGetObjectId(DirectFunctionCall1(regprocin,
+															  CStringGetDatum(name)));
+
+			if (!pllua_prewarm_function(L, fn_oid, langoid, trusted))
+				elog(DEBUG1, "pllua: not prewarming function \"%s\" in this interpreter",
+					 name);
+
+			ReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+		}
+		PG_CATCH();
+		{
+			ErrorData  *edata;
+
+			MemoryContextSwitchTo(oldcontext);
+			edata = CopyErrorData();
+			FlushErrorState();
+
+			RollbackAndReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+
+			pllua_error_cleanup(interp, &interp->cur_activation);
+			lua_settop(L, top);
+
+			ereport(WARNING,
+					(errmsg("PL/Lua: could not prewarm function \"%s\": %s",
+							name, edata->message)));
+			FreeErrorData(edata);
+		}
+		PG_END_TRY();
+	}
+
+	list_free(names);
+	pfree(rawstring);
+}
+
 /*
  * PG-environment part of interpreter setup.
  *
@@ -941,9 +1697,34 @@ pllua_newstate_phase1(const char *ident)
 	interp->edata = pllua_make_recursive_error();
 
 	interp->gc_debt = 0;
+	interp->gc_runs = 0;
+	interp->gc_xact_runs = 0;
+	interp->gc_time = 0.0;
+	interp->gc_ratio = 0.0;
+	interp->gc_pause = 200;
+	interp->typeinfo_gen = 0;
+	interp->n_datums = 0;
+	interp->n_typeinfos = 0;
+	interp->n_functions = 0;
+	interp->n_statements = 0;
+	interp->n_cursors = 0;
+	interp->call_depth = 0;
 	interp->user_id = InvalidOid;
 	interp->db_ready = false;
 
+	interp->mem_used = 0;
+	interp->mem_peak = 0;
+	interp->mem_limit_hit = false;
+	interp->slab = NULL;
+#if LUA_VERSION_NUM > 501
+	if (pllua_use_slab_allocator)
+	{
+		interp->slab = pllua_slab_create();
+		if (!interp->slab)
+			elog(ERROR, "Out of memory creating Lua interpreter");
+	}
+#endif
+
 	interp->cur_activation.fcinfo = NULL;
 	interp->cur_activation.retval = (Datum) 0;
 	interp->cur_activation.trusted = false;
@@ -961,14 +1742,26 @@ pllua_newstate_phase1(const char *ident)
 #endif
 
 	if (!L)
+	{
+		pllua_slab_release(interp);
 		elog(ERROR, "Out of memory creating Lua interpreter");
+	}
 
 	interp->L = L;
 
-	/* Insert our alloc shim if the allocator is not our one. */
+	/*
+	 * Insert our alloc shim if the allocator is not our one. Anything the
+	 * state allocated before that wasn't counted, so start from Lua's own
+	 * figure.
+	 */
 	interp->allocf = lua_getallocf(L, &interp->alloc_ud);
 	if (interp->allocf != pllua_alloc)
+	{
 		lua_setallocf(L, pllua_alloc_shim, interp);
+		interp->mem_used = ((size_t) lua_gc(L, LUA_GCCOUNT, 0) * 1024
+							+ lua_gc(L, LUA_GCCOUNTB, 0));
+		interp->mem_peak = interp->mem_used;
+	}
 
 	lua_atpanic(L, pllua_panic);  /* can't throw */
 
@@ -1022,6 +1815,7 @@ pllua_newstate_phase1(const char *ident)
 		lua_close(L); /* can't throw, but has internal lua catch blocks */
 		pllua_pending_error = false;
 		pllua_setcontext(NULL, PLLUA_CONTEXT_PG);
+		pllua_slab_release(interp);
 
 		interp = NULL;
 
@@ -1088,7 +1882,8 @@ pllua_newstate_phase2(pllua_interpreter_hashent *interp_desc,
 		lua_pushboolean(L, trusted);
 		lua_pushinteger(L, (lua_Integer) user_id);
 		lua_pushinteger(L, (lua_Integer) langoid);
-		pllua_pcall(L, 3, 0, 0);
+		lua_pushboolean(L, IsParallelWorker());
+		pllua_pcall(L, 4, 0, 0);
 
 		if (first_time)
 		{
@@ -1097,6 +1892,7 @@ pllua_newstate_phase2(pllua_interpreter_hashent *interp_desc,
 			CacheRegisterSyscacheCallback(TYPEOID, pllua_syscache_typeoid_callback, (Datum)0);
 			CacheRegisterSyscacheCallback(TRFTYPELANG, pllua_syscache_typeoid_callback, (Datum)0);
 			CacheRegisterSyscacheCallback(CASTSOURCETARGET, pllua_syscache_cast_callback, (Datum)0);
+			RegisterXactCallback(pllua_xact_callback, NULL);
 			first_time = false;
 		}
 
@@ -1121,6 +1917,8 @@ pllua_newstate_phase2(pllua_interpreter_hashent *interp_desc,
 
 		lua_pushcfunction(L, pllua_run_init_strings);
 		pllua_pcall(L, 0, 0, 0);
+
+		pllua_prewarm_functions(interp, trusted, langoid);
 	}
 	PG_CATCH();
 	{
@@ -1153,6 +1951,7 @@ pllua_newstate_phase2(pllua_interpreter_hashent *interp_desc,
 		pllua_pending_error = false;
 		pllua_setcontext(NULL, PLLUA_CONTEXT_PG);
 
+		pllua_slab_release(interp);
 		MemoryContextDelete(interp->mcxt);
 
 		ReThrowError(e);
@@ -1171,6 +1171,636 @@ pllua_jsonb_type(lua_State *L)
 	return 1;
 }
 
+/*
+ * Incremental builder: jsonb.builder() returns an object whose methods feed
+ * tokens straight into pushJsonbValue, so that a large document can be
+ * emitted without first building it as nested Lua tables.
+ *
+ * The parse state lives in the builder's own memory context, which is held
+ * (as a memory context object) in the builder's uservalue.
+ */
+typedef struct pllua_jsonb_builder
+{
+	JsonbParseState *pstate;
+	JsonbValue *result;		/* set once the top-level value is complete */
+	MemoryContext mcxt;
+	int			depth;
+	bool		need_value;	/* inside an object, after a key */
+} pllua_jsonb_builder;
+
+static pllua_jsonb_builder *
+pllua_jsonb_checkbuilder(lua_State *L)
+{
+	pllua_jsonb_builder *b = pllua_checkobject(L, 1, PLLUA_JSONB_BUILDER_OBJECT);
+	if (!b->mcxt)
+		luaL_error(L, "jsonb builder has already returned its result");
+	return b;
+}
+
+static bool
+pllua_jsonb_builder_in_object(pllua_jsonb_builder *b)
+{
+	return b->depth > 0 && b->pstate->contVal.type == jbvObject;
+}
+
+/*
+ * Check that a value (scalar or container start) is acceptable here, and
+ * return the token to push it with.
+ */
+static JsonbIteratorToken
+pllua_jsonb_builder_value_token(lua_State *L, pllua_jsonb_builder *b)
+{
+	if (b->result)
+		luaL_error(L, "jsonb builder value is already complete");
+	if (pllua_jsonb_builder_in_object(b))
+	{
+		if (!b->need_value)
+			luaL_error(L, "jsonb builder expected a key");
+		return WJB_VALUE;
+	}
+	return WJB_ELEM;
+}
+
+static void
+pllua_jsonb_builder_push(lua_State *L, pllua_jsonb_builder *b,
+						 JsonbIteratorToken tok, JsonbValue *val)
+{
+	JsonbValue *volatile res = NULL;
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(b->mcxt);
+		res = pushJsonbValue(&b->pstate, tok, val);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	switch (tok)
+	{
+		case WJB_BEGIN_OBJECT:
+		case WJB_BEGIN_ARRAY:
+			++b->depth;
+			b->need_value = false;
+			break;
+		case WJB_END_OBJECT:
+		case WJB_END_ARRAY:
+			if (--b->depth == 0)
+				b->result = res;
+			b->need_value = false;
+			break;
+		case WJB_KEY:
+			b->need_value = true;
+			break;
+		default:
+			b->need_value = false;
+			break;
+	}
+}
+
+static int
+pllua_jsonb_builder_begin(lua_State *L, bool is_object)
+{
+	pllua_jsonb_builder *b = pllua_jsonb_checkbuilder(L);
+
+	/* a nested container is a value of its parent */
+	if (b->depth > 0 || b->result)
+		(void) pllua_jsonb_builder_value_token(L, b);
+
+	pllua_jsonb_builder_push(L, b,
+							 is_object ? WJB_BEGIN_OBJECT : WJB_BEGIN_ARRAY,
+							 NULL);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+pllua_jsonb_builder_begin_object(lua_State *L)
+{
+	return pllua_jsonb_builder_begin(L, true);
+}
+
+static int
+pllua_jsonb_builder_begin_array(lua_State *L)
+{
+	return pllua_jsonb_builder_begin(L, false);
+}
+
+static int
+pllua_jsonb_builder_end(lua_State *L, bool is_object)
+{
+	pllua_jsonb_builder *b = pllua_jsonb_checkbuilder(L);
+
+	if (b->depth == 0
+		|| pllua_jsonb_builder_in_object(b) != is_object)
+		luaL_error(L, "jsonb builder is not inside an %s",
+				   is_object ? "object" : "array");
+	if (b->need_value)
+		luaL_error(L, "jsonb builder expected a value");
+	pllua_jsonb_builder_push(L, b,
+							 is_object ? WJB_END_OBJECT : WJB_END_ARRAY,
+							 NULL);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+pllua_jsonb_builder_end_object(lua_State *L)
+{
+	return pllua_jsonb_builder_end(L, true);
+}
+
+static int
+pllua_jsonb_builder_end_array(lua_State *L)
+{
+	return pllua_jsonb_builder_end(L, false);
+}
+
+static int
+pllua_jsonb_builder_key(lua_State *L)
+{
+	pllua_jsonb_builder *b = pllua_jsonb_checkbuilder(L);
+	size_t		len = 0;
+	const char *ptr = luaL_checklstring(L, 2, &len);
+	JsonbValue	kval;
+
+	if (!pllua_jsonb_builder_in_object(b))
+		luaL_error(L, "jsonb builder is not inside an object");
+	if (b->need_value)
+		luaL_error(L, "jsonb builder expected a value");
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(b->mcxt);
+		kval.type = jbvString;
+		kval.val.string.val = palloc(len);
+		kval.val.string.len = len;
+		memcpy(kval.val.string.val, ptr, len);
+		pg_verifymbstr(kval.val.string.val, len, false);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	pllua_jsonb_builder_push(L, b, WJB_KEY, &kval);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+ * b:value(v) appends a scalar, converted exactly as by pgtype.jsonb(). A
+ * table (or other container) is converted with pgtype.jsonb() and inserted
+ * as a whole, which is convenient for small subdocuments.
+ */
+static int
+pllua_jsonb_builder_value(lua_State *L)
+{
+	pllua_jsonb_builder *b = pllua_jsonb_checkbuilder(L);
+	JsonbValue	val;
+
+	lua_settop(L, 2);
+
+	if (!pllua_jsonb_toscalar(L, &val, b->mcxt))
+	{
+		lua_pushvalue(L, lua_upvalueindex(2));
+		lua_pushvalue(L, 2);
+		lua_call(L, 1, 1);
+		if (!pllua_jsonb_toscalar(L, &val, b->mcxt))
+			luaL_error(L, "cannot convert value to jsonb");
+	}
+
+	if (b->depth == 0)
+	{
+		if (b->result)
+			luaL_error(L, "jsonb builder value is already complete");
+		/* top-level scalar or binary value, no parse state needed */
+		PLLUA_TRY();
+		{
+			MemoryContext oldcontext = MemoryContextSwitchTo(b->mcxt);
+			b->result = palloc(sizeof(JsonbValue));
+			*b->result = val;
+			MemoryContextSwitchTo(oldcontext);
+		}
+		PLLUA_CATCH_RETHROW();
+	}
+	else
+		pllua_jsonb_builder_push(L, b, pllua_jsonb_builder_value_token(L, b), &val);
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+ * b:result() returns the completed value as a jsonb datum; the builder can't
+ * be used after this.
+ */
+static int
+pllua_jsonb_builder_result(lua_State *L)
+{
+	pllua_jsonb_builder *b = pllua_jsonb_checkbuilder(L);
+	pllua_typeinfo *t = *pllua_torefobject(L, lua_upvalueindex(2), PLLUA_TYPEINFO_OBJECT);
+	volatile Datum datum;
+	pllua_datum *nd;
+
+	if (!b->result)
+		luaL_error(L, "jsonb builder value is not complete");
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(b->mcxt);
+		datum = PointerGetDatum(JsonbValueToJsonb(b->result));
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	nd = pllua_newdatum(L, lua_upvalueindex(2), datum);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+		pllua_savedatum(L, nd, t);
+		MemoryContextReset(b->mcxt);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	/* the parse state is gone, so the builder can't be used again */
+	b->pstate = NULL;
+	b->result = NULL;
+	b->mcxt = NULL;
+	lua_pushnil(L);
+	pllua_set_user_field(L, 1, "mcxt");
+
+	return 1;
+}
+
+static int
+pllua_jsonb_builder(lua_State *L)
+{
+	pllua_jsonb_builder *b = pllua_newobject(L, PLLUA_JSONB_BUILDER_OBJECT,
+											 sizeof(pllua_jsonb_builder), true);
+
+	b->pstate = NULL;
+	b->result = NULL;
+	b->depth = 0;
+	b->need_value = false;
+	b->mcxt = pllua_newmemcontext(L, "pllua jsonb builder context",
+								  ALLOCSET_START_SMALL_SIZES);
+	pllua_set_user_field(L, -2, "mcxt");
+	return 1;
+}
+
+static luaL_Reg jsonb_builder_methods[] = {
+	{ "begin_object", pllua_jsonb_builder_begin_object },
+	{ "end_object", pllua_jsonb_builder_end_object },
+	{ "begin_array", pllua_jsonb_builder_begin_array },
+	{ "end_array", pllua_jsonb_builder_end_array },
+	{ "key", pllua_jsonb_builder_key },
+	{ "value", pllua_jsonb_builder_value },
+	{ "result", pllua_jsonb_builder_result },
+	{ NULL, NULL }
+};
+
+static luaL_Reg jsonb_builder_mt[] = {
+	{ NULL, NULL }
+};
+
+/*
+ * Lazy read-only views over a jsonb value: jsonb.view(d) returns an object
+ * over the on-disk container, which is only looked into on indexing. Object
+ * keys are found by binary search (findJsonbValueFromContainer), array
+ * elements by position, and nested containers come back as further views
+ * pointing into the same data, so nothing is converted to Lua until a scalar
+ * is reached.
+ *
+ * The uservalue's "parent" field anchors whatever holds the underlying data:
+ * the original datum, a memory context object holding a detoasted copy, or
+ * the view containing this one.
+ */
+typedef struct pllua_jsonb_view
+{
+	JsonbContainer *container;
+} pllua_jsonb_view;
+
+static void
+pllua_jsonb_push_view(lua_State *L, JsonbContainer *jc, int parent)
+{
+	pllua_jsonb_view *v = pllua_newobject(L, PLLUA_JSONB_VIEW_OBJECT,
+										  sizeof(pllua_jsonb_view), true);
+	v->container = jc;
+	lua_pushvalue(L, parent);
+	pllua_set_user_field(L, -2, "parent");
+}
+
+/*
+ * Push a value found in a container. Scalars are converted as for
+ * jsonb.pairs(); nested containers become views anchored on parent (which
+ * must be an absolute or pseudo index). nnumt is the numeric typeinfo.
+ */
+static void
+pllua_jsonb_view_pushvalue(lua_State *L, JsonbValue *jv, int parent, int nnumt)
+{
+	switch (jv->type)
+	{
+		case jbvNull:
+			lua_pushnil(L);
+			break;
+		case jbvBool:
+			lua_pushboolean(L, jv->val.boolean);
+			break;
+		case jbvNumeric:
+			{
+				pllua_typeinfo *numt = *pllua_torefobject(L, nnumt, PLLUA_TYPEINFO_OBJECT);
+				pllua_datum_single(L, NumericGetDatum(jv->val.numeric), false, nnumt, numt);
+			}
+			break;
+		case jbvString:
+			lua_pushlstring(L, jv->val.string.val, jv->val.string.len);
+			break;
+		case jbvBinary:
+			pllua_jsonb_push_view(L, jv->val.binary.data, parent);
+			break;
+		default:
+			luaL_error(L, "unexpected jsonb value type: %d", (int) jv->type);
+	}
+}
+
+static int
+pllua_jsonb_view(lua_State *L)
+{
+	pllua_datum *d = pllua_checkdatum(L, 1, lua_upvalueindex(2));
+	Jsonb	   *volatile jb = NULL;
+
+	lua_settop(L, 1);
+
+	if (VARATT_IS_EXTENDED(DatumGetPointer(d->value)))
+	{
+		/* a detoasted copy must live as long as the views do */
+		MemoryContext mcxt = pllua_newmemcontext(L, "jsonb view context",
+												 ALLOCSET_START_SMALL_SIZES);
+		PLLUA_TRY();
+		{
+			MemoryContext oldcontext = MemoryContextSwitchTo(mcxt);
+			jb = DatumGetJsonbP(d->value);
+			MemoryContextSwitchTo(oldcontext);
+		}
+		PLLUA_CATCH_RETHROW();
+	}
+	else
+		jb = (Jsonb *) DatumGetPointer(d->value);
+
+	if (JB_ROOT_IS_SCALAR(jb))
+	{
+		JsonbValue	jv;
+
+		PLLUA_TRY();
+		{
+			JsonbValue *res = getIthJsonbValueFromContainer(&jb->root, 0);
+			jv = *res;
+			pfree(res);
+		}
+		PLLUA_CATCH_RETHROW();
+
+		pllua_jsonb_view_pushvalue(L, &jv, lua_gettop(L), lua_upvalueindex(3));
+	}
+	else
+		pllua_jsonb_push_view(L, &jb->root, lua_gettop(L));
+
+	return 1;
+}
+
+/*
+ * __index(view, key)
+ *
+ * Arrays are indexed from 0, as with jsonb.ipairs() and the SQL operators.
+ * Missing keys or out-of-range indexes give nil.
+ */
+static int
+pllua_jsonb_view_index(lua_State *L)
+{
+	pllua_jsonb_view *v = pllua_checkobject(L, 1, PLLUA_JSONB_VIEW_OBJECT);
+	JsonbContainer *jc = v->container;
+	volatile bool found = false;
+	JsonbValue	jv;
+
+	if (jc->header & JB_FOBJECT)
+	{
+		JsonbValue	key;
+		size_t		len;
+		const char *str;
+
+		if (lua_type(L, 2) != LUA_TSTRING && lua_type(L, 2) != LUA_TNUMBER)
+			return 0;
+		str = lua_tolstring(L, 2, &len);
+		key.type = jbvString;
+		key.val.string.val = (char *) str;
+		key.val.string.len = len;
+
+		PLLUA_TRY();
+		{
+			JsonbValue *res = findJsonbValueFromContainer(jc, JB_FOBJECT, &key);
+			if (res)
+			{
+				jv = *res;
+				pfree(res);
+				found = true;
+			}
+		}
+		PLLUA_CATCH_RETHROW();
+	}
+	else
+	{
+		int			isint = 0;
+		lua_Integer idx = lua_tointegerx(L, 2, &isint);
+
+		if (!isint || idx < 0 || idx >= (jc->header & JB_CMASK))
+			return 0;
+
+		PLLUA_TRY();
+		{
+			JsonbValue *res = getIthJsonbValueFromContainer(jc, (uint32) idx);
+			if (res)
+			{
+				jv = *res;
+				pfree(res);
+				found = true;
+			}
+		}
+		PLLUA_CATCH_RETHROW();
+	}
+
+	if (!found)
+		return 0;
+
+	pllua_jsonb_view_pushvalue(L, &jv, 1, lua_upvalueindex(3));
+	return 1;
+}
+
+/*
+ * __len(view) is the number of array elements or object pairs.
+ */
+static int
+pllua_jsonb_view_len(lua_State *L)
+{
+	pllua_jsonb_view *v = pllua_checkobject(L, 1, PLLUA_JSONB_VIEW_OBJECT);
+	lua_pushinteger(L, v->container->header & JB_CMASK);
+	return 1;
+}
+
+static int
+pllua_jsonb_view_tostring(lua_State *L)
+{
+	pllua_jsonb_view *v = pllua_checkobject(L, 1, PLLUA_JSONB_VIEW_OBJECT);
+	char	   *volatile str = NULL;
+
+	PLLUA_TRY();
+	{
+		str = JsonbToCString(NULL, v->container, 64);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_pushstring(L, str);
+
+	PLLUA_TRY();
+	{
+		pfree(str);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 1;
+}
+
+struct jsonb_view_iter
+{
+	JsonbIterator *it;
+	lua_Integer index;
+	bool		done;
+	MemoryContext mcxt;
+};
+
+/*
+ * upvalues:
+ *   1 = lightudata ptr to state
+ *   2 = numeric typeinfo
+ *   3 = view being iterated
+ *   4 = loop memory context object
+ */
+static int
+pllua_jsonb_view_pairs_next(lua_State *L)
+{
+	struct jsonb_view_iter *st = lua_touserdata(L, lua_upvalueindex(1));
+	volatile JsonbIteratorToken vr;
+	JsonbValue	jv;
+
+	if (st->done)
+		return 0;
+
+	for (;;)
+	{
+		PLLUA_TRY();
+		{
+			MemoryContext oldcxt = MemoryContextSwitchTo(st->mcxt);
+			vr = JsonbIteratorNext(&st->it, &jv, true);
+			MemoryContextSwitchTo(oldcxt);
+		}
+		PLLUA_CATCH_RETHROW();
+
+		switch (vr)
+		{
+			case WJB_BEGIN_ARRAY:
+			case WJB_BEGIN_OBJECT:
+			case WJB_END_ARRAY:
+			case WJB_END_OBJECT:
+				continue;
+
+			case WJB_KEY:
+				if (jv.type != jbvString)
+					luaL_error(L, "unexpected type for jsonb key");
+				lua_pushlstring(L, jv.val.string.val, jv.val.string.len);
+				PLLUA_TRY();
+				{
+					MemoryContext oldcxt = MemoryContextSwitchTo(st->mcxt);
+					vr = JsonbIteratorNext(&st->it, &jv, true);
+					MemoryContextSwitchTo(oldcxt);
+				}
+				PLLUA_CATCH_RETHROW();
+				if (vr != WJB_VALUE)
+					luaL_error(L, "unexpected return from jsonb iterator");
+				pllua_jsonb_view_pushvalue(L, &jv, lua_upvalueindex(3), lua_upvalueindex(2));
+				return 2;
+
+			case WJB_ELEM:
+				lua_pushinteger(L, st->index++);
+				pllua_jsonb_view_pushvalue(L, &jv, lua_upvalueindex(3), lua_upvalueindex(2));
+				return 2;
+
+			case WJB_DONE:
+				st->done = true;
+				PLLUA_TRY();
+				{
+					MemoryContextReset(st->mcxt);
+				}
+				PLLUA_CATCH_RETHROW();
+				return 0;
+
+			default:
+				luaL_error(L, "unexpected return from jsonb iterator");
+		}
+	}
+}
+
+/*
+ * __pairs(view): keys and values of an object, or 0-based indexes and
+ * elements of an array, in storage order. Nested containers are views.
+ */
+static int
+pllua_jsonb_view_pairs(lua_State *L)
+{
+	pllua_jsonb_view *v = pllua_checkobject(L, 1, PLLUA_JSONB_VIEW_OBJECT);
+	struct jsonb_view_iter *volatile st = NULL;
+	MemoryContext mcxt;
+
+	lua_settop(L, 1);
+
+	/* loop context object at index 2 */
+	mcxt = pllua_newmemcontext(L, "jsonb view pairs context",
+							   ALLOCSET_START_SMALL_SIZES);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(mcxt);
+		struct jsonb_view_iter *p = palloc(sizeof(struct jsonb_view_iter));
+		p->mcxt = mcxt;
+		p->index = 0;
+		p->done = false;
+		p->it = JsonbIteratorInit(v->container);
+		st = p;
+		MemoryContextSwitchTo(oldcxt);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_pushlightuserdata(L, st);
+	lua_pushvalue(L, lua_upvalueindex(3));
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 2);  /* keeps the loop mcxt alive as long as the closure */
+	lua_pushcclosure(L, pllua_jsonb_view_pairs_next, 4);
+	lua_pushnil(L);
+	lua_pushnil(L);
+	lua_pushvalue(L, 2);  /* put the loop mcxt in the close slot */
+	return 4;
+}
+
+static luaL_Reg jsonb_view_mt[] = {
+	{ "__len", pllua_jsonb_view_len },
+	{ "__tostring", pllua_jsonb_view_tostring },
+	{ NULL, NULL }
+};
+
+/* these need the module upvalues */
+static luaL_Reg jsonb_view_mt_up[] = {
+	{ "__index", pllua_jsonb_view_index },
+	{ "__pairs", pllua_jsonb_view_pairs },
+	{ NULL, NULL }
+};
+
 
 static luaL_Reg jsonb_meta[] = {
 	{ "__call", pllua_jsonb_map },
@@ -1252,6 +1882,8 @@ static luaL_Reg jsonb_funcs[] = {
 	{ "pairs", pllua_jsonb_pairs },
 	{ "ipairs", pllua_jsonb_ipairs },
 	{ "type", pllua_jsonb_type },
+	{ "builder", pllua_jsonb_builder },
+	{ "view", pllua_jsonb_view },
 	{ NULL, NULL }
 };
 
@@ -1304,6 +1936,22 @@ int pllua_open_jsonb(lua_State *L)
 	lua_pushvalue(L, 4);
 	luaL_setfuncs(L, jsonb_funcs, 3);
 
+	pllua_newmetatable(L, PLLUA_JSONB_BUILDER_OBJECT, jsonb_builder_mt);
+	lua_newtable(L);
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 3);
+	lua_pushvalue(L, 4);
+	luaL_setfuncs(L, jsonb_builder_methods, 3);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	pllua_newmetatable(L, PLLUA_JSONB_VIEW_OBJECT, jsonb_view_mt);
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 3);
+	lua_pushvalue(L, 4);
+	luaL_setfuncs(L, jsonb_view_mt_up, 3);
+	lua_pop(L, 1);
+
 	lua_getuservalue(L, 3);  /* datum metatable */
 
 	lua_pushvalue(L, 1);  /* first upvalue for jsonb metamethods */
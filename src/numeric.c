@@ -329,6 +329,271 @@ pllua_numeric_tonumber(lua_State *L)
 	return 1;
 }
 
+/*
+ * Accumulators: numeric.accum([init]) returns a mutable object for running
+ * totals and products. The current value is kept as a single Numeric in the
+ * accumulator's own memory context and replaced in place on each operation,
+ * so no Datum object is created per step. Integer addends are summed in an
+ * int64 and only folded into the Numeric when this would overflow, when a
+ * non-additive op comes along, or when the value is read.
+ */
+typedef struct pllua_numeric_accum
+{
+	MemoryContext mcxt;
+	Numeric		value;
+	int64		pending;
+} pllua_numeric_accum;
+
+/* must be called inside a catch block, in acc->mcxt */
+static void
+pllua_numeric_accum_flush(pllua_numeric_accum *acc)
+{
+	if (acc->pending != 0)
+	{
+		Datum		tmp = DirectFunctionCall1(int8_numeric, Int64GetDatumFast(acc->pending));
+		Numeric		oldval = acc->value;
+
+		acc->value = DatumGetNumeric(DirectFunctionCall2(numeric_add,
+														 NumericGetDatum(oldval),
+														 tmp));
+		acc->pending = 0;
+		pfree(oldval);
+		pfree(DatumGetPointer(tmp));
+	}
+}
+
+/*
+ * Apply one op with the value at stack index nd. Lua numbers are converted
+ * in the same catch block as the operation itself; anything else that isn't
+ * already a Numeric goes through the numeric constructor (upvalue 1).
+ */
+static void
+pllua_numeric_accum_apply(lua_State *L, pllua_numeric_accum *acc,
+						  int op, int nd)
+{
+	pllua_datum *d = pllua_todatum(L, nd, lua_upvalueindex(1));
+	int			isint = 0;
+	lua_Integer	ival = 0;
+	float8		fval = 0;
+	bool		isnum = false;
+
+	if (!d && lua_type(L, nd) == LUA_TNUMBER)
+	{
+		isnum = true;
+		ival = lua_tointegerx(L, nd, &isint);
+		if (!isint)
+			fval = lua_tonumber(L, nd);
+
+		/* the cheap case: integer sums need no numeric arithmetic */
+		if (isint && (op == PLLUA_NUM_ADD || op == PLLUA_NUM_SUB))
+		{
+			int64		x = ival;
+
+			if (op == PLLUA_NUM_ADD || x != PG_INT64_MIN)
+			{
+				if (op == PLLUA_NUM_SUB)
+					x = -x;
+				if ((x >= 0 && acc->pending <= PG_INT64_MAX - x)
+					|| (x < 0 && acc->pending >= PG_INT64_MIN - x))
+				{
+					acc->pending += x;
+					return;
+				}
+			}
+		}
+	}
+	else if (!d)
+	{
+		lua_pushvalue(L, lua_upvalueindex(1));
+		lua_pushvalue(L, nd);
+		lua_call(L, 1, 1);
+		d = pllua_todatum(L, -1, lua_upvalueindex(1));
+		if (!d)
+			luaL_error(L, "numeric conversion did not yield a numeric datum");
+		lua_replace(L, nd);
+	}
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(acc->mcxt);
+		Numeric		oldval;
+		Datum		arg;
+		Datum		res = (Datum) 0;
+
+		if (!isnum)
+			arg = d->value;
+		else if (isint)
+			arg = DirectFunctionCall1(int8_numeric, Int64GetDatumFast((int64) ival));
+		else
+			arg = DirectFunctionCall1(float8_numeric, Float8GetDatumFast(fval));
+
+		if (op != PLLUA_NUM_ADD && op != PLLUA_NUM_SUB)
+			pllua_numeric_accum_flush(acc);
+
+		oldval = acc->value;
+		switch (op)
+		{
+			case PLLUA_NUM_ADD:
+				res = DirectFunctionCall2(numeric_add, NumericGetDatum(oldval), arg);	break;
+			case PLLUA_NUM_SUB:
+				res = DirectFunctionCall2(numeric_sub, NumericGetDatum(oldval), arg);	break;
+			case PLLUA_NUM_MUL:
+				res = DirectFunctionCall2(numeric_mul, NumericGetDatum(oldval), arg);	break;
+			case PLLUA_NUM_DIV:
+				res = DirectFunctionCall2(numeric_div, NumericGetDatum(oldval), arg);	break;
+		}
+		acc->value = DatumGetNumeric(res);
+		pfree(oldval);
+		if (isnum)
+			pfree(DatumGetPointer(arg));
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+}
+
+/*
+ * acc:add(...), acc:sub(...), acc:mul(...), acc:div(...) apply the op with
+ * each arg in turn, and return the accumulator.
+ *
+ * upvalue 1 is the numeric typeinfo object, 2 the opcode
+ */
+static int
+pllua_numeric_accum_op(lua_State *L)
+{
+	pllua_numeric_accum *acc = pllua_checkobject(L, 1, PLLUA_NUMERIC_ACCUM_OBJECT);
+	int			op = lua_tointeger(L, lua_upvalueindex(2));
+	int			nargs = lua_gettop(L);
+	int			i;
+
+	for (i = 2; i <= nargs; ++i)
+		pllua_numeric_accum_apply(L, acc, op, i);
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+ * Set the accumulator to the value at nd, or 0 if that is nil.
+ */
+static void
+pllua_numeric_accum_set(lua_State *L, pllua_numeric_accum *acc, int nd)
+{
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(acc->mcxt);
+		Numeric		oldval = acc->value;
+
+		acc->value = DatumGetNumeric(DirectFunctionCall1(int8_numeric, Int64GetDatumFast(0)));
+		acc->pending = 0;
+		if (oldval)
+			pfree(oldval);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	if (!lua_isnil(L, nd))
+		pllua_numeric_accum_apply(L, acc, PLLUA_NUM_ADD, nd);
+}
+
+/*
+ * acc:reset([value]) sets the accumulator to value or 0.
+ *
+ * upvalue 1 is the numeric typeinfo object
+ */
+static int
+pllua_numeric_accum_reset(lua_State *L)
+{
+	pllua_numeric_accum *acc = pllua_checkobject(L, 1, PLLUA_NUMERIC_ACCUM_OBJECT);
+
+	lua_settop(L, 2);
+	pllua_numeric_accum_set(L, acc, 2);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+ * acc:value() returns the current value as a new Numeric datum.
+ *
+ * upvalue 1 is the numeric typeinfo object
+ */
+static int
+pllua_numeric_accum_value(lua_State *L)
+{
+	pllua_numeric_accum *acc = pllua_checkobject(L, 1, PLLUA_NUMERIC_ACCUM_OBJECT);
+	pllua_typeinfo *t = pllua_totypeinfo(L, lua_upvalueindex(1));
+	pllua_datum *d = pllua_newdatum(L, lua_upvalueindex(1), (Datum) 0);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(acc->mcxt);
+
+		pllua_numeric_accum_flush(acc);
+		MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+		d->value = NumericGetDatum(acc->value);
+		pllua_savedatum(L, d, t);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 1;
+}
+
+static int
+pllua_numeric_accum_tostring(lua_State *L)
+{
+	lua_settop(L, 1);
+	luaL_getmetafield(L, 1, "__index");
+	lua_getfield(L, -1, "value");
+	lua_pushvalue(L, 1);
+	lua_call(L, 1, 1);
+	luaL_tolstring(L, -1, NULL);
+	return 1;
+}
+
+/*
+ * numeric.accum([init])
+ *
+ * upvalue 1 is the numeric typeinfo object
+ */
+static int
+pllua_numeric_accum_new(lua_State *L)
+{
+	pllua_numeric_accum *acc;
+
+	lua_settop(L, 1);
+	acc = pllua_newobject(L, PLLUA_NUMERIC_ACCUM_OBJECT,
+						  sizeof(pllua_numeric_accum), true);
+	acc->value = NULL;
+	acc->pending = 0;
+	acc->mcxt = pllua_newmemcontext(L, "pllua numeric accumulator",
+									ALLOCSET_SMALL_SIZES);
+	pllua_set_user_field(L, -2, "mcxt");
+
+	pllua_numeric_accum_set(L, acc, 1);
+
+	return 1;
+}
+
+static struct { const char *name; enum num_method_id id; } numeric_accum_ops[] = {
+	{ "add", PLLUA_NUM_ADD },
+	{ "sub", PLLUA_NUM_SUB },
+	{ "mul", PLLUA_NUM_MUL },
+	{ "div", PLLUA_NUM_DIV },
+	{ NULL, PLLUA_NUM_NONE }
+};
+
+static luaL_Reg numeric_accum_methods[] = {
+	{ "reset", pllua_numeric_accum_reset },
+	{ "value", pllua_numeric_accum_value },
+	{ NULL, NULL }
+};
+
+static luaL_Reg numeric_accum_mt[] = {
+	{ "__tostring", pllua_numeric_accum_tostring },
+	{ NULL, NULL }
+};
+
 
 static struct { const char *name; enum num_method_id id; } numeric_meta[] = {
 	{ "__add", PLLUA_NUM_ADD },
@@ -414,6 +679,24 @@ int pllua_open_numeric(lua_State *L)
 	luaL_setfuncs(L, numeric_plain_methods, 3);
 	lua_pop(L, 1);
 
+	pllua_newmetatable(L, PLLUA_NUMERIC_ACCUM_OBJECT, numeric_accum_mt);
+	lua_newtable(L);
+	for (i = 0; numeric_accum_ops[i].name; ++i)
+	{
+		lua_pushvalue(L, 2);
+		lua_pushinteger(L, numeric_accum_ops[i].id);
+		lua_pushcclosure(L, pllua_numeric_accum_op, 2);
+		lua_setfield(L, -2, numeric_accum_ops[i].name);
+	}
+	lua_pushvalue(L, 2);
+	luaL_setfuncs(L, numeric_accum_methods, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	lua_pushvalue(L, 2);
+	lua_pushcclosure(L, pllua_numeric_accum_new, 1);
+	lua_setfield(L, 1, "accum");
+
 	lua_pushvalue(L, 1);
 	return 1;
 }
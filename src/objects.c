@@ -366,6 +366,9 @@ int pllua_freeactivation(lua_State *L)
 	act->argtypes = NULL;
 	act->tupdesc = NULL;
 
+	luaL_unref(L, LUA_REGISTRYINDEX, act->typeinfo_ref);
+	act->typeinfo_ref = LUA_NOREF;
+
 	lua_rawgetp(L, LUA_REGISTRYINDEX, PLLUA_ACTIVATIONS);
 	lua_pushnil(L);
 	lua_rawsetp(L, -2, act);
@@ -472,6 +475,9 @@ int pllua_newactivation(lua_State *L)
 	act->resolved = false;
 	act->rettype = InvalidOid;
 	act->tupdesc = NULL;
+	act->simple_scalar = false;
+	act->typeinfo_ref = LUA_NOREF;
+	act->typeinfo_gen = 0;
 
 	act->interp = pllua_getinterpreter(L);
 	act->L = L;
@@ -699,7 +705,10 @@ static int pllua_funcobject_gc(lua_State *L)
 	ASSERT_LUA_CONTEXT;
 	*p = NULL;
 	if (obj)
+	{
+		--(pllua_getinterpreter(L)->n_functions);
 		pllua_destroy_funcinfo(L, obj);
+	}
 	return 0;
 }
 
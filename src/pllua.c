@@ -82,6 +82,8 @@ Datum pllua_common_call(FunctionCallInfo fcinfo, bool trusted)
 	pllua_activation_record act;
 	pllua_func_activation *funcact = (fcinfo->flinfo) ? fcinfo->flinfo->fn_extra : NULL;
 	ErrorContextCallback ecxt;
+	pllua_profile_frame prof;
+	bool		profiling = (pllua_profile_enabled && fcinfo->flinfo);
 
 	pllua_entry_stack_check();
 
@@ -102,6 +104,11 @@ Datum pllua_common_call(FunctionCallInfo fcinfo, bool trusted)
 
 	pllua_setcontext(NULL, PLLUA_CONTEXT_PG);
 
+	/* resumptions of a value-per-call SRF don't count as calls */
+	if (profiling)
+		pllua_profile_begin(&prof, fcinfo->flinfo->fn_oid,
+							!(funcact && funcact->thread));
+
 	/*
 	 * this catch block exists to save/restore the error context stack and
 	 * allow cleanup of our internal error state when returning to PG proper
@@ -137,9 +144,14 @@ Datum pllua_common_call(FunctionCallInfo fcinfo, bool trusted)
 			pllua_initial_protected_call(act.interp, pllua_call_event_trigger, &act);
 		else
 			pllua_initial_protected_call(act.interp, pllua_call_function, &act);
+
+		if (profiling)
+			pllua_profile_end(&prof);
 	}
 	PG_CATCH();
 	{
+		if (profiling)
+			pllua_profile_end(&prof);
 		if (interp)
 			pllua_error_cleanup(interp, &act);
 		PG_RE_THROW();
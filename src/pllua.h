@@ -15,6 +15,7 @@
 #include "utils/palloc.h"
 
 #include "miscadmin.h"
+#include "portability/instr_time.h"
 
 #include <lua.h>
 #include <lualib.h>
@@ -111,6 +112,7 @@ typedef enum
 
 extern pllua_context_type pllua_context;
 extern bool pllua_pending_error;
+extern int pllua_subxact_pending;
 
 #define ASSERT_PG_CONTEXT Assert(pllua_context == PLLUA_CONTEXT_PG)
 #define ASSERT_LUA_CONTEXT Assert(pllua_context == PLLUA_CONTEXT_LUA)
@@ -132,16 +134,26 @@ pllua_setcontext(lua_State *L, pllua_context_type newctx)
 
 /*
  * Abbreviate the most common form of catch block.
+ *
+ * Both forms start any pending pcall subtransactions before running the
+ * block, since anything that can throw a PG error needs one to roll back to.
+ * PLLUA_TRY_ERROK skips the pending-error check, for error reporting and
+ * interrupt checks; if an error is already pending it can't start a
+ * subtransaction either.
  */
 #define PLLUA_TRY() do {												\
 	pllua_context_type _pllua_oldctx = pllua_setcontext(L, PLLUA_CONTEXT_PG); \
 	MemoryContext _pllua_oldmcxt = CurrentMemoryContext;				\
-	PG_TRY()
+	PG_TRY();															\
+	if (unlikely(pllua_subxact_pending))								\
+		pllua_subxact_start()
 
 #define PLLUA_TRY_ERROK() do {												\
 	pllua_context_type _pllua_oldctx = pllua_setcontext(NULL, PLLUA_CONTEXT_PG); \
 	MemoryContext _pllua_oldmcxt = CurrentMemoryContext;				\
-	PG_TRY()
+	PG_TRY();															\
+	if (unlikely(pllua_subxact_pending) && !pllua_pending_error)		\
+		pllua_subxact_start()
 
 #define PLLUA_CATCH_RETHROW()											\
 	PG_CATCH();															\
@@ -203,6 +215,11 @@ typedef struct pllua_interpreter
 	lua_Alloc	allocf;
 	void	   *alloc_ud;		/* saved ud value for allocator */
 
+	struct pllua_slab *slab;	/* small-block allocator, if in use */
+	size_t		mem_used;		/* bytes currently allocated by Lua */
+	size_t		mem_peak;		/* high-water mark of mem_used */
+	bool		mem_limit_hit;	/* last failed allocation was due to limit */
+
 	MemoryContext mcxt;
 	MemoryContext emcxt;
 
@@ -212,6 +229,22 @@ typedef struct pllua_interpreter
 	bool		db_ready;
 
 	unsigned long gc_debt;		/* estimated additional GC debt */
+	unsigned long gc_runs;		/* number of extra GC calls made */
+	unsigned long gc_xact_runs;	/* how many of those were at commit */
+	double		gc_time;		/* seconds spent in extra GC calls */
+	double		gc_ratio;		/* smoothed debt/heap ratio (adaptive GC) */
+	int			gc_pause;		/* pause last set by adaptive GC */
+
+	unsigned long typeinfo_gen;	/* bumped by every typeinfo invalidation */
+
+	/* counts of live objects, for stats.interpreters() */
+	unsigned long n_datums;
+	unsigned long n_typeinfos;
+	unsigned long n_functions;
+	unsigned long n_statements;
+	unsigned long n_cursors;
+
+	int			call_depth;		/* calls in progress (see pllua_xact_callback) */
 
 	/* state below must be saved/restored for recursive calls */
 	pllua_activation_record cur_activation;
@@ -338,10 +371,18 @@ typedef struct pllua_func_activation
 	TupleDesc	tupdesc;
 	TypeFuncClass typefuncclass;
 	bool		retdomain;
+	bool		simple_scalar;	/* result and args are all plain scalars */
 
 	int			nargs;
 	Oid		   *argtypes;	/* with polymorphism resolved */
 
+	/*
+	 * registry ref of a table of typeinfos for the result [0] and args [1..n],
+	 * valid only while typeinfo_gen matches the interpreter's
+	 */
+	int			typeinfo_ref;
+	unsigned long typeinfo_gen;
+
 	/*
 	 * this data is allocated and referenced in lua, so we need to arrange to
 	 * drop it for GC when the context containing the pointer to it is reset
@@ -458,6 +499,8 @@ extern bool pllua_ending;
  * reg[PLLUA_TYPES] = { [integer oid] = typeinfo object }
  * reg[PLLUA_RECORDS] = { [integer typmod] = typeinfo object }
  * reg[PLLUA_PORTALS] = { [light(Portal)] = cursor object }
+ * reg[PLLUA_SPI_PLANCACHE] = { [query key] = stmt object }
+ * reg[PLLUA_SPI_PLANCACHE_LRU] = { [query key] = integer }
  *
  * metatables:
  * reg[PLLUA_FUNCTION_OBJECT]
@@ -485,9 +528,15 @@ extern char PLLUA_TYPES[];
 extern char PLLUA_RECORDS[];
 extern char PLLUA_ACTIVATIONS[];
 extern char PLLUA_PORTALS[];
+extern char PLLUA_SPI_PLANCACHE[];
+extern char PLLUA_SPI_PLANCACHE_LRU[];
 extern char PLLUA_FUNCTION_OBJECT[];
 extern char PLLUA_ERROR_OBJECT[];
 extern char PLLUA_IDXLIST_OBJECT[];
+extern char PLLUA_ARRAYVIEW_OBJECT[];
+extern char PLLUA_JSONB_BUILDER_OBJECT[];
+extern char PLLUA_JSONB_VIEW_OBJECT[];
+extern char PLLUA_NUMERIC_ACCUM_OBJECT[];
 extern char PLLUA_ACTIVATION_OBJECT[];
 extern char PLLUA_MCONTEXT_OBJECT[];
 extern char PLLUA_TYPEINFO_OBJECT[];
@@ -496,8 +545,10 @@ extern char PLLUA_TYPEINFO_PACKAGE_ARRAY_OBJECT[];
 extern char PLLUA_TUPCONV_OBJECT[];
 extern char PLLUA_TRIGGER_OBJECT[];
 extern char PLLUA_EVENT_TRIGGER_OBJECT[];
+extern char PLLUA_TRIGGER_TABLE_OBJECT[];
 extern char PLLUA_SPI_STMT_OBJECT[];
 extern char PLLUA_SPI_CURSOR_OBJECT[];
+extern char PLLUA_SPI_FUNC_OBJECT[];
 extern char PLLUA_LAST_ERROR[];
 extern char PLLUA_RECURSIVE_ERROR[];
 extern char PLLUA_FUNCTION_MEMBER[];
@@ -519,6 +570,8 @@ extern char PLLUA_SANDBOX_META[];
 /* init.c */
 
 pllua_interpreter *pllua_getstate(bool trusted, pllua_activation_record *act);
+void pllua_update_hook(lua_State *L);
+int pllua_num_held_states(void);
 
 /*
  * careful, mustn't throw
@@ -544,12 +597,23 @@ pllua_get_memory_cxt(lua_State *L)
 }
 
 int pllua_set_new_ident(lua_State *L);
-void pllua_run_extra_gc(lua_State *L, unsigned long gc_debt);
+size_t pllua_slab_reserved(pllua_interpreter *interp);
+unsigned long pllua_run_extra_gc(lua_State *L, unsigned long gc_debt, bool force);
+int pllua_xact_end_gc(lua_State *L);
 PGDLLEXPORT bool pllua_stack_is_too_deep(void);
 PGDLLEXPORT void pllua_stack_depth_error(void);
 
 extern bool pllua_track_gc_debt;
+extern struct HTAB *pllua_interp_hash;
+extern unsigned long pllua_interp_hits;
+extern unsigned long pllua_interp_held_used;
+extern unsigned long pllua_interp_created;
 extern bool pllua_do_install_globals;
+extern char *pllua_bytecode_cache_dir;
+extern int pllua_spi_plan_cache_size;
+extern bool pllua_materialize_srf;
+extern bool pllua_profile_enabled;
+extern bool pllua_profile_lines;
 
 /*
  * This is a macro because we want to avoid executing (sz_) at all if not tracking
@@ -573,6 +637,8 @@ void pllua_compile_inline(lua_State *L, const char *str, bool trusted);
 int pllua_compile(lua_State *L);
 int pllua_intern_function(lua_State *L);
 void pllua_validate_function(lua_State *L, Oid fn_oid, bool trusted);
+bool pllua_prewarm_function(lua_State *L, Oid fn_oid, Oid lang_oid, bool trusted);
+void pllua_install_module_searcher(lua_State *L);
 
 /* datum.c */
 int pllua_open_pgtype(lua_State *L);
@@ -644,6 +710,7 @@ PGDLLEXPORT int pllua_cpcall(lua_State *L, lua_CFunction func, void* arg);
 PGDLLEXPORT void pllua_pcall(lua_State *L, int nargs, int nresults, int msgh);
 PGDLLEXPORT int pllua_trampoline(lua_State *L);
 PGDLLEXPORT void pllua_pending_error_violation(lua_State *L);
+PGDLLEXPORT void pllua_subxact_start(void);
 
 void pllua_initial_protected_call(pllua_interpreter *interp,
 								  lua_CFunction func,
@@ -726,12 +793,44 @@ int pllua_preload_compat(lua_State *L);
 int pllua_open_spi(lua_State *L);
 
 int pllua_spi_convert_args(lua_State *L);
+int pllua_spi_convert_many(lua_State *L);
+int pllua_spi_copy_fill(lua_State *L);
 int pllua_spi_prepare_result(lua_State *L);
+int pllua_spi_prepare_columnar(lua_State *L);
+int pllua_spi_plancache_invalidate(lua_State *L);
 int pllua_cursor_cleanup_portal(lua_State *L);
 
 int pllua_spi_newcursor(lua_State *L);
 int pllua_cursor_name(lua_State *L);
 
+/* stats.c */
+int pllua_open_stats(lua_State *L);
+
+/*
+ * Profiler state for one (pllua) function call, kept on the C stack of the
+ * call handler while the call is in progress.
+ */
+typedef struct pllua_profile_frame
+{
+	struct pllua_profile_frame *parent;
+	struct pllua_profile_entry *entry;
+	struct pllua_profile_line_entry *saved_line;
+	bool		count_call;
+	instr_time	start;
+	double		child_time;
+	double		spi_start;
+	double		gc_start;
+	uint64		datums_start;
+} pllua_profile_frame;
+
+extern double pllua_profile_spi_time;
+extern double pllua_profile_gc_time;
+extern uint64 pllua_profile_datums;
+
+void pllua_profile_begin(pllua_profile_frame *frame, Oid fn_oid, bool count_call);
+void pllua_profile_end(pllua_profile_frame *frame);
+void pllua_profile_line(lua_State *L, lua_Debug *ar);
+
 /* time.c */
 int pllua_open_time(lua_State *L);
 
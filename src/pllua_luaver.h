@@ -70,6 +70,18 @@
 #define pllua_set_environment(L_,i_) lua_setupvalue(L_, i_, 1)
 #endif
 
+/*
+ * Loading and dumping chunks via reader/writer functions. Luajit spells the
+ * mode-taking loader lua_loadx, and its lua_dump has no "strip" option.
+ */
+#if LUA_VERSION_NUM == 501
+#define pllua_load(L_,r_,d_,n_,m_) lua_loadx(L_,r_,d_,n_,m_)
+#define pllua_dump(L_,w_,d_) lua_dump(L_,w_,d_)
+#else
+#define pllua_load(L_,r_,d_,n_,m_) lua_load(L_,r_,d_,n_,m_)
+#define pllua_dump(L_,w_,d_) lua_dump(L_,w_,d_,0)
+#endif
+
 /*
  * Handle API differences for lua_resume by emulating the 5.4 API on earlier
  * versions. Also fake out the warning system on earlier versions, and provide
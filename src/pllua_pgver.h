@@ -46,6 +46,11 @@
 #define PG_INT64_MAX	INT64CONST(0x7FFFFFFFFFFFFFFF)
 #endif
 
+/* no parallel query before 9.6 */
+#if PG_VERSION_NUM < 90600
+#define IsParallelWorker() (false)
+#endif
+
 /* catalog OID #defines changed in 14. */
 #if PG_VERSION_NUM < 140000
 #define EVENT_TRIGGEROID EVTTRIGGEROID
@@ -88,13 +93,33 @@
 	FunctionCallInfoData name_##data; \
 	FunctionCallInfo name_ = &name_##data
 
+#define PLLUA_FCINFO_SIZE(nargs_) sizeof(FunctionCallInfoData)
+
 #define LFCI_ARG_VALUE(fci_,n_) ((fci_)->arg[n_])
 #define LFCI_ARGISNULL(fci_,n_) ((fci_)->argnull[n_])
 #else
+#define PLLUA_FCINFO_SIZE(nargs_) SizeForFunctionCallInfo(nargs_)
+
 #define LFCI_ARG_VALUE(fci_,n_) ((fci_)->args[n_].value)
 #define LFCI_ARGISNULL(fci_,n_) ((fci_)->args[n_].isnull)
 #endif
 
+/* TupleTableSlot API changes */
+#if PG_VERSION_NUM < 120000
+#define pllua_make_minimal_slot(desc_) MakeSingleTupleTableSlot(desc_)
+#define pllua_slot_minimal_tuple(slot_) ExecFetchSlotMinimalTuple(slot_)
+#else
+#define pllua_make_minimal_slot(desc_) MakeSingleTupleTableSlot(desc_, &TTSOpsMinimalTuple)
+#define pllua_slot_minimal_tuple(slot_) ExecFetchSlotMinimalTuple(slot_, NULL)
+#endif
+
+/* local transaction id of the current transaction (needs storage/proc.h) */
+#if PG_VERSION_NUM >= 170000
+#define pllua_current_lxid() (MyProc->vxid.lxid)
+#else
+#define pllua_current_lxid() (MyProc->lxid)
+#endif
+
 /* TupleDesc structure change */
 #if PG_VERSION_NUM < 100000
 #define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
@@ -142,6 +167,21 @@
 #define pllua_noinline
 #endif
 
+/*
+ * pg12+ has a macro for testing for interrupts without servicing them; this
+ * is the same definition.
+ */
+#ifndef INTERRUPTS_PENDING_CONDITION
+#ifndef WIN32
+#define INTERRUPTS_PENDING_CONDITION() \
+	(unlikely(InterruptPending))
+#else
+#define INTERRUPTS_PENDING_CONDITION() \
+	(unlikely(UNBLOCKED_SIGNAL_QUEUE()) ? pgwin32_dispatch_queued_signals() : 0, \
+	 unlikely(InterruptPending))
+#endif
+#endif
+
 /* and likewise for unlikely() */
 #if !defined(unlikely)
 
@@ -6,16 +6,52 @@
 #if PG_VERSION_NUM >= 110000
 #include "access/xact.h"
 #endif
-#include "commands/trigger.h"
+#include "catalog/objectaccess.h"
+#include "catalog/pg_collation.h"
+#include "catalog/pg_proc.h"
 #include "catalog/pg_type.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
 #include "parser/analyze.h"
 #include "parser/parse_param.h"
+#include "portability/instr_time.h"
+#include "storage/lmgr.h"
+#include "storage/proc.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#if PG_VERSION_NUM >= 110000
+#include "utils/regproc.h"
+#endif
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
 
 #if PG_VERSION_NUM >= 110000
 #define PortalGetHeapMemory(portal) ((portal)->portalContext)
 #endif
 
+/*
+ * Run an SPI call (or other call back into PG), adding its elapsed time to
+ * the profiler's SPI time if pllua.profile is on.
+ */
+#define PLLUA_SPI_TIMED(stmt_)											\
+	do {																\
+		if (pllua_profile_enabled)										\
+		{																\
+			instr_time	start_;											\
+			instr_time	end_;											\
+			INSTR_TIME_SET_CURRENT(start_);								\
+			stmt_;														\
+			INSTR_TIME_SET_CURRENT(end_);								\
+			INSTR_TIME_SUBTRACT(end_, start_);							\
+			pllua_profile_spi_time += INSTR_TIME_GET_DOUBLE(end_);		\
+		}																\
+		else															\
+			stmt_;														\
+	} while (0)
+
 /*
  * plpgsql uses 10. We have a bit more overhead per queue fill since we
  * start/stop SPI and do a bunch of data copies, so a larger value seems good.
@@ -26,6 +62,22 @@
  */
 #define DEFAULT_FETCH_COUNT 50
 
+/*
+ * If no fetch count was given, rows() iterators adapt the fetch size: a batch
+ * that was used up in less than FAST_BATCH_MS doubles the size of the next
+ * one, and a batch that lasted more than SLOW_BATCH_MS halves it (but not
+ * below the default). Regardless of that, a batch is limited to work_mem
+ * worth of tuples, judged by the size of the tuples in the previous batch.
+ */
+#define MAX_ADAPTIVE_FETCH_COUNT 65536
+#define FAST_BATCH_MS 2.0
+#define SLOW_BATCH_MS 100.0
+
+/*
+ * copy_in sends this many rows per execution of its insert statement.
+ */
+#define COPY_BATCH_ROWS 1000
+
 typedef struct pllua_spi_statement {
 	SPIPlanPtr plan;
 	bool kept;
@@ -60,6 +112,11 @@ typedef struct pllua_spi_cursor {
 	bool is_ours;   /* we created (and will close) it? */
 	bool is_private;  /* nobody else should be touching it */
 	bool is_live;  /* cleared by callback */
+	/* state for adaptive fetch size, see pllua_spi_cursor_adapt */
+	int adaptive_count;
+	lua_Integer last_nrows;
+	uint64 last_bytes;
+	instr_time last_fetch;
 } pllua_spi_cursor;
 
 static pllua_spi_cursor *pllua_newcursor(lua_State *L);
@@ -114,11 +171,63 @@ static void pllua_spi_exit(lua_State *L)
 	SPI_finish();
 }
 
+/*
+ * Push the typeinfo for a result tupdesc.
+ *
+ * SPI results are nearly always of anonymous record type, for which a new
+ * typeinfo would have to be built for every result set. So the statement or
+ * cursor object at nobj (if not 0) remembers the last one it used, which is
+ * reused while the tupdesc still matches and no typeinfo invalidation has
+ * happened since.
+ */
+static void pllua_spi_push_result_typeinfo(lua_State *L, TupleDesc tupdesc, int nobj)
+{
+	unsigned long gen = pllua_getinterpreter(L)->typeinfo_gen;
+
+	if (!(tupdesc->tdtypeid == RECORDOID && tupdesc->tdtypmod < 0))
+	{
+		lua_pushcfunction(L, pllua_typeinfo_lookup);
+		lua_pushinteger(L, (lua_Integer) tupdesc->tdtypeid);
+		lua_pushinteger(L, (lua_Integer) tupdesc->tdtypmod);
+		lua_call(L, 2, 1);
+		return;
+	}
+
+	if (nobj)
+	{
+		bool current = (pllua_get_user_field(L, nobj, ".restype_gen") == LUA_TNUMBER
+						&& (unsigned long) lua_tointeger(L, -1) == gen);
+
+		lua_pop(L, 1);
+		if (current)
+		{
+			if (pllua_get_user_field(L, nobj, ".restype") == LUA_TUSERDATA)
+			{
+				pllua_typeinfo *t = pllua_totypeinfo(L, -1);
+
+				if (t && t->tupdesc && equalTupleDescs(t->tupdesc, tupdesc))
+					return;
+			}
+			lua_pop(L, 1);
+		}
+	}
+
+	pllua_newtypeinfo_raw(L, tupdesc->tdtypeid, tupdesc->tdtypmod, tupdesc);
+
+	if (nobj)
+	{
+		lua_pushvalue(L, -1);
+		pllua_set_user_field(L, nobj, ".restype");
+		lua_pushinteger(L, (lua_Integer) gen);
+		pllua_set_user_field(L, nobj, ".restype_gen");
+	}
+}
+
 /*
  * This creates the result but does not copy the data into the proper memory
  * context; see pllua_spi_save_result for that.
  *
- * args: light[tuptab] nrows [table baseidx]
+ * args: light[tuptab] nrows [table baseidx [stmt-or-cursor]]
  * returns: typeinfo table baseidx
  */
 int pllua_spi_prepare_result(lua_State *L)
@@ -126,27 +235,21 @@ int pllua_spi_prepare_result(lua_State *L)
 	SPITupleTable *tuptab = lua_touserdata(L, 1);
 	lua_Integer nrows = lua_tointeger(L, 2);
 	TupleDesc tupdesc = tuptab->tupdesc;
+	int nobj = (lua_type(L, 5) == LUA_TUSERDATA) ? 5 : 0;
 	lua_Integer base = 1;
 	lua_Integer i;
 
 	if (!lua_istable(L, 3))
 	{
-		lua_settop(L, 3);
+		if (lua_gettop(L) < 3)
+			lua_settop(L, 3);
 		lua_createtable(L, nrows, 0);
 		lua_replace(L, 3);
 	}
 	else
 		base = 1 + lua_tointeger(L, 4);
 
-	if (tupdesc->tdtypeid == RECORDOID && tupdesc->tdtypmod < 0)
-		pllua_newtypeinfo_raw(L, tupdesc->tdtypeid, tupdesc->tdtypmod, tupdesc);
-	else
-	{
-		lua_pushcfunction(L, pllua_typeinfo_lookup);
-		lua_pushinteger(L, (lua_Integer) tupdesc->tdtypeid);
-		lua_pushinteger(L, (lua_Integer) tupdesc->tdtypmod);
-		lua_call(L, 2, 1);
-	}
+	pllua_spi_push_result_typeinfo(L, tupdesc, nobj);
 
 	for (i = 0; i < nrows; ++i)
 	{
@@ -174,6 +277,122 @@ int pllua_spi_prepare_result(lua_State *L)
 	return 3;
 }
 
+/*
+ * Column-oriented variant of pllua_spi_prepare_result. Each tuple is deformed
+ * once, and its values are converted straight into per-column Lua arrays;
+ * values of types with a simple Lua representation never become datum objects
+ * at all. Everything ends up either as a plain Lua value or as a datum that
+ * has already been saved into our own memory context, so unlike the row
+ * result, no separate save pass is needed.
+ *
+ * Nulls are left as holes in the column arrays.
+ *
+ * args: light[tuptab] nrows
+ * returns: table of columns, indexed by both position and name
+ */
+int pllua_spi_prepare_columnar(lua_State *L)
+{
+	SPITupleTable *tuptab = lua_touserdata(L, 1);
+	lua_Integer nrows = lua_tointeger(L, 2);
+	TupleDesc tupdesc = tuptab->tupdesc;
+	int natts = tupdesc->natts;
+	Datum *values;
+	bool *nulls;
+	bool *flatten;
+	lua_Integer i;
+	int j;
+
+	lua_settop(L, 2);
+	luaL_checkstack(L, 20 + 2 * natts, NULL);
+
+	values = lua_newuserdata(L, Max(natts, 1) * sizeof(Datum));
+	nulls = lua_newuserdata(L, Max(natts, 1) * sizeof(bool));
+	flatten = lua_newuserdata(L, Max(natts, 1) * sizeof(bool));
+	lua_createtable(L, natts, natts);
+
+	/*
+	 * As in pllua_datum_deform_tuple, composite values might be in short or
+	 * compressed form and have to be expanded before making a datum of them.
+	 */
+	PLLUA_TRY();
+	{
+		for (j = 0; j < natts; ++j)
+		{
+			Form_pg_attribute att = TupleDescAttr(tupdesc, j);
+			char typtype = ((att->attlen == -1 && !att->attisdropped)
+							? get_typtype(getBaseType(att->atttypid))
+							: '\0');
+			flatten[j] = (att->attlen == -1
+						  && (att->atttypid == RECORDOID ||
+							  typtype == TYPTYPE_RANGE ||
+							  typtype == TYPTYPE_COMPOSITE));
+		}
+	}
+	PLLUA_CATCH_RETHROW();
+
+	/* stack: tuptab nrows values nulls flatten result [typeinfo column]... */
+
+	for (j = 0; j < natts; ++j)
+	{
+		Form_pg_attribute att = TupleDescAttr(tupdesc, j);
+
+		if (att->attisdropped)
+		{
+			lua_pushnil(L);
+			lua_pushnil(L);
+			continue;
+		}
+
+		lua_pushcfunction(L, pllua_typeinfo_lookup);
+		lua_pushinteger(L, (lua_Integer) att->atttypid);
+		lua_pushinteger(L, (lua_Integer) (att->atttypid == RECORDOID ? att->atttypmod : -1));
+		lua_call(L, 2, 1);
+		if (lua_isnil(L, -1))
+			luaL_error(L, "type %d not found", (int) att->atttypid);
+
+		lua_createtable(L, (int) Min(nrows, INT_MAX), 0);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, 6, j+1);
+		/* first column wins if names are duplicated */
+		if (lua_getfield(L, 6, NameStr(att->attname)) == LUA_TNIL)
+		{
+			lua_pushvalue(L, -2);
+			lua_setfield(L, 6, NameStr(att->attname));
+		}
+		lua_pop(L, 1);
+	}
+
+	for (i = 0; i < nrows; ++i)
+	{
+		HeapTuple htup = tuptab->vals[i];
+
+		PLLUA_TRY();
+		{
+			heap_deform_tuple(htup, tupdesc, values, nulls);
+			for (j = 0; j < natts; ++j)
+			{
+				if (!nulls[j] && flatten[j]
+					&& VARATT_IS_EXTENDED(DatumGetPointer(values[j])))
+					values[j] = PointerGetDatum(PG_DETOAST_DATUM(values[j]));
+			}
+		}
+		PLLUA_CATCH_RETHROW();
+
+		for (j = 0; j < natts; ++j)
+		{
+			int nt = 7 + 2*j;
+
+			if (nulls[j] || lua_isnil(L, nt))
+				continue;
+			pllua_datum_single(L, values[j], false, nt, pllua_totypeinfo(L, nt));
+			lua_rawseti(L, nt+1, i+1);
+		}
+	}
+
+	lua_pushvalue(L, 6);
+	return 1;
+}
+
 /*
  * stack: ... typeinfo table base
  */
@@ -317,10 +536,10 @@ static pllua_spi_statement *pllua_spi_make_statement(lua_State *L,
 	{
 		++pllua_spi_prepare_recursion;
 
-		stmt->plan = SPI_prepare_params(str,
-										pllua_spi_prepare_parser_setup_hook,
-										stmt,
-										opts);
+		PLLUA_SPI_TIMED(stmt->plan = SPI_prepare_params(str,
+														pllua_spi_prepare_parser_setup_hook,
+														stmt,
+														opts));
 
 		--pllua_spi_prepare_recursion;
 	}
@@ -350,6 +569,164 @@ static pllua_spi_statement *pllua_spi_make_statement(lua_State *L,
 	return stmt;
 }
 
+/*
+ * Plan cache for queries passed as strings, so that running the same query
+ * text in a loop doesn't parse and plan it from scratch every time.
+ *
+ * reg[PLLUA_SPI_PLANCACHE] = { [key] = stmt object, [0] = number of entries }
+ * reg[PLLUA_SPI_PLANCACHE_LRU] = { [key] = tick of last use }
+ *
+ * The key is the query text plus whatever argument types we knew in advance
+ * (i.e. those of datum arguments), since those affect how the query is
+ * parsed. Entries are only ever dropped from the tables; the plan is freed by
+ * the statement's __gc, so a nested call evicting an entry can't pull a plan
+ * out from under an outer call that is still executing it (the outer call
+ * keeps the object on its stack).
+ *
+ * Kept plans are revalidated by the PG plan cache when the objects they
+ * depend on change, but parameter types that were inferred when the plan was
+ * prepared are fixed; so the whole cache is discarded on type invalidations
+ * (see pllua_spi_plancache_invalidate).
+ */
+static lua_Integer pllua_spi_plancache_tick = 0;
+
+static void pllua_spi_plancache_evict(lua_State *L, int nc, int nlru)
+{
+	lua_Integer min_tick = LUA_MAXINTEGER;
+	int nbest;
+
+	lua_pushnil(L);
+	nbest = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, nlru))
+	{
+		lua_Integer tick = lua_tointeger(L, -1);
+		if (tick < min_tick)
+		{
+			min_tick = tick;
+			lua_pushvalue(L, -2);
+			lua_replace(L, nbest);
+		}
+		lua_pop(L, 1);
+	}
+	if (!lua_isnil(L, nbest))
+	{
+		lua_pushvalue(L, nbest);
+		lua_pushnil(L);
+		lua_rawset(L, nlru);
+		lua_pushvalue(L, nbest);
+		lua_pushnil(L);
+		lua_rawset(L, nc);
+		lua_rawgeti(L, nc, 0);
+		lua_pushinteger(L, lua_tointeger(L, -1) - 1);
+		lua_rawseti(L, nc, 0);
+		lua_pop(L, 1);
+	}
+	lua_settop(L, nbest - 1);
+}
+
+/*
+ * Find or create the cache entry for a query string. Pushes the statement
+ * object, which the caller must keep on the stack while using it. The
+ * returned pointer's target is NULL if the query still needs to be planned,
+ * see pllua_spi_plancache_fill.
+ */
+static void **pllua_spi_plancache_lookup(lua_State *L,
+										 const char *str,
+										 int nargs,
+										 Oid *argtypes)
+{
+	luaL_Buffer b;
+	void **p;
+	int nc;
+	int nlru;
+	int nkey;
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, PLLUA_SPI_PLANCACHE);
+	nc = lua_gettop(L);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, PLLUA_SPI_PLANCACHE_LRU);
+	nlru = nc + 1;
+
+	luaL_buffinit(L, &b);
+	luaL_addlstring(&b, (const char *) &nargs, sizeof(int));
+	if (nargs > 0)
+		luaL_addlstring(&b, (const char *) argtypes, nargs * sizeof(Oid));
+	luaL_addstring(&b, str);
+	luaL_pushresult(&b);
+	nkey = lua_gettop(L);
+
+	lua_pushvalue(L, nkey);
+	lua_pushinteger(L, ++pllua_spi_plancache_tick);
+	lua_rawset(L, nlru);
+
+	lua_pushvalue(L, nkey);
+	if (lua_rawget(L, nc) == LUA_TUSERDATA)
+		p = pllua_torefobject(L, -1, PLLUA_SPI_STMT_OBJECT);
+	else
+	{
+		lua_pop(L, 1);
+		p = pllua_newrefobject(L, PLLUA_SPI_STMT_OBJECT, NULL, true);
+		lua_pushvalue(L, nkey);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, nc);
+		lua_rawgeti(L, nc, 0);
+		lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+		lua_rawseti(L, nc, 0);
+		lua_pop(L, 1);
+
+		for (;;)
+		{
+			lua_Integer n;
+
+			lua_rawgeti(L, nc, 0);
+			n = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			if (n <= pllua_spi_plan_cache_size)
+				break;
+			pllua_spi_plancache_evict(L, nc, nlru);
+		}
+	}
+
+	lua_replace(L, nc);
+	lua_settop(L, nc);
+	return p;
+}
+
+/*
+ * PG context. Plan the query for a new cache entry if need be.
+ */
+static pllua_spi_statement *pllua_spi_plancache_fill(lua_State *L,
+													 void **cache_p,
+													 const char *str,
+													 int nargs,
+													 Oid *argtypes)
+{
+	pllua_spi_statement *stmt = *cache_p;
+
+	if (!stmt)
+	{
+		stmt = pllua_spi_make_statement(L, str, nargs, argtypes, 0);
+		SPI_keepplan(stmt->plan);
+		stmt->kept = true;
+		MemoryContextSetParent(stmt->mcxt, pllua_get_memory_cxt(L));
+		*cache_p = stmt;
+		++(pllua_getinterpreter(L)->n_statements);
+	}
+	return stmt;
+}
+
+/*
+ * Called via pllua_callback_broadcast; just start afresh.
+ */
+int pllua_spi_plancache_invalidate(lua_State *L)
+{
+	lua_createtable(L, 0, 8);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, PLLUA_SPI_PLANCACHE);
+	lua_createtable(L, 0, 8);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, PLLUA_SPI_PLANCACHE_LRU);
+	return 0;
+}
+
 /*
  * prepare(cmd,[{argtypes}, [{flag=true,...,fetch_count=n}])
  *
@@ -420,6 +797,7 @@ static int pllua_spi_prepare(lua_State *L)
 		stmt->fetch_count = fetch_count;
 		MemoryContextSetParent(stmt->mcxt, pllua_get_memory_cxt(L));
 		*p = stmt;
+		++(pllua_getinterpreter(L)->n_statements);
 
 		pllua_spi_exit(L);
 	}
@@ -459,13 +837,15 @@ static int pllua_spi_prepare(lua_State *L)
  * argtypes are as determined by the parser, may not match the actual type of
  * arg.
  */
-int pllua_spi_convert_args(lua_State *L)
+static void pllua_spi_convert_values(lua_State *L,
+									 Datum *values,
+									 bool *isnull,
+									 Oid *argtypes,
+									 int nargs,
+									 int argbase,
+									 int nreftab,
+									 lua_Integer refbase)
 {
-	Datum *values = lua_touserdata(L, 1);
-	bool *isnull = lua_touserdata(L, 2);
-	Oid *argtypes = lua_touserdata(L, 3);
-	int nargs = lua_gettop(L) - 4;
-	int argbase = 5;
 	int i;
 
 	for (i = 0; i < nargs; ++i)
@@ -499,7 +879,7 @@ int pllua_spi_convert_args(lua_State *L)
 			 * holding a reference here means that d remains valid even though
 			 * it's no longer on the stack
 			 */
-			lua_rawseti(L, 4, i+1);
+			lua_rawseti(L, nreftab, refbase+i+1);
 			values[i] = d->value;
 			isnull[i] = false;
 		}
@@ -509,6 +889,81 @@ int pllua_spi_convert_args(lua_State *L)
 			isnull[i] = true;
 		}
 	}
+}
+
+int pllua_spi_convert_args(lua_State *L)
+{
+	Datum *values = lua_touserdata(L, 1);
+	bool *isnull = lua_touserdata(L, 2);
+	Oid *argtypes = lua_touserdata(L, 3);
+	int nargs = lua_gettop(L) - 4;
+
+	pllua_spi_convert_values(L, values, isnull, argtypes, nargs, 5, 4, 0);
+	return 0;
+}
+
+/*
+ * Number of args in an execute_many row: the "n" field if there is one (as
+ * set by table.pack, so that trailing nils can be given), otherwise the
+ * number of elements before the first nil.
+ */
+static int
+pllua_spi_row_nargs(lua_State *L, int nd)
+{
+	int			isint = 0;
+	lua_Integer	n;
+
+	lua_getfield(L, nd, "n");
+	n = lua_tointegerx(L, -1, &isint);
+	lua_pop(L, 1);
+	if (isint)
+	{
+		if (n < 0 || n > INT_MAX)
+			luaL_error(L, "invalid \"n\" field in execute_many row");
+		return (int) n;
+	}
+
+	for (n = 0; lua_geti(L, nd, n+1) != LUA_TNIL; ++n)
+		lua_pop(L, 1);
+	lua_pop(L, 1);
+	return (int) n;
+}
+
+/*
+ * Convert the args for every row of an execute_many call in one go. The
+ * values for row r are at values[r*nargs]. Every row must have exactly nargs
+ * elements, as for spi.execute.
+ *
+ * args: light[values] light[isnull] light[argtypes] nargs nrows argtable rows
+ */
+int pllua_spi_convert_many(lua_State *L)
+{
+	Datum *values = lua_touserdata(L, 1);
+	bool *isnull = lua_touserdata(L, 2);
+	Oid *argtypes = lua_touserdata(L, 3);
+	int nargs = lua_tointeger(L, 4);
+	lua_Integer nrows = lua_tointeger(L, 5);
+	lua_Integer r;
+	int i;
+
+	luaL_checkstack(L, 20 + nargs, NULL);
+
+	for (r = 0; r < nrows; ++r)
+	{
+		int			rowargs;
+
+		lua_settop(L, 7);
+		if (lua_rawgeti(L, 7, r+1) != LUA_TTABLE)
+			luaL_error(L, "incorrect argument type for execute_many, table of rows expected");
+		rowargs = pllua_spi_row_nargs(L, 8);
+		if (rowargs != nargs)
+			luaL_error(L, "wrong number of arguments in row %d of execute_many: expected %d got %d",
+					   (int) (r+1), nargs, rowargs);
+		for (i = 0; i < nargs; ++i)
+			lua_geti(L, 8, i+1);
+		pllua_spi_convert_values(L, values + r*nargs, isnull + r*nargs,
+								 argtypes, nargs, 9, 6, r*nargs);
+	}
 	return 0;
 }
 
@@ -556,7 +1011,7 @@ pllua_spi_init_paramlist(int nargs, Datum *values, bool *isnull, Oid *types)
  * also stmt:execute_count(count, arg...)
  *
  */
-static int pllua_spi_execute_count(lua_State *L)
+static int pllua_spi_execute_internal(lua_State *L, bool columnar)
 {
 	void **p = pllua_torefobject(L, 1, PLLUA_SPI_STMT_OBJECT);
 	const char *str = lua_tostring(L, 1);
@@ -571,6 +1026,9 @@ static int pllua_spi_execute_count(lua_State *L)
 	lua_Integer count_param = luaL_optinteger(L, 2, 0);
 	long count;
 	volatile lua_Integer nrows = -1;
+	volatile int nret = 1;
+	void **cache_p = NULL;
+	int nstmt = p ? 1 : 0;
 	int i;
 
 	if (!str && !p)
@@ -617,6 +1075,13 @@ static int pllua_spi_execute_count(lua_State *L)
 
 	/* we're going to re-push all the args, better have space */
 	luaL_checkstack(L, 40+nargs, NULL);
+
+	if (!p && pllua_spi_plan_cache_size > 0)
+	{
+		cache_p = pllua_spi_plancache_lookup(L, str, nargs, argtypes);
+		nstmt = lua_gettop(L);
+	}
+
 	lua_createtable(L, nargs, 0);  /* table to hold refs to arg datums */
 
 	PLLUA_TRY();
@@ -626,7 +1091,9 @@ static int pllua_spi_execute_count(lua_State *L)
 		ParamListInfo paramLI = NULL;
 		int rc;
 
-		if (!stmt)
+		if (cache_p)
+			stmt = pllua_spi_plancache_fill(L, cache_p, str, nargs, argtypes);
+		else if (!stmt)
 			stmt = pllua_spi_make_statement(L, str, nargs, argtypes, 0);
 
 		if (stmt->nparams != nargs)
@@ -646,11 +1113,20 @@ static int pllua_spi_execute_count(lua_State *L)
 		if (nargs > 0)
 			paramLI = pllua_spi_init_paramlist(nargs, values, isnull, stmt->param_types);
 
-		rc = SPI_execute_plan_with_paramlist(stmt->plan, paramLI, readonly, count);
+		PLLUA_SPI_TIMED(rc = SPI_execute_plan_with_paramlist(stmt->plan, paramLI, readonly, count));
 		if (rc >= 0)
 		{
 			nrows = SPI_processed;
-			if (SPI_tuptable)
+			if (SPI_tuptable && columnar)
+			{
+				pllua_pushcfunction(L, pllua_spi_prepare_columnar);
+				lua_pushlightuserdata(L, SPI_tuptable);
+				lua_pushinteger(L, nrows);
+				pllua_pcall(L, 2, 1, 0);
+				lua_pushinteger(L, nrows);
+				nret = 2;
+			}
+			else if (SPI_tuptable)
 			{
 				/*
 				 * Blessing the tupdesc of the result turns out to be a bad
@@ -660,7 +1136,13 @@ static int pllua_spi_execute_count(lua_State *L)
 				pllua_pushcfunction(L, pllua_spi_prepare_result);
 				lua_pushlightuserdata(L, SPI_tuptable);
 				lua_pushinteger(L, nrows);
-				pllua_pcall(L, 2, 3, 0);
+				lua_pushnil(L);
+				lua_pushnil(L);
+				if (nstmt)
+					lua_pushvalue(L, nstmt);
+				else
+					lua_pushnil(L);
+				pllua_pcall(L, 5, 3, 0);
 
 				pllua_spi_save_result(L, nrows);
 				lua_pop(L, 1);
@@ -679,47 +1161,223 @@ static int pllua_spi_execute_count(lua_State *L)
 	}
 	PLLUA_CATCH_RETHROW();
 
-	return 1;
+	return nret;
 }
 
-/*
- * spi.execute(cmd, arg...) returns {rows...}
- * also stmt:execute(arg...)
- *
- * simple shim to insert the count arg
- */
-static int pllua_spi_execute(lua_State *L)
+static int pllua_spi_execute_count(lua_State *L)
 {
-	luaL_checkany(L, 1);
-	lua_pushcfunction(L, pllua_spi_execute_count);
-	lua_insert(L, 1);
-	lua_pushnil(L);
-	lua_insert(L, 3);
-	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
-	return lua_gettop(L);
+	return pllua_spi_execute_internal(L, false);
+}
+
+static int pllua_spi_execute_count_columnar(lua_State *L)
+{
+	return pllua_spi_execute_internal(L, true);
 }
 
 /*
- * c:open(cmd, arg...)
- * c:open(stmt, arg...)
+ * spi.execute_many(cmd, {{arg...}, {arg...}, ...}) returns count
+ * also stmt:execute_many({{arg...}, ...})
  *
+ * Executes the statement once for each row of args, returning the total
+ * number of rows processed. Any rows returned by the statement are discarded.
+ * Everything is done within a single SPI connection, with the args for all
+ * rows converted up front and a single parameter list that is overwritten
+ * for each execution.
+ *
+ * For a query string, argtypes are taken from the datums in the first row.
  */
-static int pllua_spi_cursor_open(lua_State *L)
+static int pllua_spi_execute_many(lua_State *L)
 {
-	pllua_spi_cursor *curs = pllua_checkobject(L, 1, PLLUA_SPI_CURSOR_OBJECT);
-	void **p = pllua_torefobject(L, 2, PLLUA_SPI_STMT_OBJECT);
-	pllua_spi_statement *stmt = p ? *p : NULL;
-	const char *str = lua_tostring(L, 2);
-	const char *name = NULL;
-	int nargs = lua_gettop(L) - 2;
-	int argbase = 3;
-	Datum d_values[100];
-	bool d_isnull[100];
+	void **p = pllua_torefobject(L, 1, PLLUA_SPI_STMT_OBJECT);
+	const char *str = lua_tostring(L, 1);
+	int nargs = 0;
 	Oid d_argtypes[100];
-	Datum *values = d_values;
-	bool *isnull = d_isnull;
+	Oid *argtypes = d_argtypes;
+	void **cache_p = NULL;
+	lua_Integer nrows = 0;
+	volatile lua_Integer total = 0;
+	int i;
+
+	if (!str && !p)
+		luaL_error(L, "incorrect argument type for execute_many, string or statement expected");
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+
+	if (pllua_ending)
+		luaL_error(L, "cannot call SPI during shutdown");
+
+	while (lua_rawgeti(L, 2, nrows+1) != LUA_TNIL)
+	{
+		lua_pop(L, 1);
+		++nrows;
+	}
+	lua_pop(L, 1);
+
+	if (str)
+	{
+		pllua_verify_encoding(L, str);
+
+		if (nrows > 0)
+		{
+			lua_rawgeti(L, 2, 1);
+			if (!lua_istable(L, -1))
+				luaL_error(L, "incorrect argument type for execute_many, table of rows expected");
+			nargs = pllua_spi_row_nargs(L, 3);
+			if (nargs > 99)
+				pllua_spi_alloc_argspace(L, nargs, NULL, NULL, &argtypes, NULL);
+			for (i = 0; i < nargs; ++i)
+			{
+				argtypes[i] = 0;
+				if (lua_geti(L, 3, i+1) == LUA_TUSERDATA)
+				{
+					pllua_typeinfo *dt;
+					pllua_datum *d = pllua_toanydatum(L, -1, &dt);
+					if (d)
+					{
+						argtypes[i] = dt->typeoid;
+						lua_pop(L, 1);
+					}
+				}
+				lua_pop(L, 1);
+			}
+		}
+	}
+
+	if (nrows == 0)
+	{
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	luaL_checkstack(L, 40, NULL);
+
+	if (!p && pllua_spi_plan_cache_size > 0)
+		cache_p = pllua_spi_plancache_lookup(L, str, nargs, argtypes);
+
+	lua_newtable(L);  /* table to hold refs to arg datums */
+
+	PLLUA_TRY();
+	{
+		bool readonly = pllua_spi_enter(L);
+		pllua_spi_statement *stmt = p ? *p : NULL;
+		ParamListInfo paramLI = NULL;
+		Datum *values;
+		bool *isnull;
+		int nparams;
+		lua_Integer r;
+
+		if (cache_p)
+			stmt = pllua_spi_plancache_fill(L, cache_p, str, nargs, argtypes);
+		else if (!stmt)
+			stmt = pllua_spi_make_statement(L, str, nargs, argtypes, 0);
+
+		nparams = stmt->nparams;
+		if ((Size) nrows > MaxAllocHugeSize / (sizeof(Datum) + sizeof(bool)) / Max(nparams, 1))
+			elog(ERROR, "pllua: too many rows for execute_many");
+
+		values = MemoryContextAllocHuge(CurrentMemoryContext,
+										Max(nparams, 1) * nrows * sizeof(Datum));
+		isnull = MemoryContextAllocHuge(CurrentMemoryContext,
+										Max(nparams, 1) * nrows * sizeof(bool));
+
+		pllua_pushcfunction(L, pllua_spi_convert_many);
+		lua_pushlightuserdata(L, values);
+		lua_pushlightuserdata(L, isnull);
+		lua_pushlightuserdata(L, stmt->param_types);
+		lua_pushinteger(L, nparams);
+		lua_pushinteger(L, nrows);
+		lua_pushvalue(L, -7);
+		lua_pushvalue(L, 2);
+		pllua_pcall(L, 7, 0, 0);
+
+		if (nparams > 0)
+			paramLI = pllua_spi_init_paramlist(nparams, values, isnull, stmt->param_types);
+
+		for (r = 0; r < nrows; ++r)
+		{
+			int rc;
+
+			if (r > 0)
+			{
+				for (i = 0; i < nparams; ++i)
+				{
+					paramLI->params[i].value = values[r*nparams + i];
+					paramLI->params[i].isnull = isnull[r*nparams + i];
+				}
+			}
+
+			PLLUA_SPI_TIMED(rc = SPI_execute_plan_with_paramlist(stmt->plan, paramLI, readonly, 0));
+			if (rc < 0)
+				elog(ERROR, "spi error: %s", SPI_result_code_string(rc));
+			total += SPI_processed;
+			if (SPI_tuptable)
+				SPI_freetuptable(SPI_tuptable);
+		}
+
+		pllua_spi_exit(L);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_pushinteger(L, total);
+	return 1;
+}
+
+/*
+ * spi.execute(cmd, arg...) returns {rows...}
+ * also stmt:execute(arg...)
+ *
+ * simple shim to insert the count arg
+ */
+static int pllua_spi_execute(lua_State *L)
+{
+	luaL_checkany(L, 1);
+	lua_pushcfunction(L, pllua_spi_execute_count);
+	lua_insert(L, 1);
+	lua_pushnil(L);
+	lua_insert(L, 3);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+/*
+ * spi.execute_columnar(cmd, arg...) returns {columns...}, nrows
+ * also stmt:execute_columnar(arg...)
+ *
+ * For queries that return no rows, returns the count as execute() does.
+ */
+static int pllua_spi_execute_columnar(lua_State *L)
+{
+	luaL_checkany(L, 1);
+	lua_pushcfunction(L, pllua_spi_execute_count_columnar);
+	lua_insert(L, 1);
+	lua_pushnil(L);
+	lua_insert(L, 3);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+/*
+ * c:open(cmd, arg...)
+ * c:open(stmt, arg...)
+ *
+ */
+static int pllua_spi_cursor_open(lua_State *L)
+{
+	pllua_spi_cursor *curs = pllua_checkobject(L, 1, PLLUA_SPI_CURSOR_OBJECT);
+	void **p = pllua_torefobject(L, 2, PLLUA_SPI_STMT_OBJECT);
+	pllua_spi_statement *stmt = p ? *p : NULL;
+	const char *str = lua_tostring(L, 2);
+	const char *name = NULL;
+	int nargs = lua_gettop(L) - 2;
+	int argbase = 3;
+	Datum d_values[100];
+	bool d_isnull[100];
+	Oid d_argtypes[100];
+	Datum *values = d_values;
+	bool *isnull = d_isnull;
 	Oid *argtypes = d_argtypes;
 	volatile Portal portal;
+	void **cache_p = NULL;
 	int i;
 
 	if (!str && !p)
@@ -770,6 +1428,10 @@ static int pllua_spi_cursor_open(lua_State *L)
 
 	/* we're going to re-push all the args, better have space */
 	luaL_checkstack(L, 40+nargs, NULL);
+
+	if (!stmt && pllua_spi_plan_cache_size > 0)
+		cache_p = pllua_spi_plancache_lookup(L, str, nargs, argtypes);
+
 	lua_createtable(L, nargs, 0);
 
 	PLLUA_TRY();
@@ -779,7 +1441,10 @@ static int pllua_spi_cursor_open(lua_State *L)
 
 		if (!stmt)
 		{
-			stmt = pllua_spi_make_statement(L, str, nargs, argtypes, 0);
+			if (cache_p)
+				stmt = pllua_spi_plancache_fill(L, cache_p, str, nargs, argtypes);
+			else
+				stmt = pllua_spi_make_statement(L, str, nargs, argtypes, 0);
 			if (!stmt->cursor_plan)
 				elog(ERROR, "pllua: invalid query for cursor");
 		}
@@ -801,7 +1466,7 @@ static int pllua_spi_cursor_open(lua_State *L)
 		if (nargs > 0)
 			paramLI = pllua_spi_init_paramlist(nargs, values, isnull, stmt->param_types);
 
-		portal = SPI_cursor_open_with_paramlist(name, stmt->plan, paramLI, readonly);
+		PLLUA_SPI_TIMED(portal = SPI_cursor_open_with_paramlist(name, stmt->plan, paramLI, readonly));
 
 		/*
 		 * If we made our own statement, we didn't save it so it goes away here
@@ -877,14 +1542,17 @@ static int pllua_spi_cursor_fetch(lua_State *L)
 
 		pllua_spi_enter(L);
 
-		SPI_scroll_cursor_fetch(curs->portal, dir, count);
+		PLLUA_SPI_TIMED(SPI_scroll_cursor_fetch(curs->portal, dir, count));
 		nrows = SPI_processed;
 		if (SPI_tuptable)
 		{
 			pllua_pushcfunction(L, pllua_spi_prepare_result);
 			lua_pushlightuserdata(L, SPI_tuptable);
 			lua_pushinteger(L, nrows);
-			pllua_pcall(L, 2, 3, 0);
+			lua_pushnil(L);
+			lua_pushnil(L);
+			lua_pushvalue(L, 1);
+			pllua_pcall(L, 5, 3, 0);
 
 			pllua_spi_save_result(L, nrows);
 			lua_pop(L, 1);
@@ -917,7 +1585,7 @@ static int pllua_spi_cursor_move(lua_State *L)
 
 		pllua_spi_enter(L);
 
-		SPI_scroll_cursor_move(curs->portal, dir, count);
+		PLLUA_SPI_TIMED(SPI_scroll_cursor_move(curs->portal, dir, count));
 		nrows = SPI_processed;
 		lua_pushinteger(L, nrows);
 
@@ -968,6 +1636,8 @@ static int pllua_stmt_gc(lua_State *L)
 	if (!stmt)
 		return 0;
 
+	--(pllua_getinterpreter(L)->n_statements);
+
 	PLLUA_TRY();
 	{
 		if (stmt->kept && stmt->plan)
@@ -1033,6 +1703,12 @@ static pllua_spi_cursor *pllua_newcursor(lua_State *L)
 	curs->is_ours = false;
 	curs->is_private = false;
 	curs->is_live = false;
+	curs->adaptive_count = 0;
+	curs->last_nrows = 0;
+	curs->last_bytes = 0;
+	INSTR_TIME_SET_ZERO(curs->last_fetch);
+
+	++(pllua_getinterpreter(L)->n_cursors);
 
 	return curs;
 }
@@ -1281,7 +1957,12 @@ static int pllua_cursor_gc(lua_State *L)
 
 	ASSERT_LUA_CONTEXT;
 
-	if (!curs || !curs->is_live || !curs->portal)
+	if (!curs)
+		return 0;
+
+	--(pllua_getinterpreter(L)->n_cursors);
+
+	if (!curs->is_live || !curs->portal)
 		return 0;
 
 	pllua_cursor_setportal(L, 1, curs, NULL, false);
@@ -1302,17 +1983,119 @@ static int pllua_cursor_meta_close(lua_State *L)
 }
 
 
+/*
+ * Choose the fetch size for the next batch of an adaptive cursor: double it
+ * while batches come back full and fast, halve it when they are slow, and cap
+ * it so that a batch stays within about work_mem.
+ */
+static void pllua_spi_cursor_adapt(pllua_spi_cursor *curs)
+{
+	int count = curs->adaptive_count;
+	instr_time now;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	if (count == 0)
+		count = DEFAULT_FETCH_COUNT;
+	else if (!INSTR_TIME_IS_ZERO(curs->last_fetch) && curs->last_nrows > 0)
+	{
+		instr_time elapsed = now;
+		double elapsed_ms;
+
+		INSTR_TIME_SUBTRACT(elapsed, curs->last_fetch);
+		elapsed_ms = INSTR_TIME_GET_MILLISEC(elapsed);
+
+		if (elapsed_ms < FAST_BATCH_MS && curs->last_nrows >= count)
+			count = Min(count * 2, MAX_ADAPTIVE_FETCH_COUNT);
+		else if (elapsed_ms > SLOW_BATCH_MS)
+			count = Max(count / 2, DEFAULT_FETCH_COUNT);
+
+		if (curs->last_bytes > 0)
+		{
+			uint64 rowsize = Max(curs->last_bytes / curs->last_nrows, 1);
+			uint64 maxrows = ((uint64) work_mem * 1024) / rowsize;
+
+			if ((uint64) count > maxrows)
+				count = (int) Max(maxrows, 2);
+		}
+	}
+
+	curs->adaptive_count = count;
+	curs->last_fetch = now;
+}
+
+/*
+ * Refill the queue table at nq from the private cursor object at ncurs. The
+ * table is reused across fetches rather than replaced, so iterating a large
+ * result doesn't generate a new table for every batch. Returns the number of
+ * rows fetched.
+ */
+static lua_Integer pllua_spi_cursor_refill(lua_State *L,
+										   pllua_spi_cursor *curs,
+										   int ncurs,
+										   int nq,
+										   int count)
+{
+	volatile lua_Integer nrows = 0;
+	volatile uint64 nbytes = 0;
+
+	if (pllua_ending)
+		luaL_error(L, "cannot call SPI during shutdown");
+
+	nq = lua_absindex(L, nq);
+
+	PLLUA_TRY();
+	{
+		pllua_spi_enter(L);
+
+		PLLUA_SPI_TIMED(SPI_scroll_cursor_fetch(curs->portal, FETCH_FORWARD, count));
+		nrows = SPI_processed;
+		if (SPI_tuptable)
+		{
+			uint64 i;
+			uint64 sz = 0;
+
+			for (i = 0; i < SPI_processed; ++i)
+				sz += SPI_tuptable->vals[i]->t_len;
+			nbytes = sz;
+
+			pllua_pushcfunction(L, pllua_spi_prepare_result);
+			lua_pushlightuserdata(L, SPI_tuptable);
+			lua_pushinteger(L, nrows);
+			lua_pushvalue(L, nq);
+			lua_pushinteger(L, 0);
+			lua_pushvalue(L, ncurs);
+			pllua_pcall(L, 5, 3, 0);
+
+			pllua_spi_save_result(L, nrows);
+			lua_pop(L, 3);
+		}
+
+		pllua_spi_exit(L);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	curs->last_nrows = nrows;
+	curs->last_bytes = nbytes;
+	return nrows;
+}
+
 /*
  * rows iterator
  *
  * upvalue 1: cursor object
  * upvalue 2: current queue pos
  * upvalue 3: current queue size
+ *
+ * Each row is removed from the queue as it is returned, so that it can be
+ * collected once the caller is done with it even though the queue table
+ * itself lives on.
  */
 static int pllua_spi_stmt_rows_iter(lua_State *L)
 {
 	pllua_spi_cursor *curs = pllua_checkobject(L, lua_upvalueindex(1), PLLUA_SPI_CURSOR_OBJECT);
 	int fetch_count = curs->is_private ? curs->fetch_count : 1;
+	bool adaptive = false;
 	int qpos = lua_tointeger(L, lua_upvalueindex(2));
 	int qlen = lua_tointeger(L, lua_upvalueindex(3));
 	/*
@@ -1323,11 +2106,39 @@ static int pllua_spi_stmt_rows_iter(lua_State *L)
 	if (!curs->portal || !curs->is_live)
 		luaL_error(L, "cannot iterate a closed cursor");
 	if (fetch_count == 0)
-		fetch_count = DEFAULT_FETCH_COUNT;
-	if (fetch_count > 1 && qpos < qlen)
+	{
+		adaptive = true;
+		fetch_count = curs->adaptive_count ? curs->adaptive_count : DEFAULT_FETCH_COUNT;
+	}
+	if ((adaptive || fetch_count > 1) && qpos < qlen)
 	{
 		pllua_get_user_field(L, lua_upvalueindex(1), "q");
 		lua_geti(L, -1, ++qpos);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, qpos);
+		lua_remove(L, -2);
+	}
+	else if (adaptive || fetch_count > 1)
+	{
+		if (adaptive)
+		{
+			pllua_spi_cursor_adapt(curs);
+			fetch_count = curs->adaptive_count;
+		}
+		if (pllua_get_user_field(L, lua_upvalueindex(1), "q") != LUA_TTABLE)
+		{
+			lua_pop(L, 1);
+			lua_createtable(L, fetch_count, 1);
+			lua_pushvalue(L, -1);
+			pllua_set_user_field(L, lua_upvalueindex(1), "q");
+		}
+		qpos = 1;
+		qlen = pllua_spi_cursor_refill(L, curs, lua_upvalueindex(1), -1, fetch_count);
+		lua_pushinteger(L, qlen);
+		lua_replace(L, lua_upvalueindex(3));
+		lua_geti(L, -1, 1);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, 1);
 		lua_remove(L, -2);
 	}
 	else
@@ -1338,15 +2149,6 @@ static int pllua_spi_stmt_rows_iter(lua_State *L)
 		lua_call(L, 2, 1);
 		if (lua_isnil(L,-1))
 			luaL_error(L, "cursor fetch returned nil");
-		if (fetch_count > 1)
-		{
-			lua_pushvalue(L, -1);
-			pllua_set_user_field(L, lua_upvalueindex(1), "q");
-			qpos = 1;
-			lua_getfield(L, -1, "n");
-			qlen = lua_tointeger(L, -1);
-			lua_replace(L, lua_upvalueindex(3));
-		}
 		lua_geti(L, -1, 1);
 	}
 	if (lua_isnil(L, -1))
@@ -1362,7 +2164,7 @@ static int pllua_spi_stmt_rows_iter(lua_State *L)
 		lua_pushnil(L);
 		return 1;
 	}
-	if (fetch_count > 1)
+	if (adaptive || fetch_count > 1)
 	{
 		lua_pushinteger(L, qpos);
 		lua_replace(L, lua_upvalueindex(2));
@@ -1418,63 +2220,973 @@ static int pllua_cursor_rows(lua_State *L)
 	return 3;
 }
 
-#if PG_VERSION_NUM >= 110000
-
-static int pllua_spi_xact(lua_State *L, bool commit)
+/*
+ * Fetch up to maxrows rows for copy_in from the source, converting each
+ * value. The source is either a sequence of rows, in which case ctl is the
+ * last index used, or an iterator function called as in a generic "for".
+ *
+ * A row that is a plain table is taken to hold the values in column order;
+ * anything else (e.g. a row datum) is indexed by column name.
+ *
+ * args: light[values] light[isnull] light[argtypes] ncols maxrows argtable
+ *       colnames iter state ctl
+ * returns: nrows ctl
+ */
+int pllua_spi_copy_fill(lua_State *L)
 {
-	pllua_interpreter *interp = pllua_getinterpreter(L);
-	if (interp->cur_activation.atomic)
-		luaL_error(L, "cannot commit or rollback in this context");
-	if (IsSubTransaction())
-		luaL_error(L, "cannot commit or rollback from inside a subtransaction");
+	Datum *values = lua_touserdata(L, 1);
+	bool *isnull = lua_touserdata(L, 2);
+	Oid *argtypes = lua_touserdata(L, 3);
+	int ncols = lua_tointeger(L, 4);
+	lua_Integer maxrows = lua_tointeger(L, 5);
+	lua_Integer n;
+	int i;
 
-	PLLUA_TRY();
+	luaL_checkstack(L, 20 + ncols, NULL);
+
+	for (n = 0; n < maxrows; ++n)
 	{
-		SPI_connect_ext(SPI_OPT_NONATOMIC);
-		if (commit)
-			SPI_commit();
+		lua_settop(L, 10);
+		if (lua_isfunction(L, 8))
+		{
+			lua_pushvalue(L, 8);
+			lua_pushvalue(L, 9);
+			lua_pushvalue(L, 10);
+			lua_call(L, 2, 1);
+			if (lua_isnil(L, -1))
+				break;
+			lua_pushvalue(L, -1);
+			lua_replace(L, 10);
+		}
 		else
-			SPI_rollback();
-		SPI_start_transaction();
-		SPI_finish();
+		{
+			lua_Integer idx = lua_tointeger(L, 10) + 1;
+			if (lua_rawgeti(L, 8, idx) == LUA_TNIL)
+				break;
+			lua_pushinteger(L, idx);
+			lua_replace(L, 10);
+		}
+
+		/* row is at 11, values go from 12 */
+		if (lua_type(L, 11) == LUA_TTABLE)
+		{
+			for (i = 0; i < ncols; ++i)
+				lua_geti(L, 11, i+1);
+		}
+		else if (lua_type(L, 11) == LUA_TUSERDATA)
+		{
+			for (i = 0; i < ncols; ++i)
+			{
+				lua_rawgeti(L, 7, i+1);
+				lua_gettable(L, 11);
+			}
+		}
+		else
+			luaL_error(L, "incorrect row type for copy_in, table or row datum expected");
+
+		pllua_spi_convert_values(L, values + n*ncols, isnull + n*ncols,
+								 argtypes, ncols, 12, 6, n*ncols);
 	}
-	PLLUA_CATCH_RETHROW();
 
-	return 0;
+	lua_pushinteger(L, n);
+	lua_pushvalue(L, 10);
+	return 2;
 }
 
-static int pllua_spi_commit(lua_State *L)
+/*
+ * spi.copy_in(table, {columns}, rows)
+ * spi.copy_in(table, {columns}, iter, state, ctl)
+ *
+ * Bulk-inserts rows into the named table, returning the number inserted. If
+ * columns is nil, all (non-generated) columns are used, in order.
+ *
+ * Rather than go through COPY's text or binary formats, the values are
+ * converted directly into datums, collected into one array per column, and
+ * inserted in batches of COPY_BATCH_ROWS via INSERT ... SELECT FROM unnest(),
+ * so that we get one executor run per batch rather than per row while still
+ * firing triggers and checking constraints normally.
+ */
+static int pllua_spi_copy_in(lua_State *L)
 {
-	return pllua_spi_xact(L, true);
-}
+	const char *relname = luaL_checkstring(L, 1);
+	NameData *attnames;
+	Oid *elemtypes;
+	volatile int ncols = 0;
+	volatile Oid relid = InvalidOid;
+	volatile lua_Integer total = 0;
+	int i;
 
-static int pllua_spi_rollback(lua_State *L)
-{
-	return pllua_spi_xact(L, false);
-}
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TTABLE);
+	if (!lua_isfunction(L, 3))
+		luaL_checktype(L, 3, LUA_TTABLE);
+	lua_settop(L, 5);
+	if (!lua_isfunction(L, 3))
+	{
+		lua_pushinteger(L, 0);
+		lua_replace(L, 5);
+	}
 
-#endif
+	if (pllua_ending)
+		luaL_error(L, "cannot call SPI during shutdown");
 
-static int pllua_spi_is_atomic(lua_State *L)
-{
-	pllua_interpreter *interp = pllua_getinterpreter(L);
-	lua_pushboolean(L, interp->cur_activation.atomic ? 1 : 0);
-	return 1;
-}
+	pllua_verify_encoding(L, relname);
+
+	/* 6, 7 - freed by GC */
+	attnames = lua_newuserdata(L, MaxTupleAttributeNumber * sizeof(NameData));
+	elemtypes = lua_newuserdata(L, MaxTupleAttributeNumber * sizeof(Oid));
+
+	if (!lua_isnil(L, 2))
+	{
+		for (i = 0; lua_geti(L, 2, i+1) != LUA_TNIL; ++i)
+		{
+			const char *colname = lua_tostring(L, -1);
+			if (!colname)
+				luaL_error(L, "column names for copy_in must be strings");
+			if (i >= MaxTupleAttributeNumber)
+				luaL_error(L, "too many columns for copy_in");
+			pllua_verify_encoding(L, colname);
+			strlcpy(NameStr(attnames[i]), colname, NAMEDATALEN);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		ncols = i;
+		if (ncols == 0)
+			luaL_error(L, "no columns specified for copy_in");
+	}
+
+	PLLUA_TRY();
+	{
+		Relation rel;
+		TupleDesc tupdesc;
+		AclResult aclresult;
+		int n = 0;
+
+		relid = DatumGetObjectId(DirectFunctionCall1(regclassin,
+													 CStringGetDatum(relname)));
+
+		/*
+		 * Check for INSERT privilege before taking the lock, as COPY FROM
+		 * does. Privileges on just some columns are enough here; the INSERT
+		 * itself checks the actual columns.
+		 */
+		aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_INSERT);
+		if (aclresult != ACLCHECK_OK)
+			aclresult = pg_attribute_aclcheck_all(relid, GetUserId(),
+												  ACL_INSERT, ACLMASK_ANY);
+		if (aclresult != ACLCHECK_OK)
+			aclcheck_error(aclresult,
+#if PG_VERSION_NUM >= 110000
+						   OBJECT_TABLE,
+#else
+						   ACL_KIND_CLASS,
+#endif
+						   get_rel_name(relid));
+
+		LockRelationOid(relid, RowExclusiveLock);
+		rel = RelationIdGetRelation(relid);
+		if (!RelationIsValid(rel))
+			elog(ERROR, "could not open relation with OID %u", relid);
+		tupdesc = RelationGetDescr(rel);
+
+		if (ncols == 0)
+		{
+			for (i = 0; i < tupdesc->natts; ++i)
+			{
+				Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+				if (att->attisdropped)
+					continue;
+#if PG_VERSION_NUM >= 100000
+				if (att->attidentity == ATTRIBUTE_IDENTITY_ALWAYS)
+					continue;
+#endif
+#if PG_VERSION_NUM >= 120000
+				if (att->attgenerated)
+					continue;
+#endif
+				attnames[n] = att->attname;
+				elemtypes[n] = att->atttypid;
+				++n;
+			}
+			ncols = n;
+		}
+		else
+		{
+			for (i = 0; i < ncols; ++i)
+			{
+				AttrNumber attnum = get_attnum(relid, NameStr(attnames[i]));
+				if (attnum <= 0)
+					ereport(ERROR,
+							(errcode(ERRCODE_UNDEFINED_COLUMN),
+							 errmsg("column \"%s\" of relation \"%s\" does not exist",
+									NameStr(attnames[i]),
+									RelationGetRelationName(rel))));
+				elemtypes[i] = TupleDescAttr(tupdesc, attnum - 1)->atttypid;
+			}
+		}
+
+		RelationClose(rel);
+
+		/*
+		 * Each column is passed as an array to unnest(), so array columns
+		 * can't be handled: there are no arrays of arrays, and unnest() of a
+		 * multidimensional array would flatten it anyway.
+		 */
+		for (i = 0; i < ncols; ++i)
+		{
+			elemtypes[i] = getBaseType(elemtypes[i]);
+			if (type_is_array(elemtypes[i]))
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("copy_in does not support array column \"%s\"",
+								NameStr(attnames[i]))));
+			if (!OidIsValid(get_array_type(elemtypes[i])))
+				elog(ERROR, "pllua: could not find array type for column \"%s\"",
+					 NameStr(attnames[i]));
+		}
+	}
+	PLLUA_CATCH_RETHROW();
+
+	if (ncols == 0)
+		luaL_error(L, "no columns to copy into");
+
+	/* 8 - column names, as Lua strings */
+	lua_createtable(L, ncols, 0);
+	for (i = 0; i < ncols; ++i)
+	{
+		lua_pushstring(L, NameStr(attnames[i]));
+		lua_rawseti(L, -2, i+1);
+	}
+
+	/* 9 - table to hold refs to arg datums */
+	lua_newtable(L);
+
+	luaL_checkstack(L, 40, NULL);
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext;
+		MemoryContext batchcxt;
+		pllua_spi_statement *stmt;
+		StringInfoData buf;
+		Oid *arraytypes;
+		int16 *typlen;
+		bool *typbyval;
+		char *typalign;
+		Datum *values;
+		bool *isnull;
+		Datum *colvalues;
+		bool *colnulls;
+		bool readonly = pllua_spi_enter(L);
+
+		arraytypes = palloc(ncols * sizeof(Oid));
+		typlen = palloc(ncols * sizeof(int16));
+		typbyval = palloc(ncols * sizeof(bool));
+		typalign = palloc(ncols * sizeof(char));
+
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "INSERT INTO %s (",
+						 quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+													get_rel_name(relid)));
+		for (i = 0; i < ncols; ++i)
+			appendStringInfo(&buf, "%s%s", (i ? ", " : ""),
+							 quote_identifier(NameStr(attnames[i])));
+		appendStringInfoString(&buf, ") SELECT * FROM unnest(");
+		for (i = 0; i < ncols; ++i)
+		{
+			arraytypes[i] = get_array_type(elemtypes[i]);
+			get_typlenbyvalalign(elemtypes[i], &typlen[i], &typbyval[i], &typalign[i]);
+			appendStringInfo(&buf, "%s$%d", (i ? ", " : ""), i + 1);
+		}
+		appendStringInfoChar(&buf, ')');
+
+		stmt = pllua_spi_make_statement(L, buf.data, ncols, arraytypes, 0);
+
+		values = palloc(COPY_BATCH_ROWS * ncols * sizeof(Datum));
+		isnull = palloc(COPY_BATCH_ROWS * ncols * sizeof(bool));
+		colvalues = palloc(COPY_BATCH_ROWS * sizeof(Datum));
+		colnulls = palloc(COPY_BATCH_ROWS * sizeof(bool));
+
+		batchcxt = AllocSetContextCreate(CurrentMemoryContext,
+										 "PL/Lua copy_in batch",
+										 ALLOCSET_DEFAULT_SIZES);
+
+		for (;;)
+		{
+			lua_Integer nrows;
+			Datum arrays[MaxTupleAttributeNumber];
+			bool arraynulls[MaxTupleAttributeNumber];
+			ParamListInfo paramLI;
+			int rc;
+
+			pllua_pushcfunction(L, pllua_spi_copy_fill);
+			lua_pushlightuserdata(L, values);
+			lua_pushlightuserdata(L, isnull);
+			lua_pushlightuserdata(L, elemtypes);
+			lua_pushinteger(L, ncols);
+			lua_pushinteger(L, COPY_BATCH_ROWS);
+			lua_pushvalue(L, 9);
+			lua_pushvalue(L, 8);
+			lua_pushvalue(L, 3);
+			lua_pushvalue(L, 4);
+			lua_pushvalue(L, 5);
+			pllua_pcall(L, 10, 2, 0);
+			lua_replace(L, 5);
+			nrows = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+
+			if (nrows == 0)
+				break;
+
+			oldcontext = MemoryContextSwitchTo(batchcxt);
+
+			for (i = 0; i < ncols; ++i)
+			{
+				int			dims[1];
+				int			lbs[1];
+				lua_Integer r;
+
+				for (r = 0; r < nrows; ++r)
+				{
+					colvalues[r] = values[r*ncols + i];
+					colnulls[r] = isnull[r*ncols + i];
+				}
+				dims[0] = (int) nrows;
+				lbs[0] = 1;
+				arrays[i] = PointerGetDatum(construct_md_array(colvalues, colnulls,
+															   1, dims, lbs,
+															   elemtypes[i],
+															   typlen[i],
+															   typbyval[i],
+															   typalign[i]));
+				arraynulls[i] = false;
+			}
+
+			paramLI = pllua_spi_init_paramlist(ncols, arrays, arraynulls, arraytypes);
+
+			MemoryContextSwitchTo(oldcontext);
+
+			PLLUA_SPI_TIMED(rc = SPI_execute_plan_with_paramlist(stmt->plan, paramLI, readonly, 0));
+			if (rc < 0)
+				elog(ERROR, "spi error: %s", SPI_result_code_string(rc));
+			total += SPI_processed;
+
+			MemoryContextReset(batchcxt);
+
+			if (nrows < COPY_BATCH_ROWS)
+				break;
+		}
+
+		pllua_spi_exit(L);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_pushinteger(L, total);
+	return 1;
+}
+
+/*
+ * spi.copy_out(query, callback, args...)
+ * also works with a statement in place of the query
+ *
+ * Runs the query through a private cursor (as spi.rows does, with the same
+ * adaptive fetching) and calls callback(row) for each result row. Returns the
+ * number of rows passed to the callback; if the callback returns false, the
+ * cursor is closed and no more rows are fetched.
+ */
+static int pllua_spi_copy_out(lua_State *L)
+{
+	int nargs = lua_gettop(L);
+	lua_Integer n = 0;
+	int i;
+
+	luaL_checkany(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	luaL_checkstack(L, 10 + nargs, NULL);
+
+	lua_pushcfunction(L, pllua_spi_stmt_rows);
+	lua_pushvalue(L, 1);
+	for (i = 3; i <= nargs; ++i)
+		lua_pushvalue(L, i);
+	lua_call(L, nargs - 1, 4);
+	/* stack: args... iter nil nil cursor */
+	lua_remove(L, -2);
+	lua_remove(L, -2);
+
+	for (;;)
+	{
+		lua_pushvalue(L, nargs + 1);
+		lua_call(L, 0, 1);
+		if (lua_isnil(L, -1))
+			break;
+		lua_pushvalue(L, 2);
+		lua_insert(L, -2);
+		lua_call(L, 1, 1);
+		++n;
+		if (lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+		{
+			lua_pushcfunction(L, pllua_cursor_close);
+			lua_pushvalue(L, nargs + 2);
+			lua_call(L, 1, 0);
+			break;
+		}
+		lua_pop(L, 1);
+	}
+
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+#if PG_VERSION_NUM >= 110000
+
+static int pllua_spi_xact(lua_State *L, bool commit)
+{
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+	if (interp->cur_activation.atomic)
+		luaL_error(L, "cannot commit or rollback in this context");
+	/* a pcall whose subtransaction hasn't been started yet counts too */
+	if (IsSubTransaction() || pllua_subxact_pending > 0)
+		luaL_error(L, "cannot commit or rollback from inside a subtransaction");
+
+	PLLUA_TRY();
+	{
+		SPI_connect_ext(SPI_OPT_NONATOMIC);
+		if (commit)
+			SPI_commit();
+		else
+			SPI_rollback();
+		SPI_start_transaction();
+		SPI_finish();
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 0;
+}
+
+static int pllua_spi_commit(lua_State *L)
+{
+	return pllua_spi_xact(L, true);
+}
+
+static int pllua_spi_rollback(lua_State *L)
+{
+	return pllua_spi_xact(L, false);
+}
+
+#endif
+
+/*
+ * Function handles
+ *
+ * f = spi.func("similarity(text,text)")   -- or an oid
+ * f(a,b)
+ *
+ * The function is looked up, permission-checked and set up for fmgr once, when
+ * the handle is made; each call then just converts the arguments, invokes the
+ * function through the saved FmgrInfo and FunctionCallInfo under a single
+ * catch block, and converts the result. Arguments are taken as plain Lua values
+ * where pllua_datum_from_value handles the type (text and bytea strings are
+ * copied into per-argument buffers that are reused across calls), as datums
+ * when they already have the right type, and otherwise via the argument type's
+ * constructor. Results are returned just as for a query result column.
+ *
+ * Only plain, non-set-returning functions whose argument types are not
+ * pseudotypes can be called this way. The handle is bound to the function
+ * definition as it was when the handle was made. The EXECUTE permission is
+ * checked when the handle is made, and again on a call whenever the current
+ * user or the transaction differs from the last check, so that a REVOKE or a
+ * SET ROLE takes effect much as it would for a query calling the function,
+ * without paying for a catalog lookup on every call.
+ *
+ * Argument conversions and results are allocated in one of two contexts used
+ * alternately. The arguments of a call are converted into its own context,
+ * and the other one, holding the previous call's data, is reset just before
+ * the function is invoked; nothing is needed from it by then, since results
+ * are copied when they are returned to Lua, and a result may point into its
+ * own call's arguments only.
+ *
+ * If the function calls back into the same handle (directly or indirectly),
+ * the inner call must not touch the fcinfo, argument buffers or call contexts,
+ * which all still belong to the outer call; it uses a fresh fcinfo (and a
+ * copy of the FmgrInfo, whose fn_extra the callee may be using) in a
+ * temporary context instead, which is left for the GC to free.
+ */
+typedef struct pllua_spi_func_arg
+{
+	Oid			argtype;
+	bool		use_buffer;
+	Size		buflen;
+	char	   *buf;
+} pllua_spi_func_arg;
+
+typedef struct pllua_spi_func
+{
+	FmgrInfo   *fn;
+	FunctionCallInfo fcinfo;
+	MemoryContext mcxt;
+	MemoryContext callcxt[2];
+	int			curcxt;
+	bool		busy;			/* a call is in progress */
+	Oid			acl_user;		/* user and transaction of the last */
+	LocalTransactionId acl_lxid;	/* successful permission check */
+	Oid			fnoid;
+	Oid			rettype;
+	Oid			collation;
+	bool		strict;
+	int			nargs;
+	pllua_spi_func_arg args[FLEXIBLE_ARRAY_MEMBER];
+} pllua_spi_func;
+
+/*
+ * Check EXECUTE permission on the function for the current user, as the
+ * executor does for a function call in a query. Called in PG context.
+ */
+static void
+pllua_spi_func_aclcheck(Oid fnoid)
+{
+	AclResult	aclresult;
+
+	aclresult = pg_proc_aclcheck(fnoid, GetUserId(), ACL_EXECUTE);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult,
+#if PG_VERSION_NUM >= 110000
+					   OBJECT_FUNCTION,
+#else
+					   ACL_KIND_PROC,
+#endif
+					   get_func_name(fnoid));
+	InvokeFunctionExecuteHook(fnoid);
+}
+
+/*
+ * spi.func(signature or oid)
+ */
+static int
+pllua_spi_func_new(lua_State *L)
+{
+	const char *sig = NULL;
+	volatile Oid fnoid = InvalidOid;
+	volatile Oid rettype = InvalidOid;
+	volatile Oid collation = InvalidOid;
+	volatile bool strict = false;
+	volatile int nargs = 0;
+	volatile Oid acl_user = InvalidOid;
+	volatile LocalTransactionId acl_lxid = InvalidLocalTransactionId;
+	Oid			argtypes[FUNC_MAX_ARGS];
+	pllua_spi_func *f;
+	MemoryContext mcxt;
+	int			i;
+
+	if (lua_type(L, 1) == LUA_TSTRING)
+		sig = lua_tostring(L, 1);
+	else
+	{
+		int			isint = 0;
+		lua_Integer oid = lua_tointegerx(L, 1, &isint);
+
+		if (!isint || oid <= 0 || oid > (lua_Integer) PG_UINT32_MAX)
+			luaL_argerror(L, 1, "function signature or oid expected");
+		fnoid = (Oid) oid;
+	}
+	lua_settop(L, 1);
+
+	PLLUA_TRY();
+	{
+		HeapTuple	proctup;
+		Form_pg_proc procform;
+		bool		collatable;
+
+		if (sig)
+			fnoid = DatumGetObjectId(DirectFunctionCall1(regprocedurein,
+														 CStringGetDatum(sig)));
+
+		proctup = SearchSysCache1(PROCOID, ObjectIdGetDatum(fnoid));
+		if (!HeapTupleIsValid(proctup))
+			elog(ERROR, "cache lookup failed for function %u", fnoid);
+		procform = (Form_pg_proc) GETSTRUCT(proctup);
+
+#if PG_VERSION_NUM >= 110000
+		if (procform->prokind != PROKIND_FUNCTION)
+#else
+		if (procform->proisagg || procform->proiswindow)
+#endif
+			ereport(ERROR,
+					(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+					 errmsg("function handles can only be made for plain functions")));
+		if (procform->proretset)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function handles do not support set-returning functions")));
+
+		rettype = procform->prorettype;
+		strict = procform->proisstrict;
+		nargs = procform->pronargs;
+		collatable = type_is_collatable(rettype);
+		for (i = 0; i < nargs; ++i)
+		{
+			argtypes[i] = procform->proargtypes.values[i];
+			if (get_typtype(argtypes[i]) == TYPTYPE_PSEUDO)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("function handles do not support arguments of type %s",
+								format_type_be(argtypes[i]))));
+			collatable = collatable || type_is_collatable(argtypes[i]);
+		}
+		if (get_typtype(rettype) == TYPTYPE_PSEUDO && rettype != VOIDOID)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function handles do not support results of type %s",
+							format_type_be(rettype))));
+		ReleaseSysCache(proctup);
+
+		/* what the parser would assign to a call with no COLLATE clause */
+		collation = collatable ? DEFAULT_COLLATION_OID : InvalidOid;
+
+		pllua_spi_func_aclcheck(fnoid);
+		acl_user = GetUserId();
+		acl_lxid = pllua_current_lxid();
+	}
+	PLLUA_CATCH_RETHROW();
+
+	f = pllua_newobject(L, PLLUA_SPI_FUNC_OBJECT,
+						offsetof(pllua_spi_func, args)
+						+ nargs * sizeof(pllua_spi_func_arg),
+						true);
+	f->fn = NULL;
+	f->fcinfo = NULL;
+	f->mcxt = NULL;
+	f->callcxt[0] = f->callcxt[1] = NULL;
+	f->curcxt = 0;
+	f->busy = false;
+	f->acl_user = acl_user;
+	f->acl_lxid = acl_lxid;
+	f->fnoid = fnoid;
+	f->rettype = rettype;
+	f->collation = collation;
+	f->strict = strict;
+	f->nargs = nargs;
+	for (i = 0; i < nargs; ++i)
+	{
+		f->args[i].argtype = argtypes[i];
+		f->args[i].use_buffer = (argtypes[i] == TEXTOID ||
+								 argtypes[i] == VARCHAROID ||
+								 argtypes[i] == BYTEAOID);
+		f->args[i].buflen = 0;
+		f->args[i].buf = NULL;
+	}
+
+	/* typeinfos: [0] is the result type, [i] the type of arg i */
+	lua_createtable(L, nargs, 1);
+	for (i = 0; i <= nargs; ++i)
+	{
+		Oid			typeid = (i == 0) ? rettype : argtypes[i - 1];
+
+		if (typeid == VOIDOID)
+			continue;
+		lua_pushcfunction(L, pllua_typeinfo_lookup);
+		lua_pushinteger(L, (lua_Integer) typeid);
+		lua_call(L, 1, 1);
+		if (lua_isnil(L, -1))
+			luaL_error(L, "type not found: %d", (int) typeid);
+		lua_rawseti(L, -2, i);
+	}
+	pllua_set_user_field(L, 2, "types");
+
+	mcxt = pllua_newmemcontext(L, "pllua function handle context",
+							   ALLOCSET_SMALL_SIZES);
+	pllua_set_user_field(L, 2, "mcxt");
+
+	pllua_pgfunc_new(L);
+	pllua_set_user_field(L, 2, "pgfunc");
+	pllua_get_user_field(L, 2, "pgfunc");
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(mcxt);
+
+		f->fn = pllua_pgfunc_init(L, -1, fnoid, nargs, argtypes, rettype);
+		f->fcinfo = palloc0(PLLUA_FCINFO_SIZE(nargs));
+		f->callcxt[0] = AllocSetContextCreate(mcxt,
+											  "pllua function handle call context",
+											  ALLOCSET_SMALL_SIZES);
+		f->callcxt[1] = AllocSetContextCreate(mcxt,
+											  "pllua function handle call context",
+											  ALLOCSET_SMALL_SIZES);
+		f->mcxt = mcxt;
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+	lua_pop(L, 1);
+
+	return 1;
+}
+
+/*
+ * Copy a string arg into its buffer as a varlena, growing the buffer if need
+ * be.
+ */
+static Datum
+pllua_spi_func_bufarg(lua_State *L, pllua_spi_func *f, int i)
+{
+	pllua_spi_func_arg *a = &f->args[i];
+	size_t		len;
+	const char *str = lua_tolstring(L, i + 2, &len);
+
+	if (a->argtype != BYTEAOID)
+	{
+		if (len != strlen(str))
+			luaL_error(L, "null characters not allowed in text values");
+		if (!pllua_verify_encoding_noerror(L, str))
+			luaL_error(L, "invalid encoding for text value");
+	}
+
+	if (len + VARHDRSZ > a->buflen)
+	{
+		Size		newlen = Max(len + VARHDRSZ, 2 * a->buflen);
+
+		if (len + VARHDRSZ > MaxAllocSize)
+			luaL_error(L, "string too long");
+		if (newlen > MaxAllocSize)
+			newlen = MaxAllocSize;
+		PLLUA_TRY();
+		{
+			char	   *newbuf = MemoryContextAlloc(f->mcxt, newlen);
+
+			if (a->buf)
+				pfree(a->buf);
+			a->buf = newbuf;
+			a->buflen = newlen;
+		}
+		PLLUA_CATCH_RETHROW();
+	}
+
+	memcpy(VARDATA(a->buf), str, len);
+	SET_VARSIZE(a->buf, len + VARHDRSZ);
+	return PointerGetDatum(a->buf);
+}
+
+/*
+ * Convert arg i (at stack index i+2) the general way, leaving the datum that
+ * is used in place of the original value so that it stays referenced.
+ */
+static Datum
+pllua_spi_func_datumarg(lua_State *L, pllua_spi_func *f, int i, int typesidx)
+{
+	int			nd = i + 2;
+	pllua_typeinfo *dt;
+	pllua_datum *d = pllua_toanydatum(L, nd, &dt);
+
+	/* not already an unexploded datum of the correct type? */
+	if (!d ||
+		dt->typeoid != f->args[i].argtype ||
+		dt->obsolete || dt->modified ||
+		d->modified)
+	{
+		if (d)
+			lua_pop(L, 1);		/* discard typeinfo */
+		lua_rawgeti(L, typesidx, i + 1);
+		lua_pushvalue(L, nd);
+		lua_call(L, 1, 1);
+		lua_replace(L, nd);
+		d = pllua_toanydatum(L, nd, &dt);
+	}
+	if (!d || dt->typeoid != f->args[i].argtype)
+		luaL_error(L, "inconsistent value type for argument %d", i + 1);
+	lua_pop(L, 1);				/* discard typeinfo */
+	return d->value;
+}
+
+/*
+ * __call(self, args...)
+ */
+static int
+pllua_spi_func_call(lua_State *L)
+{
+	pllua_spi_func *f = pllua_checkobject(L, 1, PLLUA_SPI_FUNC_OBJECT);
+	FunctionCallInfo volatile fcinfo = f->fcinfo;
+	FmgrInfo   *volatile flinfo = f->fn;
+	bool		reentered = f->busy;
+	MemoryContext callcxt;
+	MemoryContext prevcxt;
+	int			nargs = f->nargs;
+	int			typesidx = 0;
+	bool		anynull = false;
+	volatile Datum result = (Datum) 0;
+	volatile bool isnull = false;
+	int			i;
+
+	if (!fcinfo)
+		luaL_error(L, "function handle not initialized");
+	if (lua_gettop(L) - 1 > nargs)
+		luaL_error(L, "too many arguments: expected %d, got %d",
+				   nargs, lua_gettop(L) - 1);
+	lua_settop(L, nargs + 1);
+
+	if (reentered)
+	{
+		callcxt = pllua_newmemcontext(L, "pllua function handle call context",
+									  ALLOCSET_SMALL_SIZES);
+		prevcxt = NULL;
+		PLLUA_TRY();
+		{
+			fcinfo = MemoryContextAllocZero(callcxt, PLLUA_FCINFO_SIZE(nargs));
+			flinfo = MemoryContextAlloc(callcxt, sizeof(FmgrInfo));
+			fmgr_info_copy(flinfo, f->fn, callcxt);
+		}
+		PLLUA_CATCH_RETHROW();
+	}
+	else
+	{
+		callcxt = f->callcxt[f->curcxt];
+		prevcxt = f->callcxt[1 - f->curcxt];
+	}
+
+	for (i = 0; i < nargs; ++i)
+	{
+		int			nd = i + 2;
+		Datum		value = (Datum) 0;
+		bool		argnull = false;
+
+		if (lua_type(L, nd) == LUA_TSTRING && f->args[i].use_buffer && !reentered)
+			value = pllua_spi_func_bufarg(L, f, i);
+		else if (lua_isnil(L, nd))
+			argnull = true;
+		else
+		{
+			const char *errstr = NULL;
+			MemoryContext oldcontext = MemoryContextSwitchTo(callcxt);
+			bool		done = pllua_datum_from_value(L, nd, f->args[i].argtype,
+													  &value, &argnull, &errstr);
+
+			MemoryContextSwitchTo(oldcontext);
+			if (!done || errstr)
+			{
+				/* let the type's input function produce the error if any */
+				if (!typesidx)
+				{
+					pllua_get_user_field(L, 1, "types");
+					typesidx = lua_gettop(L);
+				}
+				value = pllua_spi_func_datumarg(L, f, i, typesidx);
+				argnull = false;
+			}
+		}
+
+		LFCI_ARG_VALUE(fcinfo, i) = value;
+		LFCI_ARGISNULL(fcinfo, i) = argnull;
+		anynull = anynull || argnull;
+	}
+
+	if (f->strict && anynull)
+	{
+		if (f->rettype == VOIDOID)
+			return 0;
+		lua_pushnil(L);
+		return 1;
+	}
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext;
+		bool		pushed = false;
+
+		if (prevcxt)
+			MemoryContextReset(prevcxt);
+		oldcontext = MemoryContextSwitchTo(callcxt);
+
+		if (!ActiveSnapshotSet())
+		{
+			PushActiveSnapshot(GetTransactionSnapshot());
+			pushed = true;
+		}
+
+		if (f->acl_user != GetUserId() || f->acl_lxid != pllua_current_lxid())
+		{
+			pllua_spi_func_aclcheck(f->fnoid);
+			f->acl_user = GetUserId();
+			f->acl_lxid = pllua_current_lxid();
+		}
+
+		InitFunctionCallInfoData(*fcinfo, flinfo, nargs, f->collation, NULL, NULL);
+		f->busy = true;
+		PG_TRY();
+		{
+			PLLUA_SPI_TIMED(result = FunctionCallInvoke(fcinfo));
+		}
+		PG_CATCH();
+		{
+			f->busy = reentered;
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+		f->busy = reentered;
+		isnull = fcinfo->isnull;
+
+		if (pushed)
+			PopActiveSnapshot();
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	if (!reentered)
+		f->curcxt = 1 - f->curcxt;
+
+	if (f->rettype == VOIDOID)
+		return 0;
+	if (isnull)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	pllua_get_user_field(L, 1, "types");
+	lua_rawgeti(L, -1, 0);
+	return pllua_datum_single(L, result, false, -1, pllua_totypeinfo(L, -1));
+}
+
+static int
+pllua_spi_func_tostring(lua_State *L)
+{
+	pllua_spi_func *f = pllua_checkobject(L, 1, PLLUA_SPI_FUNC_OBJECT);
+	const char *volatile name = NULL;
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+		name = format_procedure(f->fnoid);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_pushfstring(L, "function handle: %s", name);
+	return 1;
+}
+
+static int pllua_spi_is_atomic(lua_State *L)
+{
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+	lua_pushboolean(L, interp->cur_activation.atomic ? 1 : 0);
+	return 1;
+}
 
 static struct luaL_Reg spi_funcs[] = {
 	{ "execute", pllua_spi_execute },
 	{ "execute_count", pllua_spi_execute_count },
+	{ "execute_columnar", pllua_spi_execute_columnar },
+	{ "execute_many", pllua_spi_execute_many },
 	{ "prepare", pllua_spi_prepare },
 	{ "readonly", pllua_spi_is_readonly },
 	{ "findcursor", pllua_spi_findcursor },
 	{ "newcursor", pllua_spi_newcursor },
 	{ "rows", pllua_spi_stmt_rows },
+	{ "copy_in", pllua_spi_copy_in },
+	{ "copy_out", pllua_spi_copy_out },
 #if PG_VERSION_NUM >= 110000
 	{ "commit", pllua_spi_commit },
 	{ "rollback", pllua_spi_rollback },
 #endif
 	{ "is_atomic", pllua_spi_is_atomic },
+	{ "func", pllua_spi_func_new },
 	{ NULL, NULL }
 };
 
@@ -1512,6 +3224,8 @@ static struct luaL_Reg spi_stmt_methods[] = {
 	{ "issaved", pllua_spi_noop_true },
 	{ "execute", pllua_spi_execute },
 	{ "execute_count", pllua_spi_execute_count },
+	{ "execute_columnar", pllua_spi_execute_columnar },
+	{ "execute_many", pllua_spi_execute_many },
 	{ "getcursor", pllua_spi_stmt_getcursor },
 	{ "rows", pllua_spi_stmt_rows },
 	{ "numargs", pllua_stmt_numargs },
@@ -1519,6 +3233,12 @@ static struct luaL_Reg spi_stmt_methods[] = {
 	{ "cursor_ok", pllua_stmt_cursor_ok },
 	{ NULL, NULL }
 };
+static struct luaL_Reg spi_func_mt[] = {
+	{ "__call", pllua_spi_func_call },
+	{ "__tostring", pllua_spi_func_tostring },
+	{ NULL, NULL }
+};
+
 static struct luaL_Reg spi_stmt_mt[] = {
 	{ "__gc", pllua_stmt_gc },
 	{ "__call", pllua_spi_execute },
@@ -1539,6 +3259,9 @@ int pllua_open_spi(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	lua_pop(L, 1);
 
+	lua_pushcfunction(L, pllua_spi_plancache_invalidate);
+	lua_call(L, 0, 0);
+
 	/* make a weak table to hold portals: light[Portal] = cursor object */
 	pllua_new_weak_table(L, "v", "spi portal registry table");
 	lua_pop(L, 1);
@@ -1549,6 +3272,9 @@ int pllua_open_spi(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	lua_pop(L, 1);
 
+	pllua_newmetatable(L, PLLUA_SPI_FUNC_OBJECT, spi_func_mt);
+	lua_pop(L, 1);
+
 	lua_newtable(L);
 	luaL_setfuncs(L, spi_funcs, 0);
 
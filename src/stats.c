@@ -0,0 +1,682 @@
+/* stats.c */
+
+/*
+ * Introspection of interpreter resource usage, for tuning and for spotting
+ * leaks. Everything here reports on the calling interpreter only, except for
+ * stats.interpreters(), stats.pool() and the function profiler, which cover
+ * the whole backend.
+ */
+
+#include "pllua.h"
+
+#include "utils/hsearch.h"
+
+/*
+ * stats.memory()
+ *
+ * Returns a table of counters for this interpreter's Lua heap.
+ */
+static int
+pllua_stats_memory(lua_State *L)
+{
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, (lua_Integer) interp->mem_used);
+	lua_setfield(L, -2, "in_use");
+	lua_pushinteger(L, (lua_Integer) interp->mem_peak);
+	lua_setfield(L, -2, "peak");
+	lua_pushboolean(L, interp->slab != NULL);
+	lua_setfield(L, -2, "slab");
+	lua_pushinteger(L, (lua_Integer) pllua_slab_reserved(interp));
+	lua_setfield(L, -2, "slab_reserved");
+	return 1;
+}
+
+/*
+ * stats.reset_peak()
+ *
+ * Resets the high-water mark to the current usage.
+ */
+static int
+pllua_stats_reset_peak(lua_State *L)
+{
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+
+	interp->mem_peak = interp->mem_used;
+	return 0;
+}
+
+/*
+ * stats.gc()
+ *
+ * Returns a table of counters for the extra GC work done on behalf of
+ * pllua.extra_gc_multiplier, pllua.adaptive_gc and pllua.xact_end_gc.
+ * Collections run by Lua itself, or by collectgarbage(), are not included.
+ */
+static int
+pllua_stats_gc(lua_State *L)
+{
+	pllua_interpreter *interp = pllua_getinterpreter(L);
+
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, (lua_Integer) interp->gc_debt);
+	lua_setfield(L, -2, "debt");
+	lua_pushinteger(L, (lua_Integer) interp->gc_runs);
+	lua_setfield(L, -2, "runs");
+	lua_pushinteger(L, (lua_Integer) interp->gc_xact_runs);
+	lua_setfield(L, -2, "xact_runs");
+	lua_pushnumber(L, (lua_Number) interp->gc_time);
+	lua_setfield(L, -2, "time");
+	lua_pushnumber(L, (lua_Number) interp->gc_ratio);
+	lua_setfield(L, -2, "ratio");
+	return 1;
+}
+
+/*
+ * Total bytes allocated in a memory context and its children. Returns false
+ * if the server version doesn't let us find out.
+ */
+#if PG_VERSION_NUM >= 90600 && PG_VERSION_NUM < 130000
+static void
+pllua_stats_context_counters(MemoryContext cxt, MemoryContextCounters *totals)
+{
+	MemoryContext child;
+
+#if PG_VERSION_NUM >= 110000
+	cxt->methods->stats(cxt, NULL, NULL, totals);
+#else
+	cxt->methods->stats(cxt, 0, false, totals);
+#endif
+	for (child = cxt->firstchild; child != NULL; child = child->nextchild)
+		pllua_stats_context_counters(child, totals);
+}
+#endif
+
+static bool
+pllua_stats_context_bytes(MemoryContext cxt, Size *bytes)
+{
+#if PG_VERSION_NUM >= 130000
+	*bytes = MemoryContextMemAllocated(cxt, true);
+	return true;
+#elif PG_VERSION_NUM >= 90600
+	MemoryContextCounters totals;
+
+	memset(&totals, 0, sizeof(totals));
+	pllua_stats_context_counters(cxt, &totals);
+	*bytes = totals.totalspace;
+	return true;
+#else
+	(void) cxt;
+	*bytes = 0;
+	return false;
+#endif
+}
+
+typedef struct pllua_interp_snapshot
+{
+	Oid			user_id;
+	bool		trusted;
+	bool		current;
+	bool		have_mem;
+	size_t		heap;
+	size_t		peak;
+	unsigned long gc_debt;
+	unsigned long datums;
+	unsigned long typeinfos;
+	unsigned long functions;
+	unsigned long statements;
+	unsigned long cursors;
+	Size		mcxt_bytes;
+	Size		emcxt_bytes;
+} pllua_interp_snapshot;
+
+/*
+ * stats.interpreters()
+ *
+ * Returns an array with an entry for each interpreter in use in this backend
+ * (not only the calling one). Held (prebuilt, not yet used) interpreters are
+ * not included; see stats.pool().
+ */
+static int
+pllua_stats_interpreters(lua_State *L)
+{
+	pllua_interpreter *self = pllua_getinterpreter(L);
+	long		n = pllua_interp_hash ? hash_get_num_entries(pllua_interp_hash) : 0;
+	pllua_interp_snapshot *snaps = lua_newuserdata(L, Max(n, 1) * sizeof(pllua_interp_snapshot));
+	volatile long count = 0;
+	long		i;
+
+	if (n > 0)
+	{
+		PLLUA_TRY();
+		{
+			HASH_SEQ_STATUS hash_seq;
+			pllua_interpreter_hashent *desc;
+
+			hash_seq_init(&hash_seq, pllua_interp_hash);
+			while ((desc = hash_seq_search(&hash_seq)) != NULL)
+			{
+				pllua_interpreter *interp = desc->interp;
+				pllua_interp_snapshot *sn;
+
+				if (!interp || count >= n)
+					continue;
+				sn = &snaps[count++];
+				sn->user_id = desc->user_id;
+				sn->trusted = desc->trusted;
+				sn->current = (interp == self);
+				sn->heap = interp->mem_used;
+				sn->peak = interp->mem_peak;
+				sn->gc_debt = interp->gc_debt;
+				sn->datums = interp->n_datums;
+				sn->typeinfos = interp->n_typeinfos;
+				sn->functions = interp->n_functions;
+				sn->statements = interp->n_statements;
+				sn->cursors = interp->n_cursors;
+				sn->have_mem = pllua_stats_context_bytes(interp->mcxt,
+														 &sn->mcxt_bytes);
+				pllua_stats_context_bytes(interp->emcxt, &sn->emcxt_bytes);
+			}
+		}
+		PLLUA_CATCH_RETHROW();
+	}
+
+	lua_createtable(L, (int) count, 0);
+	for (i = 0; i < count; ++i)
+	{
+		pllua_interp_snapshot *sn = &snaps[i];
+
+		lua_createtable(L, 0, 14);
+		pllua_pushbigint(L, (int64) sn->user_id);
+		lua_setfield(L, -2, "user_id");
+		lua_pushboolean(L, sn->trusted);
+		lua_setfield(L, -2, "trusted");
+		lua_pushboolean(L, sn->current);
+		lua_setfield(L, -2, "current");
+		lua_pushinteger(L, (lua_Integer) sn->heap);
+		lua_setfield(L, -2, "heap");
+		lua_pushinteger(L, (lua_Integer) sn->peak);
+		lua_setfield(L, -2, "peak");
+		lua_pushinteger(L, (lua_Integer) sn->gc_debt);
+		lua_setfield(L, -2, "gc_debt");
+		lua_pushinteger(L, (lua_Integer) sn->datums);
+		lua_setfield(L, -2, "datums");
+		lua_pushinteger(L, (lua_Integer) sn->typeinfos);
+		lua_setfield(L, -2, "typeinfos");
+		lua_pushinteger(L, (lua_Integer) sn->functions);
+		lua_setfield(L, -2, "functions");
+		lua_pushinteger(L, (lua_Integer) sn->statements);
+		lua_setfield(L, -2, "statements");
+		lua_pushinteger(L, (lua_Integer) sn->cursors);
+		lua_setfield(L, -2, "cursors");
+		if (sn->have_mem)
+		{
+			lua_pushinteger(L, (lua_Integer) sn->mcxt_bytes);
+			lua_setfield(L, -2, "context_bytes");
+			lua_pushinteger(L, (lua_Integer) sn->emcxt_bytes);
+			lua_setfield(L, -2, "error_context_bytes");
+		}
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+/*
+ * stats.pool()
+ *
+ * Returns counters for interpreter lookups: how many held interpreters are
+ * left, and how many lookups found an existing interpreter, took a held one,
+ * or had to create one.
+ */
+static int
+pllua_stats_pool(lua_State *L)
+{
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, (lua_Integer) pllua_num_held_states());
+	lua_setfield(L, -2, "held");
+	lua_pushinteger(L, (lua_Integer) pllua_interp_hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, (lua_Integer) pllua_interp_held_used);
+	lua_setfield(L, -2, "held_used");
+	lua_pushinteger(L, (lua_Integer) pllua_interp_created);
+	lua_setfield(L, -2, "created");
+	return 1;
+}
+
+/*
+ * Function profiler (pllua.profile)
+ *
+ * The call handler brackets each call of a pllua function with
+ * pllua_profile_begin/end, which keep per-backend counters for each function
+ * oid. Calls of functions from other profiled functions (via SPI) are tracked
+ * with a stack of frames so that a caller's self time excludes them. Time in
+ * SPI (which includes spi.func calls), time in extra GC and the number of
+ * datum objects created are taken as deltas of backend-wide counters, so they
+ * include nested calls.
+ *
+ * With pllua.profile_lines also on, the hook is called at each new source
+ * line, and the time until the next line event (or the end of the call) is
+ * charged to that line. Time that a line spends in nested profiled calls is
+ * charged to the lines of the nested function instead.
+ *
+ * Line events happen in Lua context, possibly while handling an error, so
+ * they must not call into PG at all: the line entries are kept in a fixed
+ * open-addressing table that is allocated by pllua_profile_begin, and the
+ * hook does nothing but plain C work on it. Once the table reaches
+ * PLLUA_PROFILE_LINE_MAX entries, further new lines are not recorded.
+ *
+ * Entries are never removed, only zeroed by stats.reset_profile(), since
+ * frames of calls in progress point at them.
+ */
+typedef struct pllua_profile_entry
+{
+	Oid			fn_oid;			/* hash key, must be first */
+	uint64		calls;
+	double		total_time;
+	double		self_time;
+	double		spi_time;
+	double		gc_time;
+	uint64		datums;
+} pllua_profile_entry;
+
+typedef struct pllua_profile_line_key
+{
+	char		source[LUA_IDSIZE];
+	int			line;
+} pllua_profile_line_key;
+
+typedef struct pllua_profile_line_entry
+{
+	pllua_profile_line_key key;
+	bool		used;
+	uint64		hits;
+	double		time;
+} pllua_profile_line_entry;
+
+/* must be a power of 2 */
+#define PLLUA_PROFILE_LINE_SLOTS 4096
+#define PLLUA_PROFILE_LINE_MAX (PLLUA_PROFILE_LINE_SLOTS / 4 * 3)
+
+double pllua_profile_spi_time = 0;
+double pllua_profile_gc_time = 0;
+uint64 pllua_profile_datums = 0;
+
+static HTAB *pllua_profile_hash = NULL;
+static pllua_profile_line_entry *pllua_profile_line_tab = NULL;
+static int pllua_profile_line_count = 0;
+static pllua_profile_frame *pllua_profile_current = NULL;
+static pllua_profile_line_entry *pllua_profile_cur_line = NULL;
+static instr_time pllua_profile_line_start;
+
+/*
+ * Charge the time since the last line event to the current line.
+ */
+static void
+pllua_profile_line_flush(instr_time *now)
+{
+	if (pllua_profile_cur_line)
+	{
+		instr_time	elapsed = *now;
+
+		INSTR_TIME_SUBTRACT(elapsed, pllua_profile_line_start);
+		pllua_profile_cur_line->time += INSTR_TIME_GET_DOUBLE(elapsed);
+		pllua_profile_cur_line = NULL;
+	}
+}
+
+/*
+ * Called in PG context by the call handler; may throw (only on OOM).
+ */
+void
+pllua_profile_begin(pllua_profile_frame *frame, Oid fn_oid, bool count_call)
+{
+	pllua_profile_entry *entry;
+	bool		found;
+
+	if (pllua_profile_lines && !pllua_profile_line_tab)
+		pllua_profile_line_tab =
+			MemoryContextAllocZero(TopMemoryContext,
+								   PLLUA_PROFILE_LINE_SLOTS * sizeof(pllua_profile_line_entry));
+
+	if (!pllua_profile_hash)
+	{
+		HASHCTL		hash_ctl;
+
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(Oid);
+		hash_ctl.entrysize = sizeof(pllua_profile_entry);
+		pllua_profile_hash = hash_create("PLLua function profile",
+										 64,
+										 &hash_ctl,
+										 HASH_ELEM | HASH_BLOBS);
+	}
+
+	entry = hash_search(pllua_profile_hash, &fn_oid, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->calls = 0;
+		entry->total_time = 0;
+		entry->self_time = 0;
+		entry->spi_time = 0;
+		entry->gc_time = 0;
+		entry->datums = 0;
+	}
+
+	frame->parent = pllua_profile_current;
+	frame->entry = entry;
+	frame->count_call = count_call;
+	frame->child_time = 0;
+	frame->spi_start = pllua_profile_spi_time;
+	frame->gc_start = pllua_profile_gc_time;
+	frame->datums_start = pllua_profile_datums;
+	INSTR_TIME_SET_CURRENT(frame->start);
+
+	/* the caller's line picks up again when we return */
+	frame->saved_line = pllua_profile_cur_line;
+	pllua_profile_line_flush(&frame->start);
+	pllua_profile_current = frame;
+}
+
+/*
+ * Called in PG context by the call handler, both on normal exit and on error;
+ * must not throw.
+ */
+void
+pllua_profile_end(pllua_profile_frame *frame)
+{
+	pllua_profile_entry *entry = frame->entry;
+	instr_time	now;
+	instr_time	elapsed;
+	double		secs;
+
+	INSTR_TIME_SET_CURRENT(now);
+	elapsed = now;
+	INSTR_TIME_SUBTRACT(elapsed, frame->start);
+	secs = INSTR_TIME_GET_DOUBLE(elapsed);
+
+	pllua_profile_line_flush(&now);
+	pllua_profile_cur_line = frame->saved_line;
+	pllua_profile_line_start = now;
+
+	if (frame->count_call)
+		entry->calls++;
+	entry->total_time += secs;
+	entry->self_time += secs - frame->child_time;
+	entry->spi_time += pllua_profile_spi_time - frame->spi_start;
+	entry->gc_time += pllua_profile_gc_time - frame->gc_start;
+	entry->datums += pllua_profile_datums - frame->datums_start;
+
+	pllua_profile_current = frame->parent;
+	if (frame->parent)
+	{
+		frame->parent->child_time += secs;
+		/* the caller's SPI timing already covers this whole call */
+		pllua_profile_spi_time = frame->spi_start;
+	}
+}
+
+/*
+ * Find or add the entry for a line. Plain C only, see above. Returns NULL if
+ * the line is new and the table is full.
+ */
+static pllua_profile_line_entry *
+pllua_profile_line_lookup(const char *source, int line)
+{
+	pllua_profile_line_entry *tab = pllua_profile_line_tab;
+	uint32		h = 2166136261U;
+	const unsigned char *p;
+	uint32		i;
+
+	/* FNV-1a */
+	for (p = (const unsigned char *) source; *p; ++p)
+		h = (h ^ *p) * 16777619U;
+	h = (h ^ (uint32) line) * 16777619U;
+
+	for (i = h & (PLLUA_PROFILE_LINE_SLOTS - 1);
+		 tab[i].used;
+		 i = (i + 1) & (PLLUA_PROFILE_LINE_SLOTS - 1))
+	{
+		if (tab[i].key.line == line && strcmp(tab[i].key.source, source) == 0)
+			return &tab[i];
+	}
+
+	if (pllua_profile_line_count >= PLLUA_PROFILE_LINE_MAX)
+		return NULL;
+
+	strlcpy(tab[i].key.source, source, sizeof(tab[i].key.source));
+	tab[i].key.line = line;
+	tab[i].hits = 0;
+	tab[i].time = 0;
+	tab[i].used = true;
+	++pllua_profile_line_count;
+	return &tab[i];
+}
+
+/*
+ * Line event from the hook, in Lua context. Must not call into PG, since
+ * this can run while an error is pending or inside a lazy subtransaction
+ * that has not been started.
+ */
+void
+pllua_profile_line(lua_State *L, lua_Debug *ar)
+{
+	pllua_profile_line_entry *entry;
+	instr_time	now;
+
+	if (!pllua_profile_current || !pllua_profile_line_tab)
+		return;
+
+	INSTR_TIME_SET_CURRENT(now);
+	pllua_profile_line_flush(&now);
+
+	if (!lua_getinfo(L, "S", ar))
+		return;
+
+	entry = pllua_profile_line_lookup(ar->short_src, ar->currentline);
+	if (!entry)
+		return;
+
+	entry->hits++;
+	pllua_profile_cur_line = entry;
+	INSTR_TIME_SET_CURRENT(pllua_profile_line_start);
+}
+
+/*
+ * Copy the entries of a profile hash into a new userdata on the stack, since
+ * we can't build Lua tables while a hash scan is open. Returns the count.
+ */
+static long
+pllua_profile_copy_entries(lua_State *L, HTAB *hash, Size entrysize)
+{
+	long		n = hash ? hash_get_num_entries(hash) : 0;
+	char	   *buf = lua_newuserdata(L, Max(n, 1) * entrysize);
+	volatile long count = 0;
+
+	if (n == 0)
+		return 0;
+
+	PLLUA_TRY();
+	{
+		HASH_SEQ_STATUS hash_seq;
+		void	   *p;
+
+		hash_seq_init(&hash_seq, hash);
+		while ((p = hash_seq_search(&hash_seq)) != NULL)
+		{
+			if (count < n)
+				memcpy(buf + count * entrysize, p, entrysize);
+			count++;
+		}
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return Min(count, n);
+}
+
+/*
+ * stats.functions()
+ *
+ * Returns { [fn_oid] = { calls=, total_time=, self_time=, spi_time=,
+ * gc_time=, datums= } } for functions profiled in this backend (by any
+ * interpreter) since the last reset. Times are in seconds.
+ */
+static int
+pllua_stats_functions(lua_State *L)
+{
+	long		n = pllua_profile_copy_entries(L, pllua_profile_hash,
+											   sizeof(pllua_profile_entry));
+	pllua_profile_entry *ents = lua_touserdata(L, -1);
+	long		i;
+
+	lua_newtable(L);
+	for (i = 0; i < n; ++i)
+	{
+		pllua_profile_entry *e = &ents[i];
+
+		if (e->calls == 0 && e->total_time == 0)
+			continue;
+		lua_createtable(L, 0, 6);
+		lua_pushinteger(L, (lua_Integer) e->calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushnumber(L, (lua_Number) e->total_time);
+		lua_setfield(L, -2, "total_time");
+		lua_pushnumber(L, (lua_Number) e->self_time);
+		lua_setfield(L, -2, "self_time");
+		lua_pushnumber(L, (lua_Number) e->spi_time);
+		lua_setfield(L, -2, "spi_time");
+		lua_pushnumber(L, (lua_Number) e->gc_time);
+		lua_setfield(L, -2, "gc_time");
+		lua_pushinteger(L, (lua_Integer) e->datums);
+		lua_setfield(L, -2, "datums");
+		/* same key type as an oid column in a query result */
+		pllua_pushbigint(L, (int64) e->fn_oid);
+		lua_insert(L, -2);
+		lua_rawset(L, -3);
+	}
+	return 1;
+}
+
+static int
+pllua_profile_line_cmp(const void *a, const void *b)
+{
+	const pllua_profile_line_entry *la = a;
+	const pllua_profile_line_entry *lb = b;
+	int			c = strcmp(la->key.source, lb->key.source);
+
+	if (c != 0)
+		return c;
+	return (la->key.line > lb->key.line) - (la->key.line < lb->key.line);
+}
+
+/*
+ * stats.lines()
+ *
+ * Returns an array of { source=, line=, hits=, time= }, ordered by source and
+ * line, from the line profiler.
+ */
+static int
+pllua_stats_lines(lua_State *L)
+{
+	pllua_profile_line_entry *ents;
+	long		n = 0;
+	long		i;
+	lua_Integer	j = 0;
+
+	/* copy, so that sorting doesn't disturb the table */
+	ents = lua_newuserdata(L, Max(pllua_profile_line_count, 1) * sizeof(pllua_profile_line_entry));
+	if (pllua_profile_line_tab)
+	{
+		for (i = 0; i < PLLUA_PROFILE_LINE_SLOTS && n < pllua_profile_line_count; ++i)
+		{
+			if (pllua_profile_line_tab[i].used)
+				ents[n++] = pllua_profile_line_tab[i];
+		}
+	}
+
+	if (n > 1)
+		qsort(ents, n, sizeof(pllua_profile_line_entry), pllua_profile_line_cmp);
+
+	lua_newtable(L);
+	for (i = 0; i < n; ++i)
+	{
+		pllua_profile_line_entry *e = &ents[i];
+
+		if (e->hits == 0)
+			continue;
+		lua_createtable(L, 0, 4);
+		lua_pushstring(L, e->key.source);
+		lua_setfield(L, -2, "source");
+		lua_pushinteger(L, (lua_Integer) e->key.line);
+		lua_setfield(L, -2, "line");
+		lua_pushinteger(L, (lua_Integer) e->hits);
+		lua_setfield(L, -2, "hits");
+		lua_pushnumber(L, (lua_Number) e->time);
+		lua_setfield(L, -2, "time");
+		lua_rawseti(L, -2, ++j);
+	}
+	return 1;
+}
+
+/*
+ * stats.reset_profile()
+ */
+static int
+pllua_stats_reset_profile(lua_State *L)
+{
+	PLLUA_TRY();
+	{
+		HASH_SEQ_STATUS hash_seq;
+		pllua_profile_entry *e;
+
+		if (pllua_profile_hash)
+		{
+			hash_seq_init(&hash_seq, pllua_profile_hash);
+			while ((e = hash_seq_search(&hash_seq)) != NULL)
+			{
+				e->calls = 0;
+				e->total_time = 0;
+				e->self_time = 0;
+				e->spi_time = 0;
+				e->gc_time = 0;
+				e->datums = 0;
+			}
+		}
+	}
+	PLLUA_CATCH_RETHROW();
+
+	if (pllua_profile_line_tab)
+	{
+		int			i;
+
+		for (i = 0; i < PLLUA_PROFILE_LINE_SLOTS; ++i)
+		{
+			pllua_profile_line_tab[i].hits = 0;
+			pllua_profile_line_tab[i].time = 0;
+		}
+	}
+	return 0;
+}
+
+static struct luaL_Reg stats_funcs[] = {
+	{ "memory", pllua_stats_memory },
+	{ "gc", pllua_stats_gc },
+	{ "reset_peak", pllua_stats_reset_peak },
+	{ "interpreters", pllua_stats_interpreters },
+	{ "pool", pllua_stats_pool },
+	{ "functions", pllua_stats_functions },
+	{ "lines", pllua_stats_lines },
+	{ "reset_profile", pllua_stats_reset_profile },
+	{ NULL, NULL }
+};
+
+/*
+ * Does no db access, so safe to open in phase 1.
+ */
+int
+pllua_open_stats(lua_State *L)
+{
+	lua_settop(L, 0);
+	luaL_newlib(L, stats_funcs);
+	return 1;
+}
@@ -29,6 +29,14 @@
 	 (d) < (DATE_END_JULIAN - POSTGRES_EPOCH_JDATE))
 #endif
 
+#ifndef TIMESTAMP_END_JULIAN
+#define TIMESTAMP_END_JULIAN (109203528)	/* == date2j(294277, 1, 1) */
+#endif
+/* Can a date be converted to timestamp without error? */
+#define DATE_IN_TIMESTAMP_RANGE(d) \
+	((DATETIME_MIN_JULIAN - POSTGRES_EPOCH_JDATE) <= (d) && \
+	 (d) < (TIMESTAMP_END_JULIAN - POSTGRES_EPOCH_JDATE))
+
 #ifdef HAVE_INT64_TIMESTAMP
 #define FSEC_T_SCALE(f_) (f_)
 #else
@@ -725,7 +733,30 @@ pllua_time_tosql(lua_State *L)
 					break;
 			}
 
-			if (microsecs != 0 && oid != DATEOID && oid != INTERVALOID)
+#if defined(HAVE_INT64_TIMESTAMP) && defined(IS_VALID_TIMESTAMP)
+			/*
+			 * For timestamps, the fractional part can be applied directly to
+			 * the integer value without constructing an interval; the result is
+			 * identical because the offset is less than a day.
+			 */
+			if (microsecs != 0 && (oid == TIMESTAMPOID || oid == TIMESTAMPTZOID))
+			{
+				Timestamp	tval = DatumGetTimestamp(result);
+
+				if (microsecs > -USECS_PER_DAY && microsecs < USECS_PER_DAY)
+				{
+					tval += microsecs;
+					if (!IS_VALID_TIMESTAMP(tval))
+						ereport(ERROR,
+								(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+								 errmsg("timestamp out of range")));
+					result = TimestampGetDatum(tval);
+					addfunc = NULL;
+				}
+			}
+#endif
+
+			if (microsecs != 0 && addfunc)
 			{
 				float8 secs = microsecs / 1000000.0;
 				iresult = DirectFunctionCall7(make_interval,
@@ -1039,6 +1070,212 @@ pllua_time_part(lua_State *L, pllua_datum *d, Oid oid, const char *opart)
 }
 
 
+/*
+ * Fast path for the commonest field accesses on date, timestamp and
+ * timestamptz values, which avoids the text conversion and fmgr call of
+ * date_part by decomposing the value natively.
+ *
+ * The broken-down value of the most recently accessed datum is cached, so
+ * that code like "d.year, d.month, d.day" only decomposes it once. The cache
+ * key includes the session timezone for timestamptz, which changes pointer
+ * whenever the setting changes.
+ */
+static struct
+{
+	bool		valid;
+	Oid			oid;
+	Timestamp	value;
+	pg_tz	   *tz;
+	struct pg_tm tm;
+	fsec_t		fsec;
+} pllua_time_tm_cache;
+
+/*
+ * Returns NULL if the value is not finite or can't be decomposed, in which
+ * case the caller falls back to the general path (which will report any
+ * error). None of the functions called here throw.
+ */
+static struct pg_tm *
+pllua_time_get_tm(Datum val, Oid oid, fsec_t *fsec)
+{
+	Timestamp	key;
+	pg_tz	   *tz = (oid == TIMESTAMPTZOID) ? session_timezone : NULL;
+
+	if (oid == DATEOID)
+	{
+		DateADT		dval = DatumGetDateADT(val);
+
+		if (DATE_NOT_FINITE(dval) || !DATE_IN_TIMESTAMP_RANGE(dval))
+			return NULL;
+		key = (Timestamp) dval;
+	}
+	else
+	{
+		Timestamp	tval = DatumGetTimestamp(val);
+
+		if (TIMESTAMP_NOT_FINITE(tval))
+			return NULL;
+		key = tval;
+	}
+
+	if (pllua_time_tm_cache.valid &&
+		pllua_time_tm_cache.oid == oid &&
+		pllua_time_tm_cache.value == key &&
+		pllua_time_tm_cache.tz == tz)
+	{
+		*fsec = pllua_time_tm_cache.fsec;
+		return &pllua_time_tm_cache.tm;
+	}
+
+	pllua_time_tm_cache.valid = false;
+	memset(&pllua_time_tm_cache.tm, 0, sizeof(struct pg_tm));
+	pllua_time_tm_cache.fsec = 0;
+
+	switch (oid)
+	{
+		case DATEOID:
+			j2date(DatumGetDateADT(val) + POSTGRES_EPOCH_JDATE,
+				   &pllua_time_tm_cache.tm.tm_year,
+				   &pllua_time_tm_cache.tm.tm_mon,
+				   &pllua_time_tm_cache.tm.tm_mday);
+			break;
+		case TIMESTAMPOID:
+			if (timestamp2tm(DatumGetTimestamp(val), NULL,
+							 &pllua_time_tm_cache.tm, &pllua_time_tm_cache.fsec,
+							 NULL, NULL) != 0)
+				return NULL;
+			break;
+		case TIMESTAMPTZOID:
+			{
+				int			tzo;
+
+				if (timestamp2tm(DatumGetTimestampTz(val), &tzo,
+								 &pllua_time_tm_cache.tm, &pllua_time_tm_cache.fsec,
+								 NULL, NULL) != 0)
+					return NULL;
+			}
+			break;
+		default:
+			return NULL;
+	}
+
+	pllua_time_tm_cache.valid = true;
+	pllua_time_tm_cache.oid = oid;
+	pllua_time_tm_cache.value = key;
+	pllua_time_tm_cache.tz = tz;
+	*fsec = pllua_time_tm_cache.fsec;
+	return &pllua_time_tm_cache.tm;
+}
+
+/*
+ * Returns true with the value pushed if the fast path handled the field,
+ * false with nothing pushed otherwise. Results must match pllua_time_part
+ * in both value and Lua type.
+ */
+static bool
+pllua_time_fast_part(lua_State *L, pllua_datum *d, Oid oid, const char *part)
+{
+	struct pg_tm *tm;
+	fsec_t		fsec;
+
+	if (oid != DATEOID && oid != TIMESTAMPOID && oid != TIMESTAMPTZOID)
+		return false;
+
+#ifdef HAVE_INT64_TIMESTAMP
+	if (strncmp(part, "epoch", 5) == 0)
+	{
+		int64		epoch = SetEpochTimestamp();
+		int64		ts;
+
+		if (oid == DATEOID)
+		{
+			DateADT		dval = DatumGetDateADT(d->value);
+
+			if (DATE_NOT_FINITE(dval) || !DATE_IN_TIMESTAMP_RANGE(dval))
+				return false;
+			ts = (int64) dval * USECS_PER_DAY;
+		}
+		else
+		{
+			ts = (int64) DatumGetTimestamp(d->value);
+			if (TIMESTAMP_NOT_FINITE(ts))
+				return false;
+		}
+
+		/* only handle the range where the subtraction can't overflow */
+		if (ts >= (PG_INT64_MAX + epoch))
+			return false;
+
+		if (part[5] == '\0')
+			lua_pushnumber(L, (ts - epoch) / 1000000.0);
+		else if (strcmp(part + 5, "_msec") == 0)
+			lua_pushnumber(L, ((ts - epoch) / 1000000.0) * 1000.0);
+		else if (strcmp(part + 5, "_usec") == 0)
+		{
+#ifdef PLLUA_INT8_OK
+			lua_pushinteger(L, (lua_Integer) (ts - epoch));
+#else
+			lua_pushnumber(L, (lua_Number) (ts - epoch));
+#endif
+		}
+		else
+			return false;
+		return true;
+	}
+#endif
+
+	switch (part[0])
+	{
+		case 'y': if (strcmp(part, "year") != 0) return false; break;
+		case 'm': if (strcmp(part, "month") != 0 && strcmp(part, "minute") != 0) return false; break;
+		case 'd': if (strcmp(part, "day") != 0 && strcmp(part, "dow") != 0 && strcmp(part, "doy") != 0) return false; break;
+		case 'h': if (strcmp(part, "hour") != 0) return false; break;
+		case 's': if (strcmp(part, "second") != 0) return false; break;
+		case 'i': if (strcmp(part, "isodow") != 0) return false; break;
+		default:
+			return false;
+	}
+
+	tm = pllua_time_get_tm(d->value, oid, &fsec);
+	if (!tm)
+		return false;
+
+	switch (part[0])
+	{
+		case 'y':
+			/* there is no year 0, just 1 BC and 1 AD */
+			lua_pushinteger(L, (tm->tm_year > 0) ? tm->tm_year : tm->tm_year - 1);
+			break;
+		case 'm':
+			lua_pushinteger(L, (part[1] == 'o') ? tm->tm_mon : tm->tm_min);
+			break;
+		case 'h':
+			lua_pushinteger(L, tm->tm_hour);
+			break;
+		case 's':
+			lua_pushnumber(L, tm->tm_sec + FSEC_T_SCALE(fsec) / 1000000.0);
+			break;
+		case 'i':
+			{
+				int			dow = j2day(date2j(tm->tm_year, tm->tm_mon, tm->tm_mday));
+				lua_pushinteger(L, (dow == 0) ? 7 : dow);
+			}
+			break;
+		case 'd':
+			if (part[1] == 'a')
+				lua_pushinteger(L, tm->tm_mday);
+			else if (part[2] == 'w')
+				lua_pushinteger(L, j2day(date2j(tm->tm_year, tm->tm_mon, tm->tm_mday)));
+			else
+				lua_pushinteger(L, (date2j(tm->tm_year, tm->tm_mon, tm->tm_mday)
+									- date2j(tm->tm_year, 1, 1) + 1));
+			break;
+	}
+
+	return true;
+}
+
+
 static int
 pllua_time_index(lua_State *L)
 {
@@ -1051,6 +1288,8 @@ pllua_time_index(lua_State *L)
 	if (lua_getfield(L, lua_upvalueindex(3), part) != LUA_TNIL)
 		return 1;
 	lua_pop(L, 1);
+	if (pllua_time_fast_part(L, d, oid, part))
+		return 1;
 	return pllua_time_part(L, d, oid, part);
 }
 
@@ -5,9 +5,11 @@
 #include "access/htup_details.h"
 #include "commands/event_trigger.h"
 #include "commands/trigger.h"
+#include "executor/executor.h"
 #include "utils/reltrigger.h"
 #include "utils/rel.h"
 #include "utils/lsyscache.h"
+#include "utils/tuplestore.h"
 
 typedef struct pllua_trigger
 {
@@ -83,6 +85,8 @@ pllua_checkevtrigger(lua_State *L, int nd)
  *  trigger.operation
  *  trigger.level
  *  trigger.relation
+ *  trigger.new_table  - transition tables (pg10+), see below
+ *  trigger.old_table
  *
  * Assigning nil or a new row to trigger.row modifies the result of the
  * trigger, though this is for compatibility and returning a new row or nil
@@ -523,6 +527,294 @@ pllua_push_trigger_args(lua_State *L, TriggerData *td)
 	return nargs;
 }
 
+#if PG_VERSION_NUM >= 100000
+/*
+ * Transition tables.
+ *
+ * trigger.new_table and trigger.old_table give access to the transition
+ * tuplestores of a trigger declared with REFERENCING NEW/OLD TABLE, without
+ * going through SPI. Each call to :rows() or :batches() gets its own read
+ * pointer on the tuplestore, so iterations can be nested or restarted, and
+ * do not disturb SPI queries on the same tables. Tuplestores have no way to
+ * free a read pointer, so those of finished scans are kept for reuse by later
+ * ones (a scan abandoned part way keeps its pointer). Rows are returned as
+ * ordinary composite datums, which are only deformed if their columns are
+ * accessed.
+ *
+ * The objects are only usable for the duration of the trigger call.
+ */
+#define PLLUA_TRIGGER_TABLE_FREE_READPTRS 8
+
+typedef struct pllua_trigger_table
+{
+	pllua_trigger *trig;		/* anchored via the "trigger" user field */
+	bool		is_new;
+	TupleTableSlot *slot;
+	int			nfree;			/* read pointers of finished scans */
+	int			free_readptrs[PLLUA_TRIGGER_TABLE_FREE_READPTRS];
+} pllua_trigger_table;
+
+static Tuplestorestate *
+pllua_trigger_table_store(lua_State *L, pllua_trigger_table *tbl)
+{
+	TriggerData *td = tbl->trig->td;
+	if (!td)
+		luaL_error(L, "cannot access dead trigger object");
+	return tbl->is_new ? td->tg_newtable : td->tg_oldtable;
+}
+
+static int
+pllua_trigger_get_table(lua_State *L, bool is_new)
+{
+	pllua_trigger *obj = pllua_checktrigger(L, 1);
+	Tuplestorestate *ts = is_new ? obj->td->tg_newtable : obj->td->tg_oldtable;
+	pllua_trigger_table *tbl;
+	MemoryContext mcxt;
+
+	if (!ts)
+		return 0;
+
+	lua_settop(L, 1);
+	tbl = pllua_newobject(L, PLLUA_TRIGGER_TABLE_OBJECT,
+						  sizeof(pllua_trigger_table), true);
+	tbl->trig = obj;
+	tbl->is_new = is_new;
+	tbl->slot = NULL;
+	tbl->nfree = 0;
+	lua_pushvalue(L, 1);
+	pllua_set_user_field(L, 2, "trigger");
+	mcxt = pllua_newmemcontext(L, "pllua transition table context",
+							   ALLOCSET_SMALL_SIZES);
+	pllua_set_user_field(L, 2, "mcxt");
+
+	PLLUA_TRY();
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(mcxt);
+		/* unrefcounted copy, so the slot holds no resource owner pin */
+		TupleDesc	tupdesc = CreateTupleDescCopy(obj->td->tg_relation->rd_att);
+
+		tbl->slot = pllua_make_minimal_slot(tupdesc);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	return 1;
+}
+
+static int
+pllua_trigger_get_new_table(lua_State *L)
+{
+	return pllua_trigger_get_table(L, true);
+}
+
+static int
+pllua_trigger_get_old_table(lua_State *L)
+{
+	return pllua_trigger_get_table(L, false);
+}
+
+/*
+ * Fetch the next tuple for the given read pointer and push it as a row datum,
+ * with the row typeinfo on top of the stack as for pllua_trigger_getrow.
+ * Returns false, leaving the stack unchanged, at the end.
+ *
+ * The slot just points at the tuplestore's minimal tuple, and we build the
+ * composite datum from that with a single copy: the same result as
+ * heap_tuple_from_minimal_tuple followed by heap_copy_tuple_as_datum, minus
+ * the intermediate tuple. Only tuples with external toasted values, which
+ * need flattening, go the long way.
+ */
+static bool
+pllua_trigger_table_fetch(lua_State *L, pllua_trigger_table *tbl, int readptr)
+{
+	Tuplestorestate *ts = pllua_trigger_table_store(L, tbl);
+	TupleDesc	tupdesc = tbl->trig->td->tg_relation->rd_att;
+	pllua_datum *d = pllua_newdatum(L, -1, (Datum)0);
+	volatile bool found = false;
+
+	PLLUA_TRY();
+	{
+		tuplestore_select_read_pointer(ts, readptr);
+		if (tuplestore_gettupleslot(ts, true, false, tbl->slot))
+		{
+			MemoryContext oldcontext = MemoryContextSwitchTo(pllua_get_memory_cxt(L));
+			MinimalTuple mtup = pllua_slot_minimal_tuple(tbl->slot);
+
+			if (mtup->t_infomask & HEAP_HASEXTERNAL)
+			{
+				HeapTuple	htup = heap_tuple_from_minimal_tuple(mtup);
+
+				d->value = heap_copy_tuple_as_datum(htup, tupdesc);
+				heap_freetuple(htup);
+			}
+			else
+			{
+				uint32		len = mtup->t_len + MINIMAL_TUPLE_OFFSET;
+				HeapTupleHeader td = palloc(len);
+
+				memcpy((char *) td + MINIMAL_TUPLE_OFFSET, mtup, mtup->t_len);
+				HeapTupleHeaderSetDatumLength(td, len);
+				HeapTupleHeaderSetTypeId(td, tupdesc->tdtypeid);
+				HeapTupleHeaderSetTypMod(td, tupdesc->tdtypmod);
+				ItemPointerSetInvalid(&td->t_ctid);
+				d->value = PointerGetDatum(td);
+			}
+			d->need_gc = 1;
+			MemoryContextSwitchTo(oldcontext);
+			ExecClearTuple(tbl->slot);
+			found = true;
+		}
+	}
+	PLLUA_CATCH_RETHROW();
+
+	if (!found)
+		lua_pop(L, 1);
+	return found;
+}
+
+/*
+ * Start a new scan of the table at index 1, pushing the values that the
+ * iterator closures take as upvalues 1-3: the table object, the read pointer
+ * and the row typeinfo.
+ */
+static void
+pllua_trigger_table_scan(lua_State *L)
+{
+	pllua_trigger_table *tbl = pllua_checkobject(L, 1, PLLUA_TRIGGER_TABLE_OBJECT);
+	Tuplestorestate *ts = pllua_trigger_table_store(L, tbl);
+	volatile int readptr = -1;
+
+	PLLUA_TRY();
+	{
+		if (tbl->nfree > 0)
+			readptr = tbl->free_readptrs[--tbl->nfree];
+		else
+			readptr = tuplestore_alloc_read_pointer(ts, EXEC_FLAG_REWIND);
+		tuplestore_select_read_pointer(ts, readptr);
+		tuplestore_rescan(ts);
+	}
+	PLLUA_CATCH_RETHROW();
+
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, readptr);
+	pllua_get_user_field(L, 1, "trigger");
+	lua_getuservalue(L, -1);
+	pllua_trigger_get_typeinfo(L, tbl->trig, -1);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+/*
+ * Called by the iterators on reaching the end: keep the read pointer for
+ * reuse, and mark the iterator finished.
+ */
+static void
+pllua_trigger_table_endscan(lua_State *L, pllua_trigger_table *tbl, int readptr)
+{
+	if (tbl->nfree < PLLUA_TRIGGER_TABLE_FREE_READPTRS)
+		tbl->free_readptrs[tbl->nfree++] = readptr;
+	lua_pushinteger(L, -1);
+	lua_replace(L, lua_upvalueindex(2));
+}
+
+static int
+pllua_trigger_table_rows_iter(lua_State *L)
+{
+	pllua_trigger_table *tbl = pllua_checkobject(L, lua_upvalueindex(1),
+												 PLLUA_TRIGGER_TABLE_OBJECT);
+	int			readptr = (int) lua_tointeger(L, lua_upvalueindex(2));
+
+	if (readptr < 0)
+		return 0;
+	lua_pushvalue(L, lua_upvalueindex(3));
+	if (!pllua_trigger_table_fetch(L, tbl, readptr))
+	{
+		pllua_trigger_table_endscan(L, tbl, readptr);
+		return 0;
+	}
+	return 1;
+}
+
+static int
+pllua_trigger_table_batches_iter(lua_State *L)
+{
+	pllua_trigger_table *tbl = pllua_checkobject(L, lua_upvalueindex(1),
+												 PLLUA_TRIGGER_TABLE_OBJECT);
+	int			readptr = (int) lua_tointeger(L, lua_upvalueindex(2));
+	lua_Integer	batchsize = lua_tointeger(L, lua_upvalueindex(4));
+	lua_Integer	i;
+
+	if (readptr < 0)
+		return 0;
+	lua_settop(L, 0);
+	lua_createtable(L, (int) batchsize, 0);
+	lua_pushvalue(L, lua_upvalueindex(3));
+	for (i = 1; i <= batchsize; ++i)
+	{
+		if (!pllua_trigger_table_fetch(L, tbl, readptr))
+		{
+			pllua_trigger_table_endscan(L, tbl, readptr);
+			break;
+		}
+		lua_rawseti(L, 1, i);
+	}
+	if (i == 1)
+		return 0;
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+ * for row in trigger.new_table:rows() do ... end
+ */
+static int
+pllua_trigger_table_rows(lua_State *L)
+{
+	lua_settop(L, 1);
+	pllua_trigger_table_scan(L);
+	lua_pushcclosure(L, pllua_trigger_table_rows_iter, 3);
+	return 1;
+}
+
+/*
+ * for batch in trigger.new_table:batches(n) do ... end
+ *
+ * Each batch is a table of up to n rows (default 1000).
+ */
+static int
+pllua_trigger_table_batches(lua_State *L)
+{
+	lua_Integer	batchsize = luaL_optinteger(L, 2, 1000);
+	if (batchsize < 1 || batchsize > INT_MAX)
+		luaL_argerror(L, 2, "batch size out of range");
+	lua_settop(L, 1);
+	pllua_trigger_table_scan(L);
+	lua_pushinteger(L, batchsize);
+	lua_pushcclosure(L, pllua_trigger_table_batches_iter, 4);
+	return 1;
+}
+
+static int
+pllua_trigger_table_len(lua_State *L)
+{
+	pllua_trigger_table *tbl = pllua_checkobject(L, 1, PLLUA_TRIGGER_TABLE_OBJECT);
+	Tuplestorestate *ts = pllua_trigger_table_store(L, tbl);
+	lua_pushinteger(L, (lua_Integer) tuplestore_tuple_count(ts));
+	return 1;
+}
+
+static struct luaL_Reg triggertable_methods[] = {
+	{ "rows", pllua_trigger_table_rows },
+	{ "batches", pllua_trigger_table_batches },
+	{ NULL, NULL }
+};
+
+static struct luaL_Reg triggertable_mt[] = {
+	{ "__len", pllua_trigger_table_len },
+	{ NULL, NULL }
+};
+#endif
+
 static struct luaL_Reg triggerobj_keys[] = {
 	{ "new", pllua_trigger_get_new },
 	{ "old", pllua_trigger_get_old },
@@ -531,6 +823,10 @@ static struct luaL_Reg triggerobj_keys[] = {
 	{ "operation", pllua_trigger_get_operation },
 	{ "level", pllua_trigger_get_level },
 	{ "relation", pllua_trigger_get_relation },
+#if PG_VERSION_NUM >= 100000
+	{ "new_table", pllua_trigger_get_new_table },
+	{ "old_table", pllua_trigger_get_old_table },
+#endif
 	{ NULL, NULL }
 };
 
@@ -575,6 +871,14 @@ int pllua_open_trigger(lua_State *L)
 	pllua_newmetatable(L, PLLUA_EVENT_TRIGGER_OBJECT, evtriggerobj_mt);
 	lua_pop(L,1);
 
+#if PG_VERSION_NUM >= 100000
+	pllua_newmetatable(L, PLLUA_TRIGGER_TABLE_OBJECT, triggertable_mt);
+	lua_newtable(L);
+	luaL_setfuncs(L, triggertable_methods, 0);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L,1);
+#endif
+
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -759,6 +759,7 @@ static struct module_info sandbox_packages_late[] = {
 	{ "pllua.numeric",		NULL,	"copy",		NULL			},
 	{ "pllua.jsonb",		NULL,	"copy",		NULL			},
 	{ "pllua.time",			NULL,	"copy",		NULL			},
+	{ "pllua.stats",		NULL,	"copy",		NULL			},
 	{ NULL, NULL, NULL, NULL }
 };
 
@@ -0,0 +1,56 @@
+#!/bin/sh
+
+# Run the benchmark suite in bench/ against an installed pllua.
+#
+# usage: bench.sh benchdir
+#
+# Environment:
+#   PSQL            psql command (default: psql)
+#   BENCH_DB        database to (re)create and run in (default: pllua_bench)
+#   BENCH_REPS      repetitions of each case (default: 5)
+#   BENCH_OUT       output file (default: bench.out)
+#   BENCH_BASELINE  output file of an earlier run to compare against
+#
+# Connection parameters are taken from the usual PG* variables. The output
+# is tab-separated, one line per case: name, samples, min_ms, median_ms,
+# max_ms. With a baseline, a second file $BENCH_OUT.cmp is written with
+# name, median_ms, baseline_ms, ratio.
+
+benchdir="${1:?usage: bench.sh benchdir}"
+
+PSQL="${PSQL:-psql}"
+BENCH_DB="${BENCH_DB:-pllua_bench}"
+BENCH_REPS="${BENCH_REPS:-5}"
+BENCH_OUT="${BENCH_OUT:-bench.out}"
+
+run_psql() {
+    "$PSQL" -X -q -v ON_ERROR_STOP=1 "$@"
+}
+
+run_psql -d postgres -c "drop database if exists \"$BENCH_DB\"" || exit 1
+run_psql -d postgres -c "create database \"$BENCH_DB\"" || exit 1
+
+run_psql -d "$BENCH_DB" -f "$benchdir/setup.sql" >/dev/null || exit 1
+run_psql -d "$BENCH_DB" -v reps="$BENCH_REPS" \
+	 -f "$benchdir/cases.sql" >/dev/null || exit 1
+
+i=0
+while [ "$i" -lt "$BENCH_REPS" ]; do
+    run_psql -d "$BENCH_DB" -f "$benchdir/cold_start.sql" >/dev/null || exit 1
+    i=$(expr "$i" + 1)
+done
+
+run_psql -d "$BENCH_DB" -A -t -F "	" \
+	 -c "select * from pllua_bench.report()" >"$BENCH_OUT" || exit 1
+
+if [ -n "$BENCH_BASELINE" ]; then
+    run_psql -d "$BENCH_DB" -A -t -F "	" >"$BENCH_OUT.cmp" <<EOF || exit 1
+\\copy pllua_bench.baseline from '$BENCH_BASELINE'
+select * from pllua_bench.compare();
+EOF
+    cat -- "$BENCH_OUT.cmp"
+else
+    cat -- "$BENCH_OUT"
+fi
+
+exit 0